@@ -0,0 +1,233 @@
+// End-to-end inhibit benchmark against a private dbus-daemon.
+//
+// For each D-Bus interface (implementing it ourselves, and monitoring someone else implementing
+// it) N clients each run Inhibit/UnInhibit pairs as fast as they get replies. Latency is from a
+// client sending a call to our inhibit/uninhibit callback seeing it, which is where uinhibitd
+// forwards to everyone else.
+//
+// Usage: build/bench [clients] [inhibit/uninhibit pairs per client]
+//
+// One key=value line per scenario on stdout, so results can be diffed/compared across releases.
+
+#include "util.hpp"
+#include "InhibitInterface.hpp"
+#include "EventLoop.hpp"
+#include "Stats.hpp"
+#include "Log.hpp"
+#include "DBus.hpp"
+#include "../test/dbusDaemon.hpp"
+#include <sys/resource.h>
+#include <ctime>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <cstring>
+
+#define BENCH_SOCKET "unix:path=/tmp/uibench.sock"
+#define SETTLE_TIMEOUT_MS 10000
+
+using namespace uinhibit;
+
+typedef std::function<void(InhibitInterface*, Inhibit)> InhibitCB;
+
+struct Target {
+  const char* name;
+  const char* path;
+  const char* unInhibitMember;
+  bool gnome; // Inhibit(s app, u xid, s reason, u flags) rather than Inhibit(s app, s reason)
+  std::function<InhibitInterface*(InhibitCB, InhibitCB)> construct;
+};
+
+static const std::vector<Target> targets = {
+  {"org.freedesktop.ScreenSaver", "/ScreenSaver", "UnInhibit", false,
+   [](auto a, auto b) { return new FreedesktopScreenSaverInhibitInterface(a, b); }},
+  {"org.freedesktop.PowerManager", "/PowerManager", "UnInhibit", false,
+   [](auto a, auto b) { return new FreedesktopPowerManagerInhibitInterface(a, b); }},
+  {"org.gnome.SessionManager", "/org/gnome/SessionManager", "Uninhibit", true,
+   [](auto a, auto b) { return new GnomeSessionManagerInhibitInterface(a, b); }},
+  {"org.mate.ScreenSaver", "/org/mate/ScreenSaver", "UnInhibit", false,
+   [](auto a, auto b) { return new MateScreenSaverInhibitInterface(a, b); }},
+};
+
+// Drives an InhibitInterface's start() in its own thread, the same way uinhibitd's main loop does
+class LoopThread {
+  public:
+    LoopThread(InhibitInterface* i) : inhibitor(i) {
+      tr = std::jthread([this](std::stop_token stop) {
+        EventLoop loop;
+        auto ro = this->inhibitor->start();
+        loop.add(&this->inhibitor->waitSet, ro.handle);
+
+        timespec begin;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &begin);
+        while (!stop.stop_requested()) {
+          loop.runOnce(10);
+          timespec now;
+          clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+          this->cpuUS = (now.tv_sec-begin.tv_sec)*1000000 + (now.tv_nsec-begin.tv_nsec)/1000;
+        }
+      });
+    }
+
+    InhibitInterface* inhibitor;
+    std::atomic<int64_t> cpuUS = 0;
+    std::jthread tr;
+};
+
+// Until name has an owner (or has none, if !owned). Exits if that doesn't happen within
+// SETTLE_TIMEOUT_MS, since every number after that would be meaningless.
+static void waitForOwner(DBus& dbus, const char* name, bool owned) {
+  int64_t deadline = monotonicMS()+SETTLE_TIMEOUT_MS;
+  while (dbus.getNameOwner(name).empty() == owned) {
+    if (monotonicMS() >= deadline) {
+      fprintf(stderr, "%s still %s\n", name, owned ? "has no owner" : "owned");
+      exit(1);
+    }
+    usleep(1000);
+  }
+}
+
+struct Result {
+  uint64_t ops = 0;
+  uint64_t errors = 0;
+  int64_t wallUS = 0;
+  int64_t cpuUS = 0;
+  Histogram latencyUS;
+};
+
+static void runScenario(const Target& t, bool monitor, uint32_t clients, uint32_t pairs,
+                        Result& res) {
+  uint64_t total = (uint64_t)clients*pairs;
+
+  // Send times, indexed by the number in the appname
+  std::unique_ptr<std::atomic<int64_t>[]> sentInhibit(new std::atomic<int64_t>[total]);
+  std::unique_ptr<std::atomic<int64_t>[]> sentUnInhibit(new std::atomic<int64_t>[total]);
+  std::atomic<uint64_t> seen = 0;
+
+  auto latency = [&](std::unique_ptr<std::atomic<int64_t>[]>& sent, const Inhibit& in) {
+    if (in.appname.rfind("bench-", 0) != 0) return;
+    uint64_t n = strtoull(in.appname.c_str()+6, NULL, 10);
+    if (n >= total) return;
+    res.latencyUS.record(monotonicUS()-sent[n].load(std::memory_order_acquire));
+    seen++;
+  };
+
+  // Whoever implemented it last scenario must be gone, or we'd monitor them instead
+  DBus control(DBUS_BUS_SESSION);
+  waitForOwner(control, t.name, false);
+
+  std::unique_ptr<InhibitInterface> implementer;
+  std::unique_ptr<LoopThread> implementerLoop;
+  if (monitor) {
+    implementer.reset(t.construct([](auto a, auto b){}, [](auto a, auto b){}));
+    implementerLoop = std::make_unique<LoopThread>(implementer.get());
+    waitForOwner(control, t.name, true);
+  }
+
+  std::unique_ptr<InhibitInterface> measured(t.construct(
+    [&](auto a, Inhibit in) { latency(sentInhibit, in); },
+    [&](auto a, Inhibit in) { latency(sentUnInhibit, in); }));
+  auto measuredLoop = std::make_unique<LoopThread>(measured.get());
+  waitForOwner(control, t.name, true);
+
+  std::atomic<uint64_t> ops = 0, errors = 0;
+  int64_t begin = monotonicUS();
+  {
+    std::vector<std::jthread> threads;
+    for (uint32_t c = 0; c < clients; c++) threads.emplace_back([&, c] {
+      DBus dbus(DBUS_BUS_SESSION);
+
+      for (uint32_t p = 0; p < pairs; p++) {
+        uint64_t n = (uint64_t)c*pairs+p;
+        std::string appnameStr = "bench-"+std::to_string(n);
+        const char* appname = appnameStr.c_str();
+        const char* reason = "bench";
+        uint32_t xid = 0, flags = 8, cookie = 0;
+
+        try {
+          auto call = dbus.newMethodCall(t.name, t.path, t.name, "Inhibit");
+          if (t.gnome) call.appendArgs(DBUS_TYPE_STRING, &appname, DBUS_TYPE_UINT32, &xid,
+                                       DBUS_TYPE_STRING, &reason, DBUS_TYPE_UINT32, &flags,
+                                       DBUS_TYPE_INVALID);
+          else call.appendArgs(DBUS_TYPE_STRING, &appname, DBUS_TYPE_STRING, &reason,
+                               DBUS_TYPE_INVALID);
+
+          sentInhibit[n].store(monotonicUS(), std::memory_order_release);
+          auto r = call.sendAwait(1000);
+          r.getArgs(DBUS_TYPE_UINT32, &cookie, DBUS_TYPE_INVALID);
+          ops++;
+
+          sentUnInhibit[n].store(monotonicUS(), std::memory_order_release);
+          dbus.newMethodCall(t.name, t.path, t.name, t.unInhibitMember)
+            .appendArgs(DBUS_TYPE_UINT32, &cookie, DBUS_TYPE_INVALID)
+            ->sendAwait(1000);
+          ops++;
+        } catch (DBus::Exception& e) { errors++; }
+      }
+    });
+  } // Joins
+
+  // Calls are done, wait for the callbacks to catch up
+  int64_t deadline = monotonicMS()+SETTLE_TIMEOUT_MS;
+  while (seen < 2*total && monotonicMS() < deadline) usleep(100);
+  res.wallUS = monotonicUS()-begin;
+
+  res.ops = ops;
+  res.errors = errors + (2*total-seen);
+  res.cpuUS = measuredLoop->cpuUS;
+
+  measuredLoop.reset();
+  measured.reset();
+  implementerLoop.reset();
+  implementer.reset();
+}
+
+static void exitHandler() {
+  stopDbusDaemons();
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t clients = (argc > 1) ? atoi(argv[1]) : 8;
+  uint32_t pairs = (argc > 2) ? atoi(argv[2]) : 250;
+  if (clients == 0 || pairs == 0) {
+    printf("Usage: %s [clients] [inhibit/uninhibit pairs per client]\n", argv[0]);
+    return 1;
+  }
+
+  atexit(exitHandler);
+  std::set_terminate(exitHandler);
+
+  if (setenv("DBUS_SESSION_BUS_ADDRESS", BENCH_SOCKET, 1) == -1) {
+    printf("Failed to setenv()\n");
+    exit(1);
+  };
+
+  startDbusDaemon(BENCH_SOCKET, 600);
+
+  Log::configure(LogLevel::ERROR, Log::Format::PLAIN, false); // Keep stdout for results
+
+  for (auto& t : targets) {
+    for (bool monitor : {false, true}) {
+      Result res;
+      runScenario(t, monitor, clients, pairs, res);
+
+      // Peak for the whole process (client threads included) so far, not just this scenario
+      rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+
+      printf("interface=%s mode=%s clients=%u ops=%lu errors=%lu ops_per_sec=%.0f"
+             " p50_us=%lu p99_us=%lu p999_us=%lu cpu_ms=%.1f cpu_us_per_op=%.1f"
+             " process_peak_rss_kb=%ld\n",
+             t.name, monitor ? "monitor" : "implement", clients, res.ops, res.errors,
+             res.ops/(res.wallUS/1000000.0),
+             res.latencyUS.percentile(50), res.latencyUS.percentile(99),
+             res.latencyUS.percentile(99.9),
+             res.cpuUS/1000.0, res.ops ? (double)res.cpuUS/res.ops : 0.0,
+             usage.ru_maxrss);
+      fflush(stdout);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,250 @@
+// Micro-benchmarks for the primitives on uinhibitd's data path: inhibit ID construction, the
+// activeInhibits bookkeeping, D-Bus method dispatch, fork message framing and type conversion.
+//
+// Anything whose cost could depend on how many inhibits are around is run with n = 1 to 10000 of
+// them, so we can see it stays flat. Pure conversions have no n.
+//
+// Usage: build/microbench [milliseconds per benchmark]
+//
+// One key=value line per benchmark on stdout, same as build/bench.
+
+#include "util.hpp"
+#include "InhibitInterface.hpp"
+#include "Fork.hpp"
+#include "Log.hpp"
+#include "../test/dbusDaemon.hpp"
+#include <chrono>
+#include <functional>
+#include <memory>
+
+#define MICROBENCH_SOCKET "unix:path=/tmp/uimicrobench.sock"
+
+using namespace uinhibit;
+
+static const int64_t counts[] = {1, 10, 100, 1000, 10000};
+static int64_t budgetNS = 100*1000*1000;
+
+// Stops the compiler from optimizing away a result we never use
+template <typename T> static inline void keep(T&& v) {
+  asm volatile("" : : "g"(&v) : "memory");
+}
+
+// Runs fn(iterations) with growing iteration counts until one run takes at least budgetNS
+static void run(const char* name, int64_t n, const std::function<void(uint64_t)>& fn) {
+  uint64_t iterations = 1;
+  int64_t ns = 0;
+
+  while (true) {
+    auto begin = std::chrono::steady_clock::now();
+    fn(iterations);
+    ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+      (std::chrono::steady_clock::now()-begin).count();
+
+    if (ns >= budgetNS || iterations >= (1ull << 40)) break;
+    // Aim a little past the budget, but never grow more than 10x per round
+    uint64_t next = (ns > 0) ? (uint64_t)(iterations*(budgetNS*1.2/ns)) : iterations*10;
+    iterations = std::max(iterations+1, std::min(next, iterations*10));
+  }
+
+  if (n >= 0) printf("name=%s n=%ld iterations=%lu ns_per_op=%.1f\n", name, n, iterations,
+                     (double)ns/iterations);
+  else printf("name=%s iterations=%lu ns_per_op=%.1f\n", name, iterations, (double)ns/iterations);
+  fflush(stdout);
+}
+
+// The protected bits of the interfaces we benchmark, so everything goes through the same API
+// their subclasses use
+class BenchMate : public MateScreenSaverInhibitInterface {
+  public:
+    using MateScreenSaverInhibitInterface::MateScreenSaverInhibitInterface;
+    using SimpleDBusInhibitInterface::mkId;
+    using InhibitInterface::registerInhibit;
+    using InhibitInterface::registerUnInhibit;
+    using DBusInhibitInterface::dbus;
+    using DBusInhibitInterface::methodTable;
+    using DBusInhibitInterface::memberRef;
+};
+
+class BenchSxmo : public SxmoInhibitInterface {
+  public:
+    using SxmoInhibitInterface::SxmoInhibitInterface;
+    using SxmoInhibitInterface::mkId;
+    using SxmoInhibitInterface::mkToken;
+};
+
+class BenchSystemd : public SystemdInhibitInterface {
+  public:
+    using SystemdInhibitInterface::systemdType2us;
+    using SystemdInhibitInterface::us2systemdType;
+};
+
+static Inhibit mkInhibit(BenchMate& i, std::string_view sender, uint32_t cookie) {
+  Inhibit in = {};
+  in.type = InhibitType::SCREENSAVER;
+  in.appname = "org.example.App";
+  in.reason = "Playing video";
+  in.id = i.mkId(sender, cookie);
+  return in;
+}
+
+// Fills i with n active inhibits from n different senders, returning their IDs
+static std::vector<InhibitID> fill(BenchMate& i, int64_t n) {
+  for (auto& [id, in] : std::unordered_map(i.activeInhibits)) {
+    InhibitID release = id;
+    i.registerUnInhibit(release);
+  }
+
+  std::vector<InhibitID> ids;
+  for (int64_t k = 0; k < n; k++) {
+    auto in = mkInhibit(i, ":1."+std::to_string(k), k+1);
+    i.registerInhibit(in);
+    ids.push_back(in.id);
+  }
+  return ids;
+}
+
+static void encodeInhibit(std::string& buf, uint32_t id) {
+  Fork::encode(buf, SystemdInhibitFork::INHIBIT, id, 0,
+               {"idle:sleep", "org.example.App", "Playing video", "block"});
+}
+
+static void inhibitCount(BenchMate& mate, int64_t n) {
+  std::vector<std::string> senders;
+  for (int64_t k = 0; k < n; k++) senders.push_back(":1."+std::to_string(k));
+
+  run("mkid_simple_dbus", n, [&](uint64_t iterations) {
+    size_t k = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+      keep(mate.mkId(senders[k], i));
+      if (++k == senders.size()) k = 0;
+    }
+  });
+
+  std::vector<std::string> tokens;
+  for (int64_t k = 0; k < n; k++) tokens.push_back("App - reason "+std::to_string(k));
+  BenchSxmo sxmo([](auto a, auto b){}, [](auto a, auto b){});
+
+  run("mkid_sxmo", n, [&](uint64_t iterations) {
+    size_t k = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+      keep(sxmo.mkId(tokens[k]));
+      if (++k == tokens.size()) k = 0;
+    }
+  });
+
+  auto ids = fill(mate, n);
+  auto extra = mkInhibit(mate, ":2.0", 1);
+
+  run("active_lookup", n, [&](uint64_t iterations) {
+    size_t k = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+      keep(mate.activeInhibits.find(ids[k]));
+      if (++k == ids.size()) k = 0;
+    }
+  });
+
+  run("register_inhibit_uninhibit", n, [&](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+      Inhibit in = extra;
+      mate.registerInhibit(in);
+      mate.registerUnInhibit(in.id);
+    }
+  });
+
+  run("inhibited", n, [&](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) keep(mate.inhibited());
+  });
+
+  std::string buf;
+  run("fork_queue", n, [&](uint64_t iterations) {
+    int64_t k = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+      encodeInhibit(buf, i);
+      if (++k == n) { buf.clear(); k = 0; }
+    }
+    buf.clear();
+  });
+
+  // n messages buffered at once, as if they all arrived in one read
+  for (int64_t k = 0; k < n; k++) encodeInhibit(buf, k);
+
+  run("fork_parse", n, [&](uint64_t iterations) {
+    ForkMessage msg;
+    size_t pos = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+      if (pos == buf.size()) pos = 0; // Drained, rewind
+      pos += Fork::decode(buf.data()+pos, buf.size()-pos, msg);
+      keep(msg);
+    }
+  });
+}
+
+static void pure(BenchMate& mate) {
+  const char* name = "org.mate.ScreenSaver";
+  const char* path = "/org/mate/ScreenSaver";
+  std::vector<DBus::Message> msgs;
+  msgs.push_back(mate.dbus.newMethodCall(name, path, name, "Inhibit"));
+  msgs.push_back(mate.dbus.newMethodCall(name, path, name, "UnInhibit"));
+  msgs.push_back(mate.dbus.newMethodCall(name, "/", "org.freedesktop.DBus.Introspectable",
+                                         "Introspect"));
+  msgs.push_back(mate.dbus.newMethodCall(name, path, "org.example.NotOurs", "Inhibit")); // Miss
+
+  run("dbus_dispatch", -1, [&](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++)
+      keep(mate.methodTable.find(BenchMate::memberRef(msgs[i%msgs.size()])));
+  });
+
+  const std::string whats[] = {"idle", "sleep", "idle:sleep",
+                               "shutdown:sleep:idle:handle-lid-switch"};
+  run("systemd_type2us", -1, [&](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++)
+      keep(BenchSystemd::systemdType2us(whats[i%4]));
+  });
+
+  const InhibitType types[] = {InhibitType::SCREENSAVER, InhibitType::SUSPEND,
+                               (InhibitType)(InhibitType::SCREENSAVER|InhibitType::SUSPEND)};
+  run("us2systemd_type", -1, [&](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++)
+      keep(BenchSystemd::us2systemdType(types[i%3]));
+  });
+
+  run("sxmo_mktoken", -1, [&](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++)
+      keep(BenchSxmo::mkToken("org.example.App", "Playing \"video\""));
+  });
+}
+
+static void exitHandler() {
+  stopDbusDaemons();
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1) {
+    int64_t ms = atoll(argv[1]);
+    if (ms <= 0) {
+      printf("Usage: %s [milliseconds per benchmark]\n", argv[0]);
+      return 1;
+    }
+    budgetNS = ms*1000*1000;
+  }
+
+  atexit(exitHandler);
+  std::set_terminate(exitHandler);
+
+  // D-Bus interfaces need a bus to construct, but we never send anything over it
+  if (setenv("DBUS_SESSION_BUS_ADDRESS", MICROBENCH_SOCKET, 1) == -1) {
+    printf("Failed to setenv()\n");
+    exit(1);
+  };
+
+  startDbusDaemon(MICROBENCH_SOCKET, 600);
+
+  Log::configure(LogLevel::ERROR, Log::Format::PLAIN, false); // Keep stdout for results
+
+  BenchMate mate([](auto a, auto b){}, [](auto a, auto b){});
+
+  for (auto n : counts) inhibitCount(mate, n);
+  pure(mate);
+
+  return 0;
+}
@@ -20,6 +20,10 @@
 #include <vector>
 #include <functional>
 #include <cstring>
+#include <mutex>
+#include <poll.h>
+#include <unordered_map>
+#include <unordered_set>
 
 // Thin libdbus wrapper
 //
@@ -144,16 +148,25 @@ class DBus {
 
     void throwErrAndFree();
 
-    // Wraps a DBusMessage to have a constructor->destructor lifecycle
-    class UniqueMessage {
-      public:
-        DBusMessage* msg;
-        UniqueMessage(DBusMessage* msg) : msg(msg) {};
-        ~UniqueMessage() { if (this->msg != nullptr) dbus_message_unref(this->msg); }
+    struct Credentials {
+      uint32_t pid = 0;
+      uint32_t uid = 0;
     };
 
+    // Owns one reference to a DBusMessage, using libdbus's own refcount (no allocation of our
+    // own). Move-only: ref() if you really need a second handle on the same message.
     class Message {
       public:
+        Message() = default; // Null
+        Message(DBusMessage* msg, DBus* dbus); // Takes over the caller's reference
+        Message(Message&& o) noexcept;
+        Message& operator=(Message&& o) noexcept;
+        Message(const Message&) = delete;
+        Message& operator=(const Message&) = delete;
+        ~Message();
+
+        Message ref();
+
         bool isNull();
         bool notNull();
         void getArgs(int32_t firstArgType, ...);
@@ -163,8 +176,7 @@ class DBus {
         const char* interface();
         const char* member();
         const char* path();
-        uint32_t senderPID();
-        uint32_t senderUID();
+        void senderCredentials(std::function<void(Credentials)> cb); // See DBus::getCredentials()
         uint32_t serial();
         uint32_t replySerial();
         Message newMethodReturn();
@@ -173,22 +185,46 @@ class DBus {
         void send(uint32_t serial);
         Message sendAwait(int32_t timeout);
 
-        std::shared_ptr<UniqueMessage> msg;
-        DBus* dbus;
+        // Send without blocking for the reply. cb is called from dispatch() with the reply, or a
+        // null Message if the call failed or there was no reply within timeout (ms).
+        void sendAsync(int32_t timeout, std::function<void(Message reply)> cb);
 
-        Message(std::shared_ptr<UniqueMessage> msg, DBus* dbus);
+        DBusMessage* msg = nullptr;
+        DBus* dbus = nullptr;
     };
 
     DBus(DBusBusType type);
     ~DBus();
     void reconnect();
     bool nameHasOwner(const char* name);
+    std::string getNameOwner(const char* name); // Unique name, empty if nobody owns it
     int32_t requestName(const char* name, uint32_t flags);
     const char* getUniqueName();
     void addMatch(const char* rule);
     void readWrite(int32_t timeoutMS);
     void readWriteDispatch(int32_t timeoutMS);
+    bool dataRemains(); // Messages are waiting in our incoming queue (no need to read the socket)
+
+    // fds (with poll() events) libdbus currently wants watched for this connection, for
+    // integrating with an event loop. Call readWrite(0) once any of them are ready.
+    std::vector<pollfd> pollFds();
+
+    // ms until handleTimeouts() should next be called, -1 for never. libdbus uses these for
+    // sendAsync() reply timeouts.
+    int32_t timeoutMS();
+    void handleTimeouts();
+
+    void dispatch(); // Dispatch everything in our incoming queue (runs sendAsync() callbacks)
+
+    // Credentials of the connection with unique name `name`, with a single GetConnectionCredentials
+    // call. Never blocks: cb is called right away if they're cached, otherwise once the reply
+    // arrives (from popMessage()/dispatch()). Zeroed if the lookup fails or times out.
+    //
+    // Cached until NameOwnerChanged tells us the name has gone away.
+    void getCredentials(const char* name, std::function<void(Credentials)> cb);
+    const char* credentialsService = DBUS_SERVICE_DBUS; // Who getCredentials() asks (for tests)
     void flush();
+    bool hasMessagesToSend(); // Outgoing messages libdbus hasn't written to the socket yet
     Message popMessage();
     Message newMethodCall(const char* destination,
                           const char* path,
@@ -207,4 +243,29 @@ class DBus {
     DBusConnection* conn;
     DBusError err;
     DBusBusType type;
+
+  private:
+    void setWatchFunctions();
+    static dbus_bool_t addWatch(DBusWatch* watch, void* data);
+    static void removeWatch(DBusWatch* watch, void* data);
+    static dbus_bool_t addTimeout(DBusTimeout* timeout, void* data);
+    static void removeTimeout(DBusTimeout* timeout, void* data);
+    static void toggleTimeout(DBusTimeout* timeout, void* data);
+
+    struct Timeout {
+      DBusTimeout* timeout;
+      int64_t deadlineMS; // CLOCK_MONOTONIC
+    };
+
+    std::mutex watchesMutex;
+    std::vector<DBusWatch*> watches; // under watchesMutex
+    std::vector<Timeout> timeouts; // under watchesMutex
+
+    std::unordered_set<uint32_t> asyncSerials; // sendAsync() calls awaiting their reply
+    std::unordered_map<std::string, Credentials> credentials; // unique name, credentials
+    std::unordered_map<std::string, std::vector<std::function<void(Credentials)>>>
+      credentialWaiters; // unique name, callbacks waiting on its lookup
+    bool watchingNameOwners = false;
+    void handleNameOwnerChanged(DBusMessage* msg);
+    static Credentials parseCredentials(DBusMessage* reply);
 };
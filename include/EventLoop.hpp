@@ -0,0 +1,113 @@
+// Copyright (C) 2022 Matthew Egeler
+//
+// This file is part of unified-inhibit.
+//
+// unified-inhibit is free software: you can redistribute it and/or modify it under the terms of the
+// GNU General Public License as published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// unified-inhibit is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with unified-inhibit. If
+// not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+#include <poll.h>
+#include <coroutine>
+#include <cstdint>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <unordered_map>
+
+namespace uinhibit {
+  // CLOCK_MONOTONIC in milliseconds
+  int64_t monotonicMS();
+  int64_t monotonicUS(); // Same clock in microseconds
+
+  // The set of fds (and optional deadline) a suspended coroutine is waiting on.
+  //
+  // The set is mirrored into a private epoll instance, so whoever drives the coroutine can wait
+  // on any number of these by watching a single fd each (fd() becomes readable when anything in
+  // the set is ready).
+  class WaitSet {
+    public:
+      WaitSet();
+      ~WaitSet();
+      WaitSet(const WaitSet&) = delete;
+      WaitSet& operator=(const WaitSet&) = delete;
+
+      // Replace the set. events use poll()/epoll flags (POLLIN, POLLOUT).
+      // timeoutMS < 0 waits forever.
+      void set(const std::vector<pollfd>& fds, int64_t timeoutMS);
+
+      int32_t fd();
+      int64_t deadline(); // monotonicMS() time we should be resumed regardless, -1 for none
+
+      // True if something in the set is ready or the deadline has passed.
+      // Blocks for up to timeoutMS (-1 forever, 0 to not block) waiting for that to happen.
+      bool ready(int32_t timeoutMS = 0);
+
+    private:
+      int32_t epollFd = -1;
+      int64_t deadlineMS = -1;
+      std::vector<pollfd> registered;
+  };
+
+  // Callbacks to run once a deadline passes. Not thread-safe.
+  //
+  // Whoever owns this should fold next() into whatever it waits on and call run() when woken.
+  class TimerQueue {
+    public:
+      // Run cb timeoutMS from now. Returns an ID for cancel().
+      uint64_t add(int64_t timeoutMS, std::function<void()> cb);
+      void cancel(uint64_t id); // No-op if already run/cancelled
+
+      int64_t next(); // monotonicMS() deadline of the nearest timer, -1 for none
+      void run();     // Run (and remove) every expired timer
+
+    private:
+      struct Deadline {
+        int64_t deadlineMS;
+        uint64_t id;
+        bool operator>(const Deadline& o) const { return deadlineMS > o.deadlineMS; }
+      };
+
+      // Cancelling only removes from callbacks, stale heap entries are skipped when they surface
+      std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> heap;
+      std::unordered_map<uint64_t, std::function<void()>> callbacks; // id, cb
+      uint64_t lastId = 0;
+  };
+
+  // Resumes coroutines only when something they're waiting on is ready
+  class EventLoop {
+    public:
+      EventLoop();
+      ~EventLoop();
+      EventLoop(const EventLoop&) = delete;
+      EventLoop& operator=(const EventLoop&) = delete;
+
+      // The coroutine must suspend with its wait requirements stored in waitSet
+      void add(WaitSet* waitSet, std::coroutine_handle<> handle);
+
+      // Wait up to timeoutMS (-1 forever) for something to be ready and resume whoever is
+      // waiting on it.
+      void runOnce(int32_t timeoutMS = -1);
+
+      // Make a runOnce() in progress (or the next one) return right away. Thread and
+      // async-signal safe.
+      void interrupt();
+
+    private:
+      struct Entry {
+        WaitSet* waitSet;
+        std::coroutine_handle<> handle;
+      };
+
+      int32_t epollFd = -1;
+      int32_t interruptFd = -1; // eventfd, registered with a null Entry
+      std::vector<Entry*> entries;
+  };
+}
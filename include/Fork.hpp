@@ -2,16 +2,52 @@
 
 #include "DBus.hpp"
 #include <string>
+#include <string_view>
+#include <array>
+#include <vector>
+#include <initializer_list>
 
 namespace uinhibit {
+  // One framed message on a Fork pipe. On the wire (host byte order, both ends are us):
+  //
+  //   uint32 size (of everything after this field), uint8 op, uint8 nFields, uint32 id,
+  //   int32 value, then nFields * {uint32 len, bytes}
+  //
+  // Replies carry the id of the request they answer.
+  struct ForkMessage {
+    uint8_t op = 0;
+    uint32_t id = 0;
+    int32_t value = 0;
+    uint8_t nFields = 0;
+    std::array<std::string_view, 4> fields; // Point into the rx buffer, valid until rxFill()
+  };
+
   class Fork {
     public:
       Fork();
       ~Fork();
 
-      void tx(std::string);
-      std::string rx(); // blocking
-      std::string rxLine(); // blocking
+      // Queue a message, sent along with anything else queued by the next flush()
+      void queue(uint8_t op, uint32_t id, int32_t value,
+                 std::initializer_list<std::string_view> fields = {});
+      void flush(); // One write for everything queued
+      bool txPending(); // Something queued hasn't been flush()ed yet
+      void tx(uint8_t op, uint32_t id, int32_t value,
+              std::initializer_list<std::string_view> fields = {}); // queue() + flush()
+
+      bool rxMessage(ForkMessage& out); // Next complete buffered message, false if none yet
+
+      // The framing queue()/rxMessage() use. encode() appends a message to buf. decode() parses
+      // the one at the front of data, returning its size on the wire, or 0 if it's incomplete.
+      // Both throw on messages we can't (or won't) frame.
+      static void encode(std::string& buf, uint8_t op, uint32_t id, int32_t value,
+                         std::initializer_list<std::string_view> fields = {});
+      static size_t decode(const char* data, size_t size, ForkMessage& out);
+      ForkMessage rxWait(); // blocking, until a whole message is available
+      void rxFill(); // One read into the rx buffer, blocks if nothing's available. Throws on EOF
+
+      int32_t rxFd(); // Readable when rxFill() won't block
+      bool rxReady(); // A message is buffered or rxFill() won't block
 
       void run();
 
@@ -21,42 +57,74 @@ namespace uinhibit {
       bool child = false;
 
     private:
-      int32_t inPipe[2];
-      int32_t outPipe[2];
-      std::string lineBuf;
+      int32_t inPipe[2] = {-1, -1};
+      int32_t outPipe[2] = {-1, -1};
+
+      std::string txBuf;
+
+      // Messages are parsed in place, we only move data when we run out of room at the end
+      std::vector<char> rxBuf = std::vector<char>(64*1024);
+      size_t rxHead = 0;
+      size_t rxTail = 0;
   };
 
-  class NewlineMessageFork : public Fork {
+  class MessageFork : public Fork {
     public:
-      NewlineMessageFork();
+      MessageFork();
       void doRun() override;
 
     protected:
-      // Will always be exactly one line. Excludes the newline.
-      virtual void handleMsg(std::string) = 0;
+      // Replies should be queue()d, they're flushed once everything that arrived with this
+      // message has been handled.
+      virtual void handleMsg(const ForkMessage&) = 0;
+      virtual void batchDone() {}; // Everything from one read has been through handleMsg()
   };
 
-  class SystemdInhibitFork : public NewlineMessageFork {
+  class SystemdInhibitFork : public MessageFork {
     public:
       SystemdInhibitFork();
       void childSetup() override;
 
-      // Inhibit: 'what\twho\twhy\tmode\n' -> '37\n'
-      // Release: '37\n'
-      void handleMsg(std::string) override;
+      enum Op : uint8_t {
+        HELLO,   // -> us, fields {our unique name}
+        INHIBIT, // -> fork, fields {what, who, why, mode}. Replied to with FD, value is the fd
+        RELEASE, // -> fork, value is the fd
+        FD,
+      };
+
+      void handleMsg(const ForkMessage&) override;
 
     private:
       std::unique_ptr<DBus> dbus;
       int32_t call(std::string what, std::string who, std::string why, std::string mode);
   };
 
-  class LinuxKernelInhibitFork : public NewlineMessageFork {
+  class LinuxKernelInhibitFork : public MessageFork {
     public:
       LinuxKernelInhibitFork();
       void childSetup() override;
 
-      // * "lockname\n" to take a lock
-      // * "\tlockname\n" to remove a lock
-      void handleMsg(std::string) override;
+      ~LinuxKernelInhibitFork();
+
+      enum Op : uint8_t {
+        HELLO,  // -> us, value is 1 if we can write wakelocks
+        LOCK,   // -> fork, fields {lockname}. Replied to with RESULT
+        UNLOCK, // -> fork, fields {lockname}. Replied to with RESULT
+        RESULT, // -> us, value is 0 or an errno
+      };
+
+      void handleMsg(const ForkMessage&) override;
+      void batchDone() override;
+
+    private:
+      int32_t lockFd = -1;
+      int32_t unlockFd = -1;
+
+      struct PendingOp {
+        uint8_t op;
+        uint32_t id;
+        std::string lockName;
+      };
+      std::vector<PendingOp> batch;
   };
 }
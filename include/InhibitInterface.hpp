@@ -17,6 +17,11 @@
 #include <functional>
 #include <dbus/dbus.h>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <string_view>
+#include <optional>
+#include <deque>
 #include <cstdint>
 #include <string>
 #include <memory>
@@ -31,21 +36,62 @@
 #include "Fork.hpp"
 #include "util.hpp"
 #include "myExcept.hpp"
+#include "EventLoop.hpp"
+#include "Spawner.hpp"
+#include "Stats.hpp"
 
 #ifdef BUILDFLAG_X11
 #include <X11/Xlib.h>
 #endif
 
 namespace uinhibit {
-  // Unique ID for an Inhibit. Data within is InhibitInterface-specific.
-  // Unique among all InhibitInterfaces.
-  typedef std::vector<std::byte> InhibitID; 
+  // Unique ID for an Inhibit. Unique among all InhibitInterfaces.
+  //
+  // instanceId is the InhibitInterface's instanceId. The meaning of str and cookie is
+  // InhibitInterface-specific (typically an interned D-Bus sender or lock name and/or a cookie).
+  struct InhibitID {
+    uint64_t instanceId = 0;
+    uint32_t str = 0; // internString() handle
+    uint32_t cookie = 0;
+
+    auto operator<=>(const InhibitID&) const = default;
+  };
+
+  // Interns strings (senders, lock names...) so InhibitIDs can refer to them with a fixed-size
+  // handle. Thread-safe. "" is always 0.
+  //
+  // The same string gets the same handle for as long as it's interned: while an InhibitID in some
+  // activeInhibits uses it (they're retained/released as inhibits come and go), and for
+  // internGraceMS after its last use. After that it's freed. Handles are never reused, so a stale
+  // one just resolves to "".
+  uint32_t internString(std::string_view str);
+  std::string internedString(uint32_t handle);
+  void retainString(uint32_t handle);
+  void releaseString(uint32_t handle);
+  extern int64_t internGraceMS;
+
+  // True if a process named comm (as in /proc/<pid>/comm, so at most 15 characters are compared)
+  // is running. /proc is scanned once on first use and the result shared by every caller, so
+  // this reflects startup rather than the current state. Thread-safe.
+  bool processRunning(std::string_view comm);
+}
+
+template<> struct std::hash<uinhibit::InhibitID> {
+  size_t operator()(const uinhibit::InhibitID& id) const noexcept {
+    uint64_t h = id.instanceId * 0x9E3779B97F4A7C15ull;
+    h ^= ((((uint64_t)id.str) << 32) | id.cookie) + 0x632BE59BD9B4E019ull + (h << 6) + (h >> 2);
+    return h;
+  }
+};
+
+namespace uinhibit {
 
   enum InhibitType {
     NONE = 0,
     SCREENSAVER = 0b00000001,
     SUSPEND     = 0b00000010,
   };
+  constexpr uint32_t INHIBIT_TYPE_BITS = 2; // Number of flags in InhibitType
 
   static std::string inhibitTypeToString(InhibitType t) {
     if (t == InhibitType::NONE) return "none";
@@ -92,6 +138,7 @@ namespace uinhibit {
       InhibitInterface(std::function<void(InhibitInterface*,Inhibit)> inhibitCB,
                 std::function<void(InhibitInterface*,Inhibit)> unInhibitCB,
                 std::string name);
+      virtual ~InhibitInterface();
 
       std::string name;
 
@@ -104,7 +151,8 @@ namespace uinhibit {
             return {std::coroutine_handle<promise_type>::from_promise(*this)};
           }
           std::suspend_never initial_suspend() { return {}; }
-          std::suspend_never final_suspend() noexcept { return {}; }
+          // Stay suspended when finished so drivers can check handle.done() before resuming
+          std::suspend_always final_suspend() noexcept { return {}; }
           void unhandled_exception() { }
 
           auto getHandle(){
@@ -114,11 +162,21 @@ namespace uinhibit {
       };
 
       // Start operating/listening for inhibit events
+      //
+      // The coroutine must only suspend via waitFor() such that waitSet describes what it's
+      // waiting for. Whoever drives it should resume it once waitSet is ready.
       virtual ReturnObject start() = 0;
+      WaitSet waitSet;
+
+      // Thread-safe. Resume start() as soon as possible (ie. a thread queued work for it).
+      void wake();
 
       // Bitflags of all currently inhibited types
       InhibitType inhibited();
 
+      // Bitflags of all currently inhibited types across every InhibitInterface. Thread-safe.
+      static InhibitType globalInhibited();
+
       // Call do(Un)Inhibit for subclasses (TODO) and adds/removes activeInhibits
       // Also calls handle(un)InhibitEvent handleInhibitStateChanged()
       // Must be awaiting for these to function
@@ -126,8 +184,43 @@ namespace uinhibit {
       void unInhibit(InhibitID);
 
       uint64_t instanceId = 0; // Uniquely identifies this InhibitInterface instance
-      std::map<InhibitID, Inhibit> activeInhibits;
+      std::unordered_map<InhibitID, Inhibit> activeInhibits;
+      uint64_t activeGeneration = 0; // Bumped every time activeInhibits changes
+
+      InhibitStats stats;
+
+      // State changes within this many ms of the first are coalesced into (at most) one
+      // handleInhibitStateChanged(), so flapping inhibits don't drive backends back and forth.
+      // Changes to suspend are never held back. 0 to disable.
+      static int64_t debounceMS;
+
+      // Handles a state change still waiting out debounceMS right away. For shutdown, where
+      // nothing would be left to run its timer.
+      void flushStateChange();
+
+      // True while start() still has work in flight that something outside us is waiting on
+      // (commands, releases not yet delivered...). For draining the loop before exiting.
+      virtual bool busy();
     protected:
+      struct Wait {
+        InhibitInterface* inhibitInterface;
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<>) {}
+        void await_resume();
+      };
+
+      // co_await this to suspend start() until something in fds is ready, wake() is called, or
+      // timeoutMS passes (< 0 to wait forever). Spurious resumes are possible.
+      // Expired timers are run and finished spawner commands reaped on resume.
+      Wait waitFor(std::vector<pollfd> fds, int64_t timeoutMS = -1);
+
+      // Deadlines to act on from within start() (ie. expiring inhibits) without polling for them
+      TimerQueue timers;
+
+      // For running external commands without blocking anyone. Finished commands are reaped
+      // (and their callbacks run) on resume, same as timers.
+      Spawner spawner;
+
       // Implementation of (un)inhibit action. Do not register the inhibit, as this was a
       // user-requested action and they don't need to be called back about it (this could result in
       // infinite loops).
@@ -147,6 +240,8 @@ namespace uinhibit {
       //
       // Useful to implement InhibitInterfaces that actively 'push' their state on these events,
       // such as the org.freedesktop.PowerManager.HasInhibitChanged signal
+      //
+      // handleInhibitStateChanged() is subject to debounceMS, inhibit is the latest one involved.
       virtual void handleInhibitEvent(Inhibit inhibit) = 0;
       virtual void handleUnInhibitEvent(Inhibit inhibit) = 0;
       virtual void handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) = 0;
@@ -156,6 +251,23 @@ namespace uinhibit {
     private:
       void callEvent(bool isInhibit, Inhibit i);
       InhibitType lastInhibitState = InhibitType::NONE;
+
+      // Debounced state change, see debounceMS
+      void flushStateChange(const Inhibit& i);
+      uint64_t stateTimer = 0; // TimerQueue ID, 0 if no change is pending
+      Inhibit pendingStateInhibit;
+
+      // Active inhibits per InhibitType flag, kept in sync with activeInhibits so we never need
+      // to walk it to know what's inhibited
+      uint32_t typeCounts[INHIBIT_TYPE_BITS] = {};
+      static std::atomic<uint32_t> globalTypeCounts[INHIBIT_TYPE_BITS];
+      void countInhibit(InhibitType type, int32_t delta);
+
+      // Add/remove from activeInhibits, maintaining typeCounts. False if nothing changed.
+      bool addActive(const Inhibit& i);
+      bool removeActive(const InhibitID& id, Inhibit* removed);
+
+      int32_t wakeFd = -1; // eventfd
   };
 
   class LinuxKernelInhibitInterface : public InhibitInterface {
@@ -165,12 +277,8 @@ namespace uinhibit {
                            LinuxKernelInhibitFork* inhibitFork);
 
       ReturnObject start();
+      bool busy() override;
     protected:
-      struct _InhibitID {
-        uint64_t instanceID;
-        char lockName[1024];
-      };
-
       Inhibit doInhibit(InhibitRequest) override;
       void doUnInhibit(InhibitID) override;
       void handleInhibitEvent(Inhibit inhibit) override;
@@ -181,14 +289,26 @@ namespace uinhibit {
       bool canSend = false;
       bool canRead = false;
       void watcherThread();
-      InhibitID mkId(const char* lockName);
+      InhibitID mkId(std::string_view lockName);
 
       std::mutex registerMutex;
       std::vector<Inhibit> registerQueue;
       std::vector<InhibitID> unregisterQueue;
 
-      std::set<InhibitID> ourInhibits;
+      std::unordered_set<InhibitID> ourInhibits;
       LinuxKernelInhibitFork* inhibitFork;
+
+      // Lock/unlock requests are queued on the fork and flushed from start(). We don't wait for
+      // the results, but a lock that failed is dropped from ourInhibits once we hear about it.
+      struct ForkOp {
+        uint8_t op;
+        std::string lockName;
+      };
+      uint32_t lastRequestId = 0;
+      std::unordered_map<uint32_t, ForkOp> forkPending; // request ID, op
+      void sendToFork(uint8_t op, const std::string& lockName);
+      void handleForkResults();
+      static std::string cleanLockName(std::string_view lockName);
   };
 
   class XautolockInhibitInterface : public InhibitInterface {
@@ -233,7 +353,9 @@ namespace uinhibit {
   class XidlehookInhibitInterface: public InhibitInterface {
     public:
       XidlehookInhibitInterface(std::function<void(InhibitInterface*,Inhibit)> inhibitCB,
-                         std::function<void(InhibitInterface*,Inhibit)> unInhibitCB);
+                         std::function<void(InhibitInterface*,Inhibit)> unInhibitCB,
+                         std::string socketPath = "/tmp/xidlehook.sock");
+      ~XidlehookInhibitInterface();
 
     protected:
       ReturnObject start();
@@ -245,6 +367,16 @@ namespace uinhibit {
     private:
       InhibitType lastInhibited = InhibitType::NONE;
       bool ok = false;
+
+      // We speak xidlehook's socket protocol (NUL-terminated JSON, as xidlehook-client does) over
+      // a persistent connection, reconnecting whenever it goes away
+      std::string socketPath;
+      int32_t sockFd = -1;
+      std::string rxBuf;
+      bool connectSocket();
+      void disconnectSocket();
+      void sendControl(const char* action); // "Disable"/"Enable"
+      void handleReplies();
   };
 
   class SxmoInhibitInterface : public InhibitInterface {
@@ -253,28 +385,28 @@ namespace uinhibit {
                     std::function<void(InhibitInterface*,Inhibit)> unInhibitCB);
 
     protected:
-      struct _InhibitID {
-        uint64_t instanceID;
-        char token[1024];
-      };
-
       ReturnObject start();
       Inhibit doInhibit(InhibitRequest) override;
       void doUnInhibit(InhibitID) override;
       void handleInhibitEvent(Inhibit inhibit) override {};
       void handleUnInhibitEvent(Inhibit inhibit) override {};
       void handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) override {};
+      static std::string mkToken(std::string appname, std::string reason);
+      InhibitID mkId(std::string_view token);
 
     private:
       InhibitType lastInhibited = InhibitType::NONE;
       bool ok = false;
-      std::string mkToken(std::string appname, std::string reason);
-      InhibitID mkId(std::string token);
       void watcherThread();
+
+      std::string mutexDir;   // $XDG_RUNTIME_DIR/sxmo_mutex
+      std::string canSuspend; // mutexDir/can_suspend
+      bool mutexLock(const std::string& token);
+      bool mutexFree(const std::string& token);
       std::mutex registerMutex;
       std::vector<Inhibit> registerQueue; // under registerMutex
       std::vector<InhibitID> unregisterQueue; // under registerMutex
-      std::set<InhibitID> ourInhibits; // under registerMutex
+      std::unordered_set<InhibitID> ourInhibits; // under registerMutex
   };
 
   class UserCommandsInhibitInterface: public InhibitInterface {
@@ -291,20 +423,16 @@ namespace uinhibit {
       void handleUnInhibitEvent(Inhibit inhibit) override {};
       void handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) override;
 
-      struct _InhibitID {
-        uint64_t instanceID;
-        uint64_t cookie;
-      };
-
     private:
+      void runCommand(const std::string& cmd, InhibitType t, const char* what);
       InhibitType lastInhibited = InhibitType::NONE;
       bool ok = false;
 
       std::map<InhibitType,std::string> cmds;
       std::map<InhibitType,std::string> uncmds;
 
-      uint64_t lastCookie = 0;
-      InhibitID mkId(uint64_t cookie);
+      uint32_t lastCookie = 0;
+      InhibitID mkId(uint32_t cookie);
   };
 
   class DBusInhibitInterface : public InhibitInterface {
@@ -331,6 +459,7 @@ namespace uinhibit {
                     std::vector<DBusSignalCB> mySignals);
 
       ReturnObject start() override;
+      bool busy() override;
 
       bool monitor;
     protected:
@@ -344,10 +473,70 @@ namespace uinhibit {
       std::vector<DBusMethodCB> myMethods;
       std::vector<DBusSignalCB> mySignals;
 
-      std::map<uint32_t, DBus::Message> methodCalls; // serial, message
+      // Dispatch tables for myMethods/mySignals keyed on {interface, member}.
+      // Transparent so we can look up with string_views straight out of a message.
+      typedef std::pair<std::string_view, std::string_view> MemberRef;
+      struct MemberHash {
+        using is_transparent = void;
+        size_t operator()(MemberRef m) const noexcept {
+          size_t h = std::hash<std::string_view>()(m.first);
+          return h ^ (std::hash<std::string_view>()(m.second) + 0x9E3779B9 + (h << 6) + (h >> 2));
+        }
+        size_t operator()(const std::pair<std::string, std::string>& m) const noexcept {
+          return (*this)(MemberRef(m.first, m.second));
+        }
+      };
+      struct MemberEq {
+        using is_transparent = void;
+        bool operator()(MemberRef a, MemberRef b) const noexcept { return a == b; }
+      };
+      std::unordered_map<std::pair<std::string, std::string>, size_t, MemberHash, MemberEq>
+        methodTable, signalTable; // {interface, member}, index into myMethods/mySignals
+
+      static MemberRef memberRef(DBus::Message& msg);
+
+      // Calls we've seen while monitoring, waiting on the implementer's reply. Keyed on serial,
+      // but serials are only unique per connection, so a reply matches on the caller's name too.
+      std::unordered_multimap<uint32_t, DBus::Message> methodCalls;
       std::string interface;
 
       virtual void poll() = 0;
+
+      // Any fds of our own start() should also wake for (poll() will be called)
+      virtual std::vector<pollfd> watchFds() { return {}; };
+
+      // Inhibits we've forwarded to whoever implements the interface while monitoring.
+      //
+      // We don't wait for their reply: our own cookie is handed out right away and mapped to
+      // theirs once it arrives, so forwarding to a slow peer doesn't stall everyone else.
+      // call (on callDbus) must reply with a UINT32 cookie. release is called with their cookie
+      // once we have it and unforwardInhibit() was called, in whichever order that happens.
+      void forwardInhibit(uint32_t ourCookie, DBus::Message call,
+                          std::function<void(uint32_t)> release);
+      void unforwardInhibit(uint32_t ourCookie);
+      int32_t forwardTimeoutMS = 500;
+
+      // Reply to an Introspect call with the XML for msg's path, only calling build() if we don't
+      // have it cached. The cache is dropped whenever activeInhibits changes, so XML listing
+      // inhibitors stays current.
+      void sendIntrospect(DBus::Message* msg, const std::function<std::string()>& build);
+
+    private:
+      struct Forwarded {
+        std::optional<uint32_t> theirCookie; // Unset until the reply arrives
+        bool released = false;
+        std::function<void(uint32_t)> release;
+      };
+      std::unordered_map<uint32_t, Forwarded> forwarded; // our cookie, forward
+
+      // Unique name of whoever implements the interface while we monitor. We only take method
+      // returns coming from them, following NameOwnerChanged if it moves.
+      std::string monitorOwner;
+      void becomeMonitor();
+
+      std::unordered_map<std::string, std::string, StringHash, std::equal_to<>>
+        introspectCache; // path, xml
+      uint64_t introspectGeneration = 0; // activeGeneration introspectCache was built for
   };
 
   // Multiple inhibitors share this common base interface:
@@ -369,17 +558,11 @@ namespace uinhibit {
                           InhibitType inhibitType,
                           std::string extraIntrospect);
     protected:
-      struct _InhibitID {
-        uint64_t instanceID;
-        char sender[1024];
-        uint32_t cookie;
-      };  
-
       void handleInhibitMsg(DBus::Message* msg, DBus::Message* retmsg);
       void handleUnInhibitMsg(DBus::Message* msg, DBus::Message* retmsg);
       void handleNameLostMsg(DBus::Message* msg);
       void handleIntrospect(DBus::Message* msg, DBus::Message* retmsg);
-      InhibitID mkId(std::string sender, uint32_t cookie);
+      InhibitID mkId(std::string_view sender, uint32_t cookie);
       std::map<std::string, std::vector<InhibitID>> inhibitOwners; // sender, {ids}
       uint32_t lastCookie = 0;
 
@@ -432,7 +615,7 @@ namespace uinhibit {
                                 std::function<void(InhibitInterface*, Inhibit)> unInhibitCB);
     protected:
       void handleSimActivityMsg(DBus::Message* msg, DBus::Message* retmsg);
-      void poll() override;
+      std::unordered_map<InhibitID, uint64_t> simTimers; // SimulateUserActivity expiry timers
   };
 
   class FreedesktopPowerManagerInhibitInterface : public SimpleDBusInhibitInterface {
@@ -451,12 +634,6 @@ namespace uinhibit {
       GnomeSessionManagerInhibitInterface(std::function<void(InhibitInterface*, Inhibit)> inhibitCB,
                                    std::function<void(InhibitInterface*, Inhibit)> unInhibitCB);
     protected:
-      struct _InhibitID {
-        uint64_t instanceID;
-        char sender[1024];
-        uint32_t cookie;
-      };
-
       enum GnomeInhibitType {
         NONE = 0,
         LOGOUT = 1,
@@ -493,7 +670,7 @@ namespace uinhibit {
     private:
       InhibitType gnomeType2us(GnomeInhibitType t);
       GnomeInhibitType us2gnomeType(InhibitType us);
-      InhibitID mkId(std::string sender, uint32_t cookie);
+      InhibitID mkId(std::string_view sender, uint32_t cookie);
       uint32_t inhibitorPathToCookie(std::string path);
       Inhibit* inhibitFromCookie(uint32_t cookie); // throws InhibitNotFoundException
   };
@@ -503,12 +680,9 @@ namespace uinhibit {
       SystemdInhibitInterface(std::function<void(InhibitInterface*, Inhibit)> inhibitCB,
                        std::function<void(InhibitInterface*, Inhibit)> unInhibitCB,
                        SystemdInhibitFork* inhibitFork);
+      ~SystemdInhibitInterface();
+      bool busy() override;
     protected:
-      struct _InhibitID {
-        uint64_t instanceID;
-        uint32_t fd;
-      };
-
       void handleInhibitMsg(DBus::Message* msg, DBus::Message* retmsg);
       void handleIntrospect(DBus::Message* msg, DBus::Message* retmsg);
       void handleListInhibitorsMsg(DBus::Message* msg, DBus::Message* retmsg);
@@ -520,13 +694,12 @@ namespace uinhibit {
       Inhibit doInhibit(InhibitRequest r) override;
       void doUnInhibit(InhibitID id) override;
       void poll() override;
+      std::vector<pollfd> watchFds() override;
+      static InhibitType systemdType2us(std::string what);
+      static std::string us2systemdType(InhibitType t);
 
     private:
-      void releaseThread(const char* path, Inhibit in, bool delay);
-      void releaseThreadOurFd(int32_t fd, std::string path, Inhibit in);
-      InhibitID mkId(uint32_t fd);
-      InhibitType systemdType2us(std::string what);
-      std::string us2systemdType(InhibitType t);
+      InhibitID mkId(uint32_t fd, std::string_view owner = "");
       SystemdInhibitFork* inhibitFork;
       std::string forkSender;
 
@@ -540,15 +713,33 @@ namespace uinhibit {
 
       uint64_t lastLockRef = 0;
 
-      std::mutex releaseQueueMutex; 
+      // Inhibits are released when the FIFO read ends we hand out see EOF, or (monitoring) when
+      // logind's FIFO gets deleted. Both are multiplexed into releaseEpollFd, which start() waits
+      // on, so this costs no threads regardless of how many inhibits are held.
+      int32_t releaseEpollFd = -1;
+      int32_t inotifyFd = -1; // Watches the directories of releasePaths
+      std::unordered_map<int32_t, std::string> inotifyDirs; // watch descriptor, directory
+      std::unordered_map<int32_t, std::pair<std::string, Inhibit>> releaseFds; // rfd, {path, in}
+      std::unordered_map<std::string, Inhibit> releasePaths; // logind FIFO path, inhibit
       std::vector<Inhibit> releaseQueue;
 
+      void watchReleaseFd(int32_t fd, std::string path, Inhibit in);
+      void watchReleasePath(std::string path, Inhibit in, bool delay);
+
+      // Inhibits we asked our fork to take (monitoring). We don't wait for it to reply with the
+      // fd it holds, replies carry our cookie as their request ID. Requests are only queued
+      // on the fork until poll(), so a burst of them goes out in one write.
+      uint32_t lastForkCookie = 0;
+      uint32_t forkPending = 0; // Requests awaiting a reply
+      std::unordered_map<uint32_t, std::optional<int32_t>> forkFds; // our cookie, fork's fd
+      void handleForkReplies();
+
       struct PidUid {
         uint32_t pid;
         uint32_t uid;
       };
 
-      std::map<InhibitID, PidUid> pidUids;
+      std::unordered_map<InhibitID, PidUid> pidUids;
   };
 
   class CinnamonScreenSaverInhibitInterface : public DBusInhibitInterface {
@@ -558,14 +749,9 @@ namespace uinhibit {
         std::function<void(InhibitInterface*, Inhibit)> unInhibitCB
       );
     protected:
-      struct _InhibitID {
-        uint64_t instanceID;
-        char sender[1024];
-      };
-
       void handleSimActivityMsg(DBus::Message* msg, DBus::Message* retmsg);
       void handleIntrospect(DBus::Message* msg, DBus::Message* retmsg);
-      InhibitID mkId(std::string sender);
+      InhibitID mkId(std::string_view sender);
       std::map<std::string, std::vector<InhibitID>> inhibitOwners; // sender, {ids}
       uint32_t lastUsInhibit = 0;
       std::map<std::string, std::jthread> simThreads; // Our made-up sender, thread
@@ -579,12 +765,54 @@ namespace uinhibit {
       Inhibit doInhibit(InhibitRequest r) override;
       void doUnInhibit(InhibitID id) override;
 
-      void poll() override;
+      void poll() override {};
 
     private:
+      std::unordered_map<InhibitID, uint64_t> simTimers; // SimulateUserActivity expiry timers
       //void simThread(std::stop_token stop_token);
   };
 
+  // Not an inhibit interface: serves our own InhibitStats as the Stats property of
+  // org.unifiedinhibit.Stats on the session bus, and writes them to dumpPath on requestDump().
+  // Refuses every inhibit.
+  class StatsInhibitInterface : public DBusInhibitInterface {
+    public:
+      StatsInhibitInterface(std::function<void(InhibitInterface*, Inhibit)> inhibitCB,
+                            std::function<void(InhibitInterface*, Inhibit)> unInhibitCB,
+                            const std::vector<InhibitInterface*>* inhibitors,
+                            std::string dumpPath);
+      ~StatsInhibitInterface();
+
+      // Async-signal-safe (for SIGUSR1)
+      static void requestDump();
+
+      // {interface name, InhibitStats::snapshot()} for every inhibitor but us
+      std::vector<std::pair<std::string, std::vector<std::pair<std::string, uint64_t>>>>
+        snapshot();
+    protected:
+      void handleGetProperty(DBus::Message* msg, DBus::Message* retmsg);
+      void handleGetAllProperties(DBus::Message* msg, DBus::Message* retmsg);
+      void handleIntrospect(DBus::Message* msg, DBus::Message* retmsg);
+
+      void handleInhibitEvent(Inhibit inhibit) override {};
+      void handleUnInhibitEvent(Inhibit inhibit) override {};
+      void handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) override {};
+      Inhibit doInhibit(InhibitRequest r) override;
+      void doUnInhibit(InhibitID id) override;
+
+      void poll() override;
+
+    private:
+      const std::vector<InhibitInterface*>* inhibitors;
+      std::string dumpPath;
+
+      void appendStats(DBusMessageIter* iter); // As a{sa{st}}
+      void dump();
+
+      static std::atomic<bool> dumpRequested;
+      static std::atomic<StatsInhibitInterface*> instance;
+  };
+
   // wayland inhibit
   // XFCE inhibit
   // org.freedesktop.portal.Inhibit xdg-desktop-portal - integration for sandboxed apps?
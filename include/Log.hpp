@@ -0,0 +1,64 @@
+// Copyright (C) 2022 Matthew Egeler
+//
+// This file is part of unified-inhibit.
+//
+// unified-inhibit is free software: you can redistribute it and/or modify it under the terms of the
+// GNU General Public License as published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// unified-inhibit is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with unified-inhibit. If
+// not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+#include <cstdint>
+#include <string_view>
+#include <initializer_list>
+
+namespace uinhibit {
+  enum class LogLevel : uint8_t { VERBOSE, INFO, WARN, ERROR };
+
+  // Line-based logging to stdout. Thread-safe.
+  //
+  // Until startThread(), lines are written by whoever logs them. After, they're formatted straight
+  // into a slot of a preallocated ring and a background thread does the writing, so a slow reader
+  // (ie. journald) never holds us up. If the ring fills, lines are dropped (and counted) rather
+  // than waited on.
+  //
+  // Warnings and errors are rate limited per call site.
+  class Log {
+    public:
+      enum class Format : uint8_t {
+        PLAIN, // As-is, with colors
+        KV,    // level=info msg="..." key=value, colors stripped
+      };
+
+      // syslogPrefix: start lines with <priority> (journald picks these up from stdout)
+      static void configure(LogLevel minLevel, Format format, bool syslogPrefix);
+
+      static void startThread();
+      static void stopThread(); // Writes out everything queued, then back to writing directly
+
+      static void verbose(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+      static void info(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+      static void warn(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+      static void error(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+      // msg followed by key=value fields. Values are quoted and escaped when they need it (they
+      // often come straight from D-Bus clients), so they can't break the line or forge fields.
+      struct Field {
+        const char* key;
+        std::string_view value;
+      };
+      static void event(LogLevel level, const char* msg, std::initializer_list<Field> fields);
+
+      // Warnings/errors from one call site past the first few in this window are suppressed
+      static int64_t repeatWindowMS;
+
+      // "verbose", "info", "warn" or "error". False if str isn't one of those.
+      static bool parseLevel(std::string_view str, LogLevel& out);
+  };
+}
@@ -0,0 +1,68 @@
+// Copyright (C) 2022 Matthew Egeler
+//
+// This file is part of unified-inhibit.
+//
+// unified-inhibit is free software: you can redistribute it and/or modify it under the terms of the
+// GNU General Public License as published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// unified-inhibit is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with unified-inhibit. If
+// not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+#include <poll.h>
+#include <sys/types.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+
+namespace uinhibit {
+  // Runs shell commands without waiting for them. Not thread-safe.
+  //
+  // Like TimerQueue, whoever owns this should fold pollFds()/next() into whatever it waits on
+  // and call reap() when woken. Children are watched with pidfds, so nothing needs to poll for
+  // them to exit (or where pidfds aren't available, we check every REAP_FALLBACK_MS).
+  class Spawner {
+    public:
+      ~Spawner();
+
+      // Run cmd with /bin/sh -c. Commands sharing a key run one at a time, in the order given.
+      //
+      // After timeoutMS (< 0 for never) the command and anything it started get SIGKILL.
+      // cb gets its exit status, or -1 if it couldn't be started, was killed, or timed out.
+      void run(std::string cmd, uint32_t key = 0, int64_t timeoutMS = -1,
+               std::function<void(int32_t status)> cb = {});
+
+      std::vector<pollfd> pollFds();
+      int64_t next(); // monotonicMS() deadline we need reap() called by regardless, -1 for none
+      void reap();    // Collect finished commands (calling their cb) and start whatever's next
+      bool busy();    // Anything still running or queued
+
+    private:
+      struct Job {
+        std::string cmd;
+        int64_t timeoutMS;
+        std::function<void(int32_t)> cb;
+      };
+
+      struct Running {
+        pid_t pid = -1;
+        int32_t pidfd = -1; // -1 if we don't have pidfds
+        int64_t deadlineMS = -1;
+        bool killed = false;
+        Job job;
+      };
+
+      std::unordered_map<uint32_t, std::deque<Job>> queued; // key, jobs waiting on running[key]
+      std::unordered_map<uint32_t, Running> running; // key, job
+
+      void startNext(uint32_t key);
+  };
+}
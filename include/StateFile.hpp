@@ -0,0 +1,113 @@
+// Copyright (C) 2022 Matthew Egeler
+//
+// This file is part of unified-inhibit.
+//
+// unified-inhibit is free software: you can redistribute it and/or modify it under the terms of the
+// GNU General Public License as published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// unified-inhibit is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with unified-inhibit. If
+// not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <string_view>
+#include "InhibitInterface.hpp"
+
+namespace uinhibit {
+  // Publishes our inhibit state as a fixed-layout file (normally $XDG_RUNTIME_DIR/uinhibit/state)
+  // for status bars and the like to mmap() and read with no syscalls or D-Bus traffic at all.
+  //
+  // The file is a Header followed by Header::capacity Entries (at headerSize, entrySize apart). It
+  // only ever lists inhibits apps asked for, not our forwards of them to other interfaces.
+  //
+  // seq and generation are only ever accessed atomically. Reading (see read()): load seq, skip if
+  // odd (mid-write), copy what you need, then load seq again. If it moved, try again. To sleep
+  // until something changes, FUTEX_WAIT (not private, the file is shared) on generation with the
+  // last value you saw (see wait()).
+  //
+  // Only one thread may publish.
+  class StateFile {
+    public:
+      static constexpr char MAGIC[8] = {'U', 'I', 'N', 'H', 'S', 'T', 'A', 'T'};
+      static constexpr uint32_t VERSION = 1;
+      static constexpr uint32_t CAPACITY = 64;
+      static constexpr uint32_t MAX_TYPES = 8; // typeCounts slots, ample room for new InhibitTypes
+
+      struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t headerSize;
+        uint32_t entrySize;
+        uint32_t capacity;
+        uint32_t seq;                     // Odd while being written
+        uint32_t generation;              // Bumped after every write, futex word
+        uint32_t pid;                     // Of the daemon, 0 once it's gone
+        uint32_t inhibited;               // InhibitType flags
+        uint32_t typeCounts[MAX_TYPES];   // Active inhibits per InhibitType flag (1 << index)
+        uint32_t count;                   // Valid entries
+        uint32_t dropped;                 // Active inhibits that didn't fit in the entries
+        uint64_t updated;                 // Unix time (s) of the last write
+        uint8_t reserved[40];
+      };
+
+      // Strings are NUL-terminated, and cut short (on a UTF-8 boundary) if they don't fit
+      struct Entry {
+        uint32_t type;      // InhibitType flags
+        uint32_t reserved;
+        uint64_t created;   // Unix time (s)
+        char appname[64];
+        char reason[128];
+        char source[48];    // InhibitInterface the app used, ie. org.freedesktop.ScreenSaver
+      };
+
+      static_assert(sizeof(Header) == 128 && sizeof(Entry) == 256, "StateFile layout changed");
+      static_assert(std::atomic_ref<uint32_t>::is_always_lock_free);
+
+      // Creates (replacing) the file at path. Throws std::runtime_error if we can't.
+      StateFile(std::string path);
+      ~StateFile(); // Publishes an empty state with pid 0 and removes the file
+
+      const std::string path;
+
+      // Call for every inhibit/uninhibit apps send us, from the thread that publishes.
+      // source is the InhibitInterface it came in on.
+      void add(std::string_view source, const Inhibit& inhibit);
+      void remove(const Inhibit& inhibit);
+
+      // Consistent copy of a mapped state file's header and entries. False if it's not a state
+      // file we understand, or we couldn't get a consistent read within a few thousand tries.
+      static bool read(const void* map, size_t size, Header& header, std::vector<Entry>& entries);
+
+      // Until generation moves off lastGeneration, or timeoutMS passes (< 0 to wait forever).
+      // True if it moved.
+      static bool wait(const void* map, uint32_t lastGeneration, int64_t timeoutMS = -1);
+
+    private:
+      struct Active {
+        Inhibit inhibit;
+        std::string source;
+      };
+      // Keyed on the order they arrived in, so entries don't move around as others come and go
+      std::map<uint64_t, Active> active;
+      std::unordered_map<InhibitID, uint64_t> activeOrder;
+      uint64_t lastOrder = 0;
+      uint32_t typeCounts[MAX_TYPES] = {};
+
+      int32_t fd = -1;
+      size_t size = 0;
+      Header* header = nullptr;
+      Entry* entries = nullptr;
+
+      void publish(uint32_t pid);
+  };
+}
@@ -0,0 +1,76 @@
+// Copyright (C) 2022 Matthew Egeler
+//
+// This file is part of unified-inhibit.
+//
+// unified-inhibit is free software: you can redistribute it and/or modify it under the terms of the
+// GNU General Public License as published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// unified-inhibit is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with unified-inhibit. If
+// not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace uinhibit {
+  // Everything here only uses relaxed atomics, so it's cheap enough to update from the hot path
+  // and safe to read from anywhere. Readers may see a slightly stale/inconsistent picture.
+
+  class Counter {
+    public:
+      void add(int64_t n = 1) { this->value.fetch_add(n, std::memory_order_relaxed); }
+      int64_t load() const { return this->value.load(std::memory_order_relaxed); }
+    private:
+      std::atomic<int64_t> value = 0;
+  };
+
+  // Latency histogram in the style of HdrHistogram: log-linear buckets keeping 3 significant bits
+  // (values are off by at most 12.5%), from 1us up to ~19h. Fixed size, no allocation.
+  class Histogram {
+    public:
+      void record(uint64_t us);
+
+      uint64_t count() const;
+      uint64_t max() const;
+      uint64_t percentile(double p) const; // 0-100. Upper bound of the bucket it lands in.
+
+    private:
+      static constexpr uint32_t SUB_BITS = 3;
+      static constexpr uint32_t MAX_BITS = 36;
+      static constexpr uint32_t BUCKETS = (MAX_BITS-SUB_BITS+1) << SUB_BITS;
+
+      static uint32_t bucketOf(uint64_t us);
+      static uint64_t bucketUpper(uint32_t bucket);
+
+      std::atomic<uint64_t> buckets[BUCKETS] = {};
+      std::atomic<uint64_t> maxUS = 0;
+  };
+
+  // Per-InhibitInterface
+  struct InhibitStats {
+    Counter inhibitsReceived;    // From apps talking to this interface
+    Counter unInhibitsReceived;
+    Counter inhibitsForwarded;   // To this interface, from others
+    Counter unInhibitsForwarded;
+    Counter forwardFailures;     // Forwards to this interface that threw (not unsupported types)
+    Counter noResponses;         // Of which (or async forwards) the other end never replied
+    Counter dbusMessages;        // Popped off our connection
+    Counter dbusIgnored;         // Of which nothing handled
+    Counter active;              // Current active inhibits
+
+    Histogram doInhibitUS;
+    Histogram doUnInhibitUS;
+    Histogram forwardUS;         // Receipt to all other interfaces having been forwarded to
+
+    // {name, value} for everything above. Histograms are summarized as count/p50/p90/p99/max.
+    std::vector<std::pair<std::string, uint64_t>> snapshot() const;
+  };
+}
@@ -19,6 +19,13 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <string_view>
+#include <functional>
+#include <algorithm>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #define VERSION_MAJOR 0
 #define VERSION_MINOR 2
@@ -63,6 +70,53 @@ static std::string strMerge(std::vector<std::string> strings) {
   return ret;
 };
 
+// True if program is an executable somewhere in $PATH
+static bool inPath(std::string_view program) {
+  const char* path = getenv("PATH");
+  if (path == NULL) return false;
+
+  std::string_view dirs(path);
+  while (!dirs.empty()) {
+    auto colon = std::min(dirs.find(':'), dirs.size());
+    std::string candidate = std::string(dirs.substr(0, colon))+"/"+std::string(program);
+    if (access(candidate.c_str(), X_OK) == 0) return true;
+    dirs.remove_prefix(std::min(colon+1, dirs.size()));
+  }
+
+  return false;
+}
+
+// Creates dir (0700) if needed. True if it's now a real directory (not a symlink) that only we
+// can get into, so files in it can't be planted or swapped by anyone else. Use this for anything
+// under a shared location like /tmp.
+static bool privateDir(const std::string& dir) {
+  if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) return false;
+
+  struct stat st;
+  if (lstat(dir.c_str(), &st) != 0) return false;
+  if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 0077) != 0) {
+    errno = EPERM;
+    return false;
+  }
+  return true;
+}
+
+// Creates path (0600) for writing, replacing whatever was there (ie. left behind by a crash).
+// Never follows a symlink. -1 with errno set on failure.
+static int exclusiveCreate(const std::string& path) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0 && errno == EEXIST && unlink(path.c_str()) == 0)
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  return fd;
+}
+
+// For unordered containers of std::string that we want to look up with string_views
+// (use with std::equal_to<>)
+struct StringHash {
+  using is_transparent = void;
+  size_t operator()(std::string_view s) const noexcept { return std::hash<std::string_view>()(s); }
+};
+
 struct Args {
   std::set<char> flags;
   std::map<std::string, std::vector<std::string>> params;
@@ -14,15 +14,19 @@
 // not, see <https://www.gnu.org/licenses/>.
 
 #include "DBus.hpp"
+#include "EventLoop.hpp"
 #include <stdexcept>
 #include <cstring>
 
+using uinhibit::monotonicMS;
+
 DBus::DBus(DBusBusType type) : type(type) {
   dbus_error_init(&err);
   dbus_threads_init_default();
   this->conn = dbus_bus_get_private(type, &err);
-  dbus_connection_set_exit_on_disconnect(this->conn, false);
   this->throwErrAndFree();
+  dbus_connection_set_exit_on_disconnect(this->conn, false);
+  this->setWatchFunctions();
 }
 
 DBus::~DBus() {
@@ -34,9 +38,119 @@ void DBus::reconnect() {
   dbus_connection_close(this->conn);
   dbus_connection_unref(this->conn);
 
+  {
+    std::unique_lock<std::mutex> lk(this->watchesMutex);
+    this->watches.clear();
+    this->timeouts.clear();
+  }
+
+  this->asyncSerials.clear();
+  this->credentials.clear();
+  this->credentialWaiters.clear(); // Their replies will never come
+  this->watchingNameOwners = false;
+
   this->conn = dbus_bus_get_private(type, &err);
-  dbus_connection_set_exit_on_disconnect(this->conn, false);
   this->throwErrAndFree();
+  dbus_connection_set_exit_on_disconnect(this->conn, false);
+  this->setWatchFunctions();
+}
+
+void DBus::setWatchFunctions() {
+  // No toggle function: we check dbus_watch_get_enabled() every time pollFds() is called
+  dbus_connection_set_watch_functions(this->conn, &DBus::addWatch, &DBus::removeWatch, NULL,
+                                      this, NULL);
+  dbus_connection_set_timeout_functions(this->conn, &DBus::addTimeout, &DBus::removeTimeout,
+                                        &DBus::toggleTimeout, this, NULL);
+}
+
+dbus_bool_t DBus::addTimeout(DBusTimeout* timeout, void* data) {
+  auto self = (DBus*)data;
+  std::unique_lock<std::mutex> lk(self->watchesMutex);
+  self->timeouts.push_back({timeout, monotonicMS()+dbus_timeout_get_interval(timeout)});
+  return true;
+}
+
+void DBus::removeTimeout(DBusTimeout* timeout, void* data) {
+  auto self = (DBus*)data;
+  std::unique_lock<std::mutex> lk(self->watchesMutex);
+  for (auto it = self->timeouts.begin(); it != self->timeouts.end(); it++) {
+    if (it->timeout == timeout) { self->timeouts.erase(it); break; }
+  }
+}
+
+void DBus::toggleTimeout(DBusTimeout* timeout, void* data) {
+  auto self = (DBus*)data;
+  std::unique_lock<std::mutex> lk(self->watchesMutex);
+  for (auto& t : self->timeouts) {
+    if (t.timeout == timeout) t.deadlineMS = monotonicMS()+dbus_timeout_get_interval(timeout);
+  }
+}
+
+int32_t DBus::timeoutMS() {
+  std::unique_lock<std::mutex> lk(this->watchesMutex);
+  int64_t now = monotonicMS();
+  int64_t ret = -1;
+
+  for (auto& t : this->timeouts) {
+    if (!dbus_timeout_get_enabled(t.timeout)) continue;
+    int64_t left = (t.deadlineMS > now) ? t.deadlineMS-now : 0;
+    if (ret < 0 || left < ret) ret = left;
+  }
+
+  return ret;
+}
+
+void DBus::handleTimeouts() {
+  std::vector<DBusTimeout*> expired;
+  {
+    std::unique_lock<std::mutex> lk(this->watchesMutex);
+    int64_t now = monotonicMS();
+    for (auto& t : this->timeouts) {
+      if (!dbus_timeout_get_enabled(t.timeout) || t.deadlineMS > now) continue;
+      expired.push_back(t.timeout);
+      t.deadlineMS = now+dbus_timeout_get_interval(t.timeout); // They repeat until removed
+    }
+  }
+
+  // Outside the lock, handling can remove timeouts
+  for (auto t : expired) dbus_timeout_handle(t);
+}
+
+void DBus::dispatch() {
+  while (dbus_connection_dispatch(this->conn) == DBUS_DISPATCH_DATA_REMAINS);
+}
+
+dbus_bool_t DBus::addWatch(DBusWatch* watch, void* data) {
+  auto self = (DBus*)data;
+  std::unique_lock<std::mutex> lk(self->watchesMutex);
+  self->watches.push_back(watch);
+  return true;
+}
+
+void DBus::removeWatch(DBusWatch* watch, void* data) {
+  auto self = (DBus*)data;
+  std::unique_lock<std::mutex> lk(self->watchesMutex);
+  for (auto it = self->watches.begin(); it != self->watches.end(); it++) {
+    if (*it == watch) { self->watches.erase(it); break; }
+  }
+}
+
+std::vector<pollfd> DBus::pollFds() {
+  std::vector<pollfd> ret;
+  std::unique_lock<std::mutex> lk(this->watchesMutex);
+
+  for (auto watch : this->watches) {
+    if (!dbus_watch_get_enabled(watch)) continue;
+
+    uint32_t flags = dbus_watch_get_flags(watch);
+    short events = 0;
+    if (flags & DBUS_WATCH_READABLE) events |= POLLIN;
+    if (flags & DBUS_WATCH_WRITABLE) events |= POLLOUT;
+
+    ret.push_back({dbus_watch_get_unix_fd(watch), events, 0});
+  }
+
+  return ret;
 }
 
 void DBus::throwErrAndFree() {
@@ -157,6 +271,21 @@ bool DBus::nameHasOwner(const char* name) {
   return ret;
 }
 
+std::string DBus::getNameOwner(const char* name) {
+  try {
+    auto retmsg = this->newMethodCall(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS,
+                                      "GetNameOwner")
+      .appendArgs(DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID)
+      ->sendAwait(500);
+
+    const char* owner = "";
+    retmsg.getArgs(DBUS_TYPE_STRING, &owner, DBUS_TYPE_INVALID);
+    return owner;
+  } catch (DBus::NameHasNoOwnerError& e) {
+    return "";
+  }
+}
+
 int32_t DBus::requestName(const char* name, uint32_t flags) {
   int32_t ret = dbus_bus_request_name(this->conn, name, flags, &err);
   this->throwErrAndFree();
@@ -174,7 +303,10 @@ void DBus::addMatch(const char* rule) {
 }
 
 void DBus::readWrite(int32_t timeoutMS) {
-  if (!dbus_connection_read_write(this->conn, timeoutMS))
+  // read_write() still reports success while the Disconnected message sits in our queue, and
+  // once disconnected there's no watch left to wake us up. Check explicitly.
+  if (!dbus_connection_read_write(this->conn, timeoutMS) ||
+      !dbus_connection_get_is_connected(this->conn))
     throw DisconnectedError("Lost D-Bus connection");
 }
 
@@ -183,16 +315,41 @@ void DBus::readWriteDispatch(int32_t timeoutMS) {
     throw DisconnectedError("Lost D-Bus connection");
 }
 
+bool DBus::dataRemains() {
+  return (dbus_connection_get_dispatch_status(this->conn) == DBUS_DISPATCH_DATA_REMAINS);
+}
+
 void DBus::flush() {
   dbus_connection_flush(this->conn);
 };
 
+bool DBus::hasMessagesToSend() {
+  return dbus_connection_has_messages_to_send(this->conn);
+}
+
 DBus::Message DBus::popMessage() {
-  DBusMessage* msg = dbus_connection_pop_message(this->conn);
+  DBusMessage* msg;
 
-  auto ptr = std::shared_ptr<DBus::UniqueMessage>(new DBus::UniqueMessage(msg));
-  DBus::Message ret(ptr, this);
-  return ret;
+  while ((msg = dbus_connection_borrow_message(this->conn)) != nullptr) {
+    int32_t type = dbus_message_get_type(msg);
+
+    // Replies to sendAsync() calls need to go through dispatch() so the callback gets called
+    if ((type == DBUS_MESSAGE_TYPE_METHOD_RETURN || type == DBUS_MESSAGE_TYPE_ERROR) &&
+        this->asyncSerials.contains(dbus_message_get_reply_serial(msg))) {
+      dbus_connection_return_message(this->conn, msg);
+      dbus_connection_dispatch(this->conn);
+      continue;
+    }
+
+    if (this->watchingNameOwners &&
+        dbus_message_is_signal(msg, DBUS_INTERFACE_DBUS, "NameOwnerChanged"))
+      this->handleNameOwnerChanged(msg);
+
+    dbus_connection_steal_borrowed_message(this->conn, msg);
+    break;
+  }
+
+  return DBus::Message(msg, this);
 };
 
 DBus::Message DBus::newMethodCall(const char* destination,
@@ -201,17 +358,13 @@ DBus::Message DBus::newMethodCall(const char* destination,
                                   const char* method) {
   DBusMessage* msg = dbus_message_new_method_call(destination, path, interface, method);
 
-  auto ptr = std::shared_ptr<DBus::UniqueMessage>(new DBus::UniqueMessage(msg));
-  DBus::Message ret(ptr, this);
-  return ret;
+  return DBus::Message(msg, this);
 };
 
 DBus::Message DBus::newSignal(const char* path, const char* interface, const char* name) {
   DBusMessage* msg = dbus_message_new_signal(path, interface, name);
 
-  auto ptr = std::shared_ptr<DBus::UniqueMessage>(new DBus::UniqueMessage(msg));
-  DBus::Message ret(ptr, this);
-  return ret;
+  return DBus::Message(msg, this);
 };
 
 void DBus::becomeMonitor(std::vector<const char*> filters) {
@@ -246,10 +399,8 @@ static DBusHandlerResult registerObjectPathFuncWrap(
 ) {
   UserDataWrap* data = (UserDataWrap*)(user_data);
 
-  auto ptr = std::shared_ptr<DBus::UniqueMessage>(new DBus::UniqueMessage(msg));
-  DBus::Message dmsg(ptr, data->dbus);
-
-  return data->handler(data->realUserData, dmsg);
+  // We're only lending the handler libdbus' message, it keeps its own reference
+  return data->handler(data->realUserData, DBus::Message(dbus_message_ref(msg), data->dbus));
 }
 
 static std::vector<UserDataWrap> wrappedUserData; // TODO: remove elements on unRegister
@@ -268,9 +419,7 @@ void DBus::registerObjectPath(
     void *user_data
   ) -> DBusHandlerResult {
 
-    auto ptr = std::shared_ptr<DBus::UniqueMessage>(new DBus::UniqueMessage(msg));
-    DBus::Message dmsg(ptr, this);
-    return handler(user_data, dmsg);
+    return handler(user_data, DBus::Message(dbus_message_ref(msg), this));
   };*/
 
   UserDataWrap s = {handler, this, userData};
@@ -284,11 +433,33 @@ void DBus::registerObjectPath(
   this->throwErrAndFree();
 };
 
-DBus::Message::Message(std::shared_ptr<DBus::UniqueMessage> msg, DBus* dbus) : msg(msg), dbus(dbus)
-{};
+DBus::Message::Message(DBusMessage* msg, DBus* dbus) : msg(msg), dbus(dbus) {};
+
+DBus::Message::Message(Message&& o) noexcept : msg(o.msg), dbus(o.dbus) {
+  o.msg = nullptr;
+};
+
+DBus::Message& DBus::Message::operator=(Message&& o) noexcept {
+  if (this != &o) {
+    if (this->msg != nullptr) dbus_message_unref(this->msg);
+    this->msg = o.msg;
+    this->dbus = o.dbus;
+    o.msg = nullptr;
+  }
+  return *this;
+};
+
+DBus::Message::~Message() {
+  if (this->msg != nullptr) dbus_message_unref(this->msg);
+};
+
+DBus::Message DBus::Message::ref() {
+  if (this->msg != nullptr) dbus_message_ref(this->msg);
+  return DBus::Message(this->msg, this->dbus);
+};
 
 bool DBus::Message::isNull() {
-  return (this->msg.get()->msg == nullptr);
+  return (this->msg == nullptr);
 };
 
 bool DBus::Message::notNull() {
@@ -298,103 +469,189 @@ bool DBus::Message::notNull() {
 void DBus::Message::getArgs(int32_t firstArgType, ...) {
   va_list args;
   va_start(args, firstArgType);
-  dbus_message_get_args_valist(this->msg.get()->msg, &(this->dbus->err), firstArgType, args);
+  dbus_message_get_args_valist(this->msg, &(this->dbus->err), firstArgType, args);
   va_end(args);
 
   this->dbus->throwErrAndFree();
 };
 
 int32_t DBus::Message::type() {
-  return dbus_message_get_type(this->msg.get()->msg);
+  return dbus_message_get_type(this->msg);
 };
 
 const char* DBus::Message::sender() {
-  return dbus_message_get_sender(this->msg.get()->msg);
+  return dbus_message_get_sender(this->msg);
 };
 
 const char* DBus::Message::destination() {
-  return dbus_message_get_destination(this->msg.get()->msg);
+  return dbus_message_get_destination(this->msg);
 };
 
 const char* DBus::Message::interface() {
-  return dbus_message_get_interface(this->msg.get()->msg);
+  return dbus_message_get_interface(this->msg);
 };
 
 const char* DBus::Message::member() {
-  return dbus_message_get_member(this->msg.get()->msg);
+  return dbus_message_get_member(this->msg);
 };
 
 const char* DBus::Message::path() {
-  return dbus_message_get_path(this->msg.get()->msg);
+  return dbus_message_get_path(this->msg);
 };
 
-uint32_t DBus::Message::senderPID() {
-  const char* sender = this->sender();
-  auto retmsg = this->dbus
-    ->newMethodCall(DBUS_SERVICE_DBUS,DBUS_PATH_DBUS,DBUS_SERVICE_DBUS,"GetConnectionUnixProcessID")
-    .appendArgs(DBUS_TYPE_STRING, &sender, DBUS_TYPE_INVALID)
-    ->sendAwait(500);
-
-  uint32_t ret = 0;
-  retmsg.getArgs(DBUS_TYPE_UINT32, &ret, DBUS_TYPE_INVALID);
-  return ret;
-}
-
-
-uint32_t DBus::Message::senderUID() {
-  const char* sender = this->sender();
-  auto retmsg = this->dbus
-    ->newMethodCall(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_SERVICE_DBUS, "GetConnectionUnixUser")
-    .appendArgs(DBUS_TYPE_STRING, &sender, DBUS_TYPE_INVALID)
-    ->sendAwait(500);
-
-  uint32_t ret = 0;
-  retmsg.getArgs(DBUS_TYPE_UINT32, &ret, DBUS_TYPE_INVALID);
-  return ret;
+void DBus::Message::senderCredentials(std::function<void(Credentials)> cb) {
+  this->dbus->getCredentials(this->sender(), cb);
 }
 
 uint32_t DBus::Message::serial() {
-  return dbus_message_get_serial(this->msg.get()->msg);
+  return dbus_message_get_serial(this->msg);
 };
 
 uint32_t DBus::Message::replySerial() {
-  return dbus_message_get_reply_serial(this->msg.get()->msg);
+  return dbus_message_get_reply_serial(this->msg);
 };
 
 DBus::Message DBus::Message::newMethodReturn() {
-  DBusMessage* reply = dbus_message_new_method_return(this->msg.get()->msg);
-  auto ptr = std::shared_ptr<DBus::UniqueMessage>(new DBus::UniqueMessage(reply));
-  DBus::Message ret(ptr, this->dbus);
-  return ret;
+  DBusMessage* reply = dbus_message_new_method_return(this->msg);
+  return DBus::Message(reply, this->dbus);
 };
 
 DBus::Message* DBus::Message::appendArgs(int32_t firstArgType, ...) {
   va_list args;
   va_start(args, firstArgType);
-  dbus_message_append_args_valist(this->msg.get()->msg, firstArgType, args);
+  dbus_message_append_args_valist(this->msg, firstArgType, args);
   va_end(args);
 
   return this;
 };
 
 void DBus::Message::send() {
-  dbus_connection_send(this->dbus->conn, this->msg.get()->msg, NULL);
+  dbus_connection_send(this->dbus->conn, this->msg, NULL);
   //this->dbus->flush();
 };
 
 void DBus::Message::send(uint32_t serial) {
-  dbus_connection_send(this->dbus->conn, this->msg.get()->msg, &serial);
+  dbus_connection_send(this->dbus->conn, this->msg, &serial);
+};
+
+void DBus::getCredentials(const char* name, std::function<void(Credentials)> cb) {
+  auto cached = this->credentials.find(name);
+  if (cached != this->credentials.end()) { cb(cached->second); return; }
+
+  auto& waiters = this->credentialWaiters[name];
+  waiters.push_back(cb);
+  if (waiters.size() > 1) return; // Already asked
+
+  if (!this->watchingNameOwners) {
+    // NULL error: don't block waiting for the bus to acknowledge
+    dbus_bus_add_match(this->conn, "type='signal',sender='" DBUS_SERVICE_DBUS "',"
+                       "interface='" DBUS_INTERFACE_DBUS "',member='NameOwnerChanged',"
+                       "arg2=''", NULL);
+    this->watchingNameOwners = true;
+  }
+
+  std::string sname = name;
+  this->newMethodCall(this->credentialsService, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS,
+                      "GetConnectionCredentials")
+    .appendArgs(DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID)
+    ->sendAsync(500, [this, sname](Message reply) {
+      Credentials creds;
+      if (reply.notNull()) {
+        creds = parseCredentials(reply.msg);
+        this->credentials[sname] = creds;
+      }
+
+      auto waiters = std::move(this->credentialWaiters[sname]);
+      this->credentialWaiters.erase(sname);
+      for (auto& waiter : waiters) waiter(creds);
+    });
+}
+
+DBus::Credentials DBus::parseCredentials(DBusMessage* reply) {
+  Credentials creds;
+
+  DBusMessageIter iter, dictIter;
+  if (!dbus_message_iter_init(reply, &iter)) return creds;
+  if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY) return creds;
+  dbus_message_iter_recurse(&iter, &dictIter);
+
+  while (dbus_message_iter_get_arg_type(&dictIter) == DBUS_TYPE_DICT_ENTRY) {
+    DBusMessageIter entryIter, variantIter;
+    const char* key;
+    dbus_message_iter_recurse(&dictIter, &entryIter);
+    dbus_message_iter_get_basic(&entryIter, &key);
+    dbus_message_iter_next(&entryIter);
+    dbus_message_iter_recurse(&entryIter, &variantIter);
+
+    if (dbus_message_iter_get_arg_type(&variantIter) == DBUS_TYPE_UINT32) {
+      if (strcmp(key, "ProcessID") == 0)  dbus_message_iter_get_basic(&variantIter, &creds.pid);
+      if (strcmp(key, "UnixUserID") == 0) dbus_message_iter_get_basic(&variantIter, &creds.uid);
+    }
+
+    dbus_message_iter_next(&dictIter);
+  }
+
+  return creds;
+}
+
+void DBus::handleNameOwnerChanged(DBusMessage* msg) {
+  const char* name; const char* oldOwner; const char* newOwner;
+  DBusError e;
+  dbus_error_init(&e);
+  if (dbus_message_get_args(msg, &e, DBUS_TYPE_STRING, &name, DBUS_TYPE_STRING, &oldOwner,
+                            DBUS_TYPE_STRING, &newOwner, DBUS_TYPE_INVALID)) {
+    if (newOwner[0] == '\0') this->credentials.erase(name);
+  }
+  dbus_error_free(&e);
+}
+
+struct AsyncReplyWrap {
+  std::function<void(DBus::Message reply)> cb;
+  DBus* dbus;
+  uint32_t serial;
+  std::unordered_set<uint32_t>* asyncSerials;
 };
 
+static void asyncReplyNotify(DBusPendingCall* pending, void* data) {
+  auto wrap = (AsyncReplyWrap*)data;
+  wrap->asyncSerials->erase(wrap->serial);
+
+  DBusMessage* reply = dbus_pending_call_steal_reply(pending);
+  if (reply != nullptr && dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+    dbus_message_unref(reply);
+    reply = nullptr;
+  }
+
+  wrap->cb(DBus::Message(reply, wrap->dbus));
+}
+
+static void asyncReplyFree(void* data) {
+  delete (AsyncReplyWrap*)data;
+}
+
+void DBus::Message::sendAsync(int32_t timeout, std::function<void(Message reply)> cb) {
+  DBusPendingCall* pending = nullptr;
+  if (!dbus_connection_send_with_reply(this->dbus->conn, this->msg, &pending, timeout))
+    throw std::bad_alloc();
+
+  // NULL if we're disconnected, in which case there will never be a reply
+  if (pending == nullptr) throw DisconnectedError("Lost D-Bus connection");
+
+  uint32_t serial = dbus_message_get_serial(this->msg);
+  this->dbus->asyncSerials.insert(serial);
+
+  auto wrap = new AsyncReplyWrap{std::move(cb), this->dbus, serial, &this->dbus->asyncSerials};
+  dbus_pending_call_set_notify(pending, &asyncReplyNotify, wrap, &asyncReplyFree);
+  dbus_pending_call_unref(pending); // The connection keeps its own ref until it completes
+}
+
 DBus::Message DBus::Message::sendAwait(int32_t timeout) {
   auto r = dbus_connection_send_with_reply_and_block(this->dbus->conn,
-                                                     this->msg.get()->msg,
+                                                     this->msg,
                                                      timeout,
                                                      &(this->dbus->err));
   this->dbus->throwErrAndFree();
 
-  auto ptr = std::shared_ptr<DBus::UniqueMessage>(new DBus::UniqueMessage(r));
-  DBus::Message ret(ptr, this->dbus);
-  return ret;
+  return DBus::Message(r, this->dbus);
 };
 
@@ -0,0 +1,208 @@
+// Copyright (C) 2022 Matthew Egeler
+//
+// This file is part of unified-inhibit.
+//
+// unified-inhibit is free software: you can redistribute it and/or modify it under the terms of the
+// GNU General Public License as published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// unified-inhibit is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with unified-inhibit. If
+// not, see <https://www.gnu.org/licenses/>.
+
+#include "EventLoop.hpp"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <time.h>
+#include <cerrno>
+#include <stdexcept>
+
+namespace uinhibit {
+  int64_t monotonicMS() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec*1000) + (ts.tv_nsec/1000000);
+  }
+
+  int64_t monotonicUS() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec*1000000) + (ts.tv_nsec/1000);
+  }
+
+  WaitSet::WaitSet() {
+    this->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->epollFd < 0) throw std::runtime_error("Failed to create epoll instance");
+  }
+
+  WaitSet::~WaitSet() {
+    close(this->epollFd);
+  }
+
+  void WaitSet::set(const std::vector<pollfd>& fds, int64_t timeoutMS) {
+    // Merge duplicate fds (libdbus likes to hand us separate read and write watches on one socket)
+    std::vector<pollfd> merged;
+    merged.reserve(fds.size());
+    for (auto& f : fds) {
+      if (f.fd < 0) continue;
+      bool found = false;
+      for (auto& m : merged) if (m.fd == f.fd) { m.events |= f.events; found = true; }
+      if (!found) merged.push_back({f.fd, f.events, 0});
+    }
+
+    for (auto& old : this->registered) {
+      bool keep = false;
+      for (auto& m : merged) if (m.fd == old.fd) keep = true;
+      if (!keep) epoll_ctl(this->epollFd, EPOLL_CTL_DEL, old.fd, nullptr);
+    }
+
+    for (auto& m : merged) {
+      epoll_event ev = {};
+      ev.events = (uint16_t)m.events;
+      ev.data.fd = m.fd;
+
+      // MOD first even if we think it's registered: if the fd was closed since the last wait epoll
+      // will have silently dropped it (and the number may have been reused).
+      if (epoll_ctl(this->epollFd, EPOLL_CTL_MOD, m.fd, &ev) != 0 && errno == ENOENT)
+        epoll_ctl(this->epollFd, EPOLL_CTL_ADD, m.fd, &ev);
+    }
+
+    this->registered = std::move(merged);
+    this->deadlineMS = (timeoutMS < 0) ? -1 : monotonicMS()+timeoutMS;
+  }
+
+  int32_t WaitSet::fd() { return this->epollFd; }
+  int64_t WaitSet::deadline() { return this->deadlineMS; }
+
+  bool WaitSet::ready(int32_t timeoutMS) {
+    if (this->deadlineMS >= 0) {
+      int64_t left = this->deadlineMS - monotonicMS();
+      if (left <= 0) return true;
+      if (timeoutMS < 0 || left < timeoutMS) timeoutMS = left;
+    }
+
+    epoll_event ev;
+    if (epoll_wait(this->epollFd, &ev, 1, timeoutMS) > 0) return true;
+    return (this->deadlineMS >= 0 && monotonicMS() >= this->deadlineMS);
+  }
+
+  uint64_t TimerQueue::add(int64_t timeoutMS, std::function<void()> cb) {
+    uint64_t id = ++this->lastId;
+    this->callbacks.insert({id, std::move(cb)});
+    this->heap.push({monotonicMS()+timeoutMS, id});
+    return id;
+  }
+
+  void TimerQueue::cancel(uint64_t id) {
+    this->callbacks.erase(id);
+
+    // Rebuild if cancelled entries are piling up (ie. a timer is constantly being pushed back)
+    if (this->heap.size() > 64 && this->heap.size() > this->callbacks.size()*2) {
+      decltype(this->heap) live;
+      while (!this->heap.empty()) {
+        if (this->callbacks.contains(this->heap.top().id)) live.push(this->heap.top());
+        this->heap.pop();
+      }
+      this->heap = std::move(live);
+    }
+  }
+
+  int64_t TimerQueue::next() {
+    while (!this->heap.empty() && !this->callbacks.contains(this->heap.top().id)) this->heap.pop();
+    return this->heap.empty() ? -1 : this->heap.top().deadlineMS;
+  }
+
+  void TimerQueue::run() {
+    int64_t now = monotonicMS();
+    while (!this->heap.empty() && this->heap.top().deadlineMS <= now) {
+      uint64_t id = this->heap.top().id;
+      this->heap.pop();
+
+      auto it = this->callbacks.find(id);
+      if (it == this->callbacks.end()) continue; // cancelled
+
+      // Remove first, the callback may add/cancel timers
+      auto cb = std::move(it->second);
+      this->callbacks.erase(it);
+      cb();
+    }
+  }
+
+  EventLoop::EventLoop() {
+    this->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->epollFd < 0) throw std::runtime_error("Failed to create epoll instance");
+
+    this->interruptFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (this->interruptFd < 0 || epoll_ctl(this->epollFd, EPOLL_CTL_ADD, this->interruptFd, &ev))
+      throw std::runtime_error("Failed to create eventfd");
+  }
+
+  EventLoop::~EventLoop() {
+    for (auto e : this->entries) delete e;
+    close(this->interruptFd);
+    close(this->epollFd);
+  }
+
+  void EventLoop::interrupt() {
+    uint64_t one = 1;
+    [[maybe_unused]] auto r = write(this->interruptFd, &one, sizeof(one));
+  }
+
+  void EventLoop::add(WaitSet* waitSet, std::coroutine_handle<> handle) {
+    auto e = new Entry{waitSet, handle};
+    this->entries.push_back(e);
+
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = e;
+    if (epoll_ctl(this->epollFd, EPOLL_CTL_ADD, waitSet->fd(), &ev) != 0)
+      throw std::runtime_error("Failed to add to epoll instance");
+  }
+
+  void EventLoop::runOnce(int32_t timeoutMS) {
+    // Wake up in time for the nearest deadline
+    int64_t now = monotonicMS();
+    for (auto e : this->entries) {
+      int64_t d = e->waitSet->deadline();
+      if (d < 0 || e->handle.done()) continue;
+      int64_t left = (d > now) ? d-now : 0;
+      if (timeoutMS < 0 || left < timeoutMS) timeoutMS = left;
+    }
+
+    epoll_event events[64];
+    int32_t n = epoll_wait(this->epollFd, events, 64, timeoutMS);
+    if (n < 0 && errno != EINTR) throw std::runtime_error("epoll_wait failed");
+
+    // Collect everyone before resuming anyone, as resuming changes wait sets/deadlines
+    std::vector<Entry*> ready;
+    for (int32_t i = 0; i < n; i++) {
+      if (events[i].data.ptr != nullptr) { ready.push_back((Entry*)events[i].data.ptr); continue; }
+      uint64_t count;
+      [[maybe_unused]] auto r = read(this->interruptFd, &count, sizeof(count));
+    }
+
+    now = monotonicMS();
+    for (auto e : this->entries) {
+      int64_t d = e->waitSet->deadline();
+      if (d < 0 || d > now) continue;
+
+      bool found = false;
+      for (auto r : ready) if (r == e) found = true;
+      if (!found) ready.push_back(e);
+    }
+
+    for (auto e : ready) {
+      if (!e->handle.done()) e->handle.resume();
+
+      // Finished coroutines can't be resumed again, stop listening for them
+      if (e->handle.done()) epoll_ctl(this->epollFd, EPOLL_CTL_DEL, e->waitSet->fd(), nullptr);
+    }
+  }
+}
@@ -4,6 +4,9 @@
 #include <thread>
 #include <stdio.h>
 #include <sys/prctl.h>
+#include <poll.h>
+#include <cstring>
+#include <cerrno>
 
 using namespace uinhibit;
 
@@ -58,40 +61,142 @@ void Fork::run() {
   close(outPipe[1]); // Close our own write side
 };
 
-void Fork::tx(std::string str) {
-  if (write(((child) ? outPipe[1] : inPipe[1]), str.c_str(), str.size()) < 0)
-    throw std::runtime_error("tx failed\n");
+void Fork::encode(std::string& buf, uint8_t op, uint32_t id, int32_t value,
+                  std::initializer_list<std::string_view> fields) {
+  if (fields.size() > std::tuple_size<decltype(ForkMessage::fields)>::value)
+    throw std::runtime_error("Too many fields for fork message");
+
+  uint32_t size = sizeof(uint8_t)*2 + sizeof(id) + sizeof(value);
+  for (auto& f : fields) size += sizeof(uint32_t) + f.size();
+
+  uint8_t nFields = fields.size();
+  auto append = [&buf](const void* data, size_t len) { buf.append((const char*)data, len); };
+
+  buf.reserve(buf.size() + sizeof(size) + size);
+  append(&size, sizeof(size));
+  append(&op, sizeof(op));
+  append(&nFields, sizeof(nFields));
+  append(&id, sizeof(id));
+  append(&value, sizeof(value));
+  for (auto& f : fields) {
+    uint32_t len = f.size();
+    append(&len, sizeof(len));
+    append(f.data(), f.size());
+  }
+}
+
+size_t Fork::decode(const char* data, size_t avail, ForkMessage& out) {
+  const char* p = data;
+
+  uint32_t size;
+  if (avail < sizeof(size)) return 0;
+  std::memcpy(&size, p, sizeof(size));
+  if (size > 1024*1024) throw std::runtime_error("Buffer overflow");
+  if (avail < sizeof(size)+size) return 0;
+
+  const char* end = p+sizeof(size)+size;
+  auto take = [&p, end](void* dst, size_t len) {
+    if (p+len > end) throw std::runtime_error("Malformed fork message");
+    std::memcpy(dst, p, len);
+    p += len;
+  };
+
+  p += sizeof(size);
+  take(&out.op, sizeof(out.op));
+  take(&out.nFields, sizeof(out.nFields));
+  take(&out.id, sizeof(out.id));
+  take(&out.value, sizeof(out.value));
+
+  if (out.nFields > out.fields.size()) throw std::runtime_error("Malformed fork message");
+  for (uint8_t i = 0; i < out.nFields; i++) {
+    uint32_t len;
+    take(&len, sizeof(len));
+    if (p+len > end) throw std::runtime_error("Malformed fork message");
+    out.fields[i] = std::string_view(p, len);
+    p += len;
+  }
 
-  fsync(((child) ? outPipe[1] : inPipe[1]));
+  return sizeof(size)+size;
 }
 
-std::string Fork::rx() {
-  std::string str;
+void Fork::queue(uint8_t op, uint32_t id, int32_t value,
+                 std::initializer_list<std::string_view> fields) {
+  encode(this->txBuf, op, id, value, fields);
+}
 
-  char buf[1024] = "";
-  int64_t got = read(((child) ? inPipe[0] : outPipe[0]), &buf, sizeof(buf));
-  if (got < 0) throw std::runtime_error("Failed to read from pipe");
-  str += buf;
-  return str;
+void Fork::flush() {
+  size_t done = 0;
+  while (done < this->txBuf.size()) {
+    int64_t wrote = write(((child) ? outPipe[1] : inPipe[1]), this->txBuf.data()+done,
+                          this->txBuf.size()-done);
+    if (wrote < 0 && errno == EINTR) continue;
+    if (wrote < 0) throw std::runtime_error("tx failed\n");
+    done += wrote;
+  }
+
+  this->txBuf.clear();
+}
+
+bool Fork::txPending() {
+  return !this->txBuf.empty();
 }
 
-std::string Fork::rxLine() {
-  while (1) {
-    if (this->lineBuf.find('\n') == std::string::npos)
-      this->lineBuf += this->rx();
-
-    std::string out;
-    int64_t newline = -1;
-    int64_t i = 0;
-    for (auto c : this->lineBuf) {
-      if (c == '\n') { newline = i; break; }
-      out.push_back(c);
-      i++;
+void Fork::tx(uint8_t op, uint32_t id, int32_t value,
+              std::initializer_list<std::string_view> fields) {
+  this->queue(op, id, value, fields);
+  this->flush();
+}
+
+void Fork::rxFill() {
+  // Out of room at the end, move what's left of the unparsed data to the front
+  if (this->rxTail == this->rxBuf.size()) {
+    std::memmove(this->rxBuf.data(), this->rxBuf.data()+this->rxHead, this->rxTail-this->rxHead);
+    this->rxTail -= this->rxHead;
+    this->rxHead = 0;
+
+    if (this->rxTail == this->rxBuf.size()) {
+      if (this->rxBuf.size() >= 1024*1024) throw std::runtime_error("Buffer overflow");
+      this->rxBuf.resize(this->rxBuf.size()*2);
     }
+  }
+
+  int64_t got;
+  do {
+    got = read(rxFd(), this->rxBuf.data()+this->rxTail, this->rxBuf.size()-this->rxTail);
+  } while (got < 0 && errno == EINTR);
+
+  if (got < 0) throw std::runtime_error("Failed to read from pipe");
+  if (got == 0) throw std::runtime_error("Pipe closed");
+  this->rxTail += got;
+}
+
+bool Fork::rxMessage(ForkMessage& out) {
+  size_t size = decode(this->rxBuf.data()+this->rxHead, this->rxTail-this->rxHead, out);
+  if (size == 0) return false;
 
-    if (newline >= 0) this->lineBuf.erase(0,newline+1); // Remove this message from buf
-    if (this->lineBuf.size() > 1024*1024) throw std::runtime_error("Buffer overflow");
+  this->rxHead += size;
+  if (this->rxHead == this->rxTail) this->rxHead = this->rxTail = 0;
+  return true;
+}
+
+ForkMessage Fork::rxWait() {
+  ForkMessage msg;
+  while (!this->rxMessage(msg)) this->rxFill();
+  return msg;
+}
 
-    return out;
+int32_t Fork::rxFd() {
+  return (child) ? inPipe[0] : outPipe[0];
+}
+
+bool Fork::rxReady() {
+  uint32_t size;
+  size_t avail = this->rxTail-this->rxHead;
+  if (avail >= sizeof(size)) {
+    std::memcpy(&size, this->rxBuf.data()+this->rxHead, sizeof(size));
+    if (avail >= sizeof(size)+size) return true;
   }
+
+  struct pollfd pollfd = { .fd = this->rxFd(), .events = POLLIN, .revents = 0 };
+  return (::poll(&pollfd, 1, 0) > 0);
 }
@@ -1,6 +1,7 @@
 #include "Fork.hpp"
 #include <fcntl.h>
-#include <algorithm>
+#include <unordered_map>
+#include <cerrno>
 
 using namespace uinhibit;
 
@@ -8,28 +9,55 @@ using namespace uinhibit;
 #define WAKE_LOCK_PATH "/sys/power/wake_lock"
 #define WAKE_UNLOCK_PATH "/sys/power/wake_unlock"
 
-THIS::THIS() : NewlineMessageFork() {};
+THIS::THIS() : MessageFork() {};
+
+THIS::~THIS() {
+  if (this->lockFd >= 0) close(this->lockFd);
+  if (this->unlockFd >= 0) close(this->unlockFd);
+}
 
 void THIS::childSetup() {
   if (setresuid(0,0,0) != 0) {
     // All good, we will probably just fail to take any locks
   }
 
-  if (access(WAKE_LOCK_PATH, W_OK) != 0) tx("nowrite\n"); else tx("good\n");
+  // Kept open for our lifetime, every write is one lock/unlock
+  this->lockFd = open(WAKE_LOCK_PATH, O_WRONLY | O_CLOEXEC);
+  this->unlockFd = open(WAKE_UNLOCK_PATH, O_WRONLY | O_CLOEXEC);
+
+  this->tx(HELLO, 0, (this->lockFd >= 0 && this->unlockFd >= 0));
+}
+
+// Lock names come from LinuxKernelInhibitInterface already stripped of whitespace
+void THIS::handleMsg(const ForkMessage& msg) {
+  if (msg.op != LOCK && msg.op != UNLOCK) return;
+
+  if (msg.nFields < 1 || msg.fields[0].size() == 0) {
+    this->queue(RESULT, msg.id, EINVAL);
+    return;
+  }
+
+  this->batch.push_back({msg.op, msg.id, std::string(msg.fields[0])});
 }
 
-void THIS::handleMsg(std::string msg) {
-  if (msg.size() == 0) return;
-  msg.erase(std::remove(msg.begin(), msg.end(), ' '), msg.end());
-
-  if (msg.front() == '\t') {
-    msg.erase(0,1);
-    int32_t wfd = open(WAKE_UNLOCK_PATH, O_WRONLY);
-    dprintf(wfd, "%s\n", msg.c_str());
-    close(wfd);
-  } else {
-    int32_t wfd = open(WAKE_LOCK_PATH, O_WRONLY);
-    dprintf(wfd, "%s\n", msg.c_str());
-    close(wfd);
+void THIS::batchDone() {
+  // Locking and unlocking are idempotent, so only the last operation on each name in the batch
+  // decides where it ends up. Everything before it is skipped (and reported as successful).
+  std::unordered_map<std::string_view, size_t> last; // lock name, index into batch
+  for (size_t i = 0; i < this->batch.size(); i++) last[this->batch[i].lockName] = i;
+
+  for (size_t i = 0; i < this->batch.size(); i++) {
+    auto& op = this->batch[i];
+    int32_t result = 0;
+
+    if (last.at(op.lockName) == i) {
+      int32_t fd = (op.op == LOCK) ? this->lockFd : this->unlockFd;
+      std::string line = op.lockName+'\n';
+      if (write(fd, line.data(), line.size()) < 0) result = errno;
+    }
+
+    this->queue(RESULT, op.id, result);
   }
+
+  this->batch.clear();
 }
@@ -0,0 +1,18 @@
+#include "Fork.hpp"
+
+using namespace uinhibit;
+
+#define THIS MessageFork
+
+THIS::THIS() : Fork() {}
+
+void THIS::doRun() {
+  ForkMessage msg;
+  while(1) {
+    this->rxFill(); // Everything that's arrived, possibly many messages
+
+    while (this->rxMessage(msg)) this->handleMsg(msg);
+    this->batchDone();
+    this->flush();
+  }
+}
@@ -1,7 +1,7 @@
 #include "Fork.hpp"
 #include "myExcept.hpp"
-#include <regex>
 #include "util.hpp"
+#include "Log.hpp"
 
 using namespace uinhibit;
 
@@ -10,7 +10,7 @@ using namespace uinhibit;
 #define DBUSNAME "org.freedesktop.login1"
 #define PATH "/org/freedesktop/login1"
 
-THIS::THIS() : NewlineMessageFork() {}
+THIS::THIS() : MessageFork() {}
 
 void THIS::childSetup() {
   if (setresuid(0,0,0) != 0) {
@@ -18,75 +18,65 @@ void THIS::childSetup() {
   }
 
   dbus = std::unique_ptr<DBus>(new DBus(DBUS_BUS_SYSTEM));
-  this->tx(std::string(dbus->getUniqueName())+'\n');
+  this->tx(HELLO, 0, 0, {dbus->getUniqueName()});
 }
 
-void THIS::handleMsg(std::string msg) {
-  if (msg.size() == 0) return;
-
-  // Count up tabs
-  int32_t tabs = 0; for (auto c : msg) if (c == '\t') tabs++;
-
-  if (tabs == 3) {
-    // Inhibit
-    std::vector<std::string> strings; strings.push_back("");
-    for (auto c : msg) {
-      if (c == '\t') strings.push_back("");
-      else strings.back() += c;
+// "idle:sleep:shutdown" -> "idle:shutdown"
+static std::string withoutSleep(std::string_view what) {
+  std::string out;
+  while (!what.empty()) {
+    auto colon = what.find(':');
+    auto type = what.substr(0, colon);
+    if (type.size() > 0 && type != "sleep") {
+      if (!out.empty()) out += ':';
+      out += type;
     }
+    what = (colon == std::string_view::npos) ? "" : what.substr(colon+1);
+  }
+  return out;
+}
 
-    if (strings.size() < 4) return;
-
-    try {
-      int32_t fd = this->call(strings.at(0),
-                              strings.at(1),
-                              strings.at(2),
-                              strings.at(3));
+void THIS::handleMsg(const ForkMessage& msg) {
+  if (msg.op == RELEASE) {
+    close(msg.value);
+    return;
+  }
 
-      this->tx(std::to_string(fd)+"\n");
-    } catch (DBus::AccessDeniedError& e) {
-      std::string justIdle = strings.at(0);
-      justIdle = std::regex_replace(justIdle, std::regex("sleep"), "");
-      justIdle = std::regex_replace(justIdle, std::regex("::"), ":");
-      justIdle = std::regex_replace(justIdle, std::regex(":$"), "");
-      justIdle = std::regex_replace(justIdle, std::regex("^:"), "");
+  if (msg.op != INHIBIT || msg.nFields < 4) return;
 
-      bool retry = false;
-      bool except = false;
-      if (justIdle.size() > 0) try {
-        retry = true;
-        int32_t fd = this->call(justIdle,
-                                strings.at(1),
-                                strings.at(2),
-                                strings.at(3));
-        this->tx(std::to_string(fd)+"\n");
-      } catch (DBus::AccessDeniedError& e) {
-        except = true;
-      }
+  std::string what(msg.fields[0]), who(msg.fields[1]), why(msg.fields[2]), mode(msg.fields[3]);
 
-      if ((retry && except) || !retry) {
-        printf(ANSI_COLOR_YELLOW
-               "Warning: access denied attempting org.freedesktop.login1 inhibit with what='%s'."
-               " You might need to give me setuid (chown root uinhibitd && chmod 4755 uinhibitd)"
-               " or configure PolicyKit."
-               ANSI_COLOR_RESET "\n",
-               strings.at(0).c_str());
+  try {
+    this->queue(FD, msg.id, this->call(what, who, why, mode));
+  } catch (InhibitNoResponseException& e) {
+    this->queue(FD, msg.id, -1);
+  } catch (DBus::AccessDeniedError& e) {
+    std::string justIdle = withoutSleep(what);
+
+    bool retry = false;
+    bool except = false;
+    if (justIdle.size() > 0) try {
+      retry = true;
+      this->queue(FD, msg.id, this->call(justIdle, who, why, mode));
+    } catch (DBus::AccessDeniedError& e) {
+      except = true;
+    }
 
-        this->tx("-1\n");
-      } else if (retry && !except) {
-        printf(ANSI_COLOR_YELLOW
-               "Warning: access denied attempting org.freedesktop.login1 inhibit with what='%s'."
-               " We retried with what='%s' and it went through."
-               " You might need to give me setuid (chown root uinhibitd && chmod 4755 uinhibitd)"
-               " or configure PolicyKit."
-               ANSI_COLOR_RESET "\n",
-               strings.at(0).c_str(),
-               justIdle.c_str());
-      }
+    if ((retry && except) || !retry) {
+      Log::warn("access denied attempting org.freedesktop.login1 inhibit with what='%s'."
+                " You might need to give me setuid (chown root uinhibitd && chmod 4755 uinhibitd)"
+                " or configure PolicyKit.",
+                what.c_str());
+
+      this->queue(FD, msg.id, -1);
+    } else if (retry && !except) {
+      Log::warn("access denied attempting org.freedesktop.login1 inhibit with what='%s'."
+                " We retried with what='%s' and it went through."
+                " You might need to give me setuid (chown root uinhibitd && chmod 4755 uinhibitd)"
+                " or configure PolicyKit.",
+                what.c_str(),
+                justIdle.c_str());
     }
-  } else if (tabs == 0) {
-    // Release
-    close(atol(msg.c_str()));
   }
 }
 
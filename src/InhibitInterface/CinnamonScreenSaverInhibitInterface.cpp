@@ -38,7 +38,8 @@ THIS::THIS(std::function<void(InhibitInterface*, Inhibit)> inhibitCB,
        {INTERFACE, "SimulateUserActivity", METHOD_CAST &THIS::handleSimActivityMsg, "*"},
        {INTROSPECT_INTERFACE, "Introspect", METHOD_CAST &THIS::handleIntrospect, INTERFACE}
      },
-     {}){}
+     {})
+{}
 
 void THIS::handleSimActivityMsg(DBus::Message* msg, DBus::Message* retmsg) {
   // We treat this as an inhibit that expires in 5min
@@ -50,47 +51,44 @@ void THIS::handleSimActivityMsg(DBus::Message* msg, DBus::Message* retmsg) {
     (uint64_t)time(NULL)
   };
 
-  // Clear any existing simActivity inhibits from this sender
-  std::vector<InhibitID> eraseIDs;
-  for (auto& [id, in] : this->activeInhibits) {
-    auto idc = id;
-    auto idStruct = reinterpret_cast<const _InhibitID*>(&id[0]);
-    if (idStruct->sender == msg->sender()) eraseIDs.push_back(idc);
-  }
-  for (auto& id : eraseIDs) this->registerUnInhibit(id);
+  // Clear any existing simActivity inhibit from this sender
+  this->registerUnInhibit(i.id);
   this->inhibitOwners[std::string(msg->sender())].clear();
 
   // Register new inhibit
   this->registerInhibit(i);
   this->inhibitOwners[std::string(msg->sender())].push_back(i.id);
 
+  // (Re)start its expiry
+  if (this->simTimers.contains(i.id)) this->timers.cancel(this->simTimers.at(i.id));
+  this->simTimers[i.id] = this->timers.add(5*60*1000, [this, id = i.id]() mutable {
+    this->simTimers.erase(id);
+    this->inhibitOwners[internedString(id.str)].clear();
+    this->registerUnInhibit(id);
+  });
+
   if (!this->monitor) msg->newMethodReturn().send();
 }
 
 void THIS::handleIntrospect(DBus::Message* msg, DBus::Message* retmsg) {
-  if (this->monitor || std::string(msg->destination()) != this->interface) return;
+  if (this->monitor || std::string_view(msg->destination()) != this->interface) return;
 
-  if (std::string(msg->path()) == "/")  {
-    std::string xml = DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+  std::string_view path = msg->path();
+  if (path == "/") this->sendIntrospect(msg, []{
+    return DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
       "<node name='/'>"
       "  <node name='" RELPATH "' />"
       "</node>";
+  });
 
-    const char* introspectXml = xml.c_str();
-    msg->newMethodReturn().appendArgs(DBUS_TYPE_STRING,&introspectXml,DBUS_TYPE_INVALID)->send();
-  }
-
-  if (std::string(msg->path()) == PATH)  {
-    std::string xml = DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+  if (path == PATH) this->sendIntrospect(msg, []{
+    return DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
       "<node name='" RELPATH "'>"
       "  <interface name=\"" INTERFACE "\">"
       "    <method name='SimulateUserActivity' />"
       "  </interface>"
       "</node>";
-
-    const char* introspectXml = xml.c_str();
-    msg->newMethodReturn().appendArgs(DBUS_TYPE_STRING,&introspectXml,DBUS_TYPE_INVALID)->send();
-  }
+  });
 }
 
 static void simThread(std::stop_token stop_token, DBus* callDbus) {
@@ -118,37 +116,14 @@ Inhibit THIS::doInhibit(InhibitRequest r) {
 };
 
 void THIS::doUnInhibit(InhibitID id) {
-  auto idStruct = reinterpret_cast<_InhibitID*>(&id[0]);
-  if (this->monitor && this->simThreads.contains(idStruct->sender)) {
-    this->simThreads.at(idStruct->sender).request_stop();
-    this->simThreads.at(idStruct->sender).detach();
-    this->simThreads.erase(idStruct->sender);
+  auto sender = internedString(id.str);
+  if (this->monitor && this->simThreads.contains(sender)) {
+    this->simThreads.at(sender).request_stop();
+    this->simThreads.at(sender).detach();
+    this->simThreads.erase(sender);
   }
 }
 
-void THIS::poll() {
-  // Unregister any expired inhibits
-  std::vector<InhibitID> eraseIDs;
-  for (auto& [id, in] : this->activeInhibits) {
-    auto idc = id;
-    auto idStruct = reinterpret_cast<const _InhibitID*>(&id[0]);
-    if (in.created <= (time(NULL)-(60*5))) {
-      this->inhibitOwners[idStruct->sender].clear();
-      eraseIDs.push_back(idc);
-    }
-  }
-
-  for (auto& id : eraseIDs) this->registerUnInhibit(id);
-}
-
-InhibitID THIS::mkId(std::string sender) {
-  _InhibitID idStruct = {this->instanceId, {}};
-
-  uint32_t size = (sender.size()>sizeof(idStruct.sender)) ? sizeof(idStruct.sender) : sender.size();
-  strncpy(idStruct.sender, sender.c_str(), size);
-  if(size>0) idStruct.sender[size]=0; // NULL terminate
-
-  auto ptr = reinterpret_cast<std::byte*>(&idStruct);
-  InhibitID id(ptr, ptr+sizeof(idStruct));
-  return id;
+InhibitID THIS::mkId(std::string_view sender) {
+  return {this->instanceId, internString(sender), 0};
 }
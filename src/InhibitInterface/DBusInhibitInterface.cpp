@@ -17,6 +17,7 @@
 #include <cstdio>
 #include <unistd.h>
 #include "util.hpp"
+#include "Log.hpp"
 #include "DBus.hpp"
 #include <cxxabi.h>
 
@@ -43,55 +44,36 @@ namespace uinhibit {
     mySignals(mySignals),
     interface(interface)
   { 
-    this->monitor = dbus.nameHasOwner(interface.c_str());
+    for (size_t i = 0; i < myMethods.size(); i++)
+      this->methodTable.insert({{myMethods[i].interface, myMethods[i].member}, i});
+    for (size_t i = 0; i < mySignals.size(); i++)
+      this->signalTable.insert({{mySignals[i].interface, mySignals[i].member}, i});
+
+    this->monitorOwner = dbus.getNameOwner(interface.c_str());
+    this->monitor = !this->monitorOwner.empty();
 
     if (this->monitor) {
       this->callDbus = std::unique_ptr<DBus>(new DBus(busType));
 
       try {
-        std::vector<std::string> rules;
-
-        for (auto method : myMethods) {
-          std::string dest = "";
-          if (method.destination != "*") dest = ",destination="+method.destination;
-          rules.push_back("type='method_call',"
-                          "interface='"+method.interface+"',"
-                          "member='"+method.member+"'"+dest);
-        }
-
-        for (auto signal : mySignals)
-          rules.push_back("type='signal',"
-                          "interface='"+signal.interface+"',"
-                          "member='"+signal.member+"'");
-
-        // TODO: it may be possible to monitor only the method returns going to the sender that
-        // happens to be implementing this interface (destination=org.freedesktop.ScreenSaver)
-        rules.push_back("type='method_return'");
-
-        std::vector<const char*> Crules;
-        Crules.reserve(rules.size());
-
-        for (auto& r : rules) {
-          Crules.push_back(r.c_str());
-        }
+        this->becomeMonitor();
 
-        // TODO: becomeMonitor should provide an overloaded version taking a vector of std::string
-        dbus.becomeMonitor(Crules);
-
-        printf("[" ANSI_COLOR_GREEN "<->" ANSI_COLOR_RESET "] %s: Something "
-               "listening on this interface. Became monitor, will eavesdrop and feed events.\n",
-               interface.c_str());
+        Log::info("[" ANSI_COLOR_GREEN "<->" ANSI_COLOR_RESET "] %s: Something "
+                  "listening on this interface. Became monitor, will eavesdrop and feed events.",
+                  interface.c_str());
       } catch (DBus::UnknownInterfaceError& e) {
-        printf("[" ANSI_COLOR_YELLOW "->" ANSI_COLOR_RESET "] %s: "
-               "UNSUPPORTED: Something has this dbus interface implemented. Tried to become monitor"
-               " in order to eavesdrop but your dbus daemon doesn't appear to support that (it's "
-               "probably too old). We will still send events here. \n", interface.c_str());
+        Log::info("[" ANSI_COLOR_YELLOW "->" ANSI_COLOR_RESET "] %s: "
+                  "UNSUPPORTED: Something has this dbus interface implemented. Tried to become"
+                  " monitor in order to eavesdrop but your dbus daemon doesn't appear to support"
+                  " that (it's probably too old). We will still send events here.",
+                  interface.c_str());
       } catch (DBus::AccessDeniedError& e) {
-        printf("[" ANSI_COLOR_YELLOW "->" ANSI_COLOR_RESET "] %s: "
-               "ACCESS DENIED: Something has this dbus interface implemented. Tried to become a"
-               " monitor to eavesdrop but was denied access. You might need to give me setuid "
-               " (chown root uinhibitd && chmod 4755 uinhibitd). You might need to allow monitoring"
-               " in D-Bus config. We will still send events here.\n", interface.c_str());
+        Log::info("[" ANSI_COLOR_YELLOW "->" ANSI_COLOR_RESET "] %s: "
+                  "ACCESS DENIED: Something has this dbus interface implemented. Tried to become a"
+                  " monitor to eavesdrop but was denied access. You might need to give me setuid "
+                  " (chown root uinhibitd && chmod 4755 uinhibitd). You might need to allow"
+                  " monitoring in D-Bus config. We will still send events here.",
+                  interface.c_str());
       }
     } else {
       int ret = 0;
@@ -99,16 +81,16 @@ namespace uinhibit {
       try {
         ret = dbus.requestName(interface.c_str(), DBUS_NAME_FLAG_REPLACE_EXISTING);
       } catch (const DBus::AccessDeniedError& e) {
-        printf("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] %s: ACCESS DENIED: We tried to implement"
-               " this interface but dbus denied our name request. You might need to configure D-Bus"
-               " to allow us access (see README.md)\n", interface.c_str());
+        Log::info("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] %s: ACCESS DENIED: We tried to"
+                  " implement this interface but dbus denied our name request. You might need to"
+                  " configure D-Bus to allow us access (see README.md)", interface.c_str());
         return;
       }
 
       if (ret != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
-        printf("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] %s: Need to "
-               "implement this interface, but failed to obtain the interface name.\n",
-               interface.c_str());
+        Log::info("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] %s: Need to "
+                  "implement this interface, but failed to obtain the interface name.",
+                  interface.c_str());
       } else {
         std::vector<std::string> signalStrings;
 
@@ -119,13 +101,139 @@ namespace uinhibit {
 
         for (auto& str : signalStrings) dbus.addMatch(str.c_str());
 
-        printf("[" ANSI_COLOR_GREEN "<-" ANSI_COLOR_RESET "] %s: "
-               "Nothing listening on this interface. Implementing to receive events.\n",
-               interface.c_str());
+        Log::info("[" ANSI_COLOR_GREEN "<-" ANSI_COLOR_RESET "] %s: "
+                  "Nothing listening on this interface. Implementing to receive events.",
+                  interface.c_str());
       }
     }
   }
 
+  void DBusInhibitInterface::becomeMonitor() {
+    std::vector<std::string> rules;
+
+    for (auto method : myMethods) {
+      std::string dest = "";
+      if (method.destination != "*") dest = ",destination="+method.destination;
+      rules.push_back("type='method_call',"
+                      "interface='"+method.interface+"',"
+                      "member='"+method.member+"'"+dest);
+    }
+
+    for (auto signal : mySignals)
+      rules.push_back("type='signal',"
+                      "interface='"+signal.interface+"',"
+                      "member='"+signal.member+"'");
+
+    // Only the implementer's replies, not every method return on the bus. The bus matches a
+    // well-known sender against whoever owns it when the reply is sent, so this keeps working if
+    // the implementer restarts (a monitor can't change its rules, and we're likely no longer
+    // privileged enough to become one again).
+    rules.push_back("type='method_return',sender='"+this->interface+"'");
+
+    // So we know which unique name replies should come from
+    rules.push_back("type='signal',sender='" DBUS_SERVICE_DBUS "',interface='" DBUS_INTERFACE_DBUS
+                    "',member='NameOwnerChanged',arg0='"+this->interface+"'");
+
+    std::vector<const char*> Crules;
+    Crules.reserve(rules.size());
+
+    for (auto& r : rules) {
+      Crules.push_back(r.c_str());
+    }
+
+    // TODO: becomeMonitor should provide an overloaded version taking a vector of std::string
+    dbus.becomeMonitor(Crules);
+  }
+
+  DBusInhibitInterface::MemberRef DBusInhibitInterface::memberRef(DBus::Message& msg) {
+    const char* interface = msg.interface();
+    const char* member = msg.member();
+    return {interface ? interface : "", member ? member : ""};
+  }
+
+  void DBusInhibitInterface::forwardInhibit(uint32_t ourCookie, DBus::Message call,
+                                            std::function<void(uint32_t)> release) {
+    try {
+      call.sendAsync(this->forwardTimeoutMS, [this, ourCookie](DBus::Message reply) {
+        auto it = this->forwarded.find(ourCookie);
+        if (it == this->forwarded.end()) return;
+
+        uint32_t theirCookie = 0;
+        bool ok = reply.notNull();
+        if (ok) try {
+          reply.getArgs(DBUS_TYPE_UINT32, &theirCookie, DBUS_TYPE_INVALID);
+        } catch (DBus::Exception& e) { ok = false; }
+
+        if (!ok) {
+          Log::warn("no response to a dbus method call");
+          this->stats.noResponses.add();
+          this->stats.forwardFailures.add();
+          this->forwarded.erase(it);
+        } else if (it->second.released) {
+          it->second.release(theirCookie);
+          this->forwarded.erase(it);
+        } else {
+          it->second.theirCookie = theirCookie;
+        }
+      });
+    } catch (DBus::DisconnectedError& e) {
+      throw InhibitNoResponseException();
+    }
+
+    this->forwarded[ourCookie] = {std::nullopt, false, release};
+
+    // We're likely being called from another InhibitInterface's start(), make sure ours wakes up
+    // to take the reply timeout into account
+    this->wake();
+  }
+
+  void DBusInhibitInterface::unforwardInhibit(uint32_t ourCookie) {
+    auto it = this->forwarded.find(ourCookie);
+    if (it == this->forwarded.end()) return;
+
+    if (it->second.theirCookie) {
+      it->second.release(*it->second.theirCookie);
+      this->forwarded.erase(it);
+      this->wake(); // Likely called from elsewhere, make sure start() gets it sent
+    } else {
+      it->second.released = true; // Release as soon as we know what to release
+    }
+  }
+
+  bool DBusInhibitInterface::busy() {
+    if (InhibitInterface::busy() || this->dbus.hasMessagesToSend()) return true;
+    if (this->callDbus && this->callDbus->hasMessagesToSend()) return true;
+    for (auto& [ourCookie, f] : this->forwarded) if (f.released) return true; // Awaiting theirs
+    return false;
+  }
+
+  void DBusInhibitInterface::sendIntrospect(DBus::Message* msg,
+                                            const std::function<std::string()>& build) {
+    // Callers can introspect any path under ours (ie. made-up inhibitor cookies), don't let that
+    // grow forever
+    if (this->introspectGeneration != this->activeGeneration || this->introspectCache.size() > 64) {
+      this->introspectCache.clear();
+      this->introspectGeneration = this->activeGeneration;
+    }
+
+    std::string_view path = msg->path();
+    auto it = this->introspectCache.find(path);
+    if (it == this->introspectCache.end()) it = this->introspectCache.emplace(path, build()).first;
+
+    const char* introspectXml = it->second.c_str();
+    msg->newMethodReturn().appendArgs(DBUS_TYPE_STRING,&introspectXml,DBUS_TYPE_INVALID)->send();
+  }
+
+  static std::string_view orEmpty(const char* str) { return str ? str : ""; }
+
+  // The held call from caller with serial, if any
+  static auto findCall(std::unordered_multimap<uint32_t, DBus::Message>& calls,
+                       const char* caller, uint32_t serial) {
+    auto [it, end] = calls.equal_range(serial);
+    for (; it != end; it++) if (orEmpty(it->second.sender()) == orEmpty(caller)) return it;
+    return calls.end();
+  }
+
   static const char* currentExceptionTypeName() {
     int status;
     return abi::__cxa_demangle(abi::__cxa_current_exception_type()->name(), 0, 0, &status);
@@ -139,59 +247,106 @@ namespace uinhibit {
     }
 
     while(1) try {
-      dbus.readWriteDispatch(40);
+      dbus.readWrite(0);
+      dbus.handleTimeouts(); // ie. getCredentials() replies that never came
+
+      if (this->callDbus) {
+        // Replies (or timeouts) for calls we didn't block on, see forwardInhibit()
+        this->callDbus->readWrite(0);
+        this->callDbus->handleTimeouts();
+        this->callDbus->dispatch();
+      }
+
       while (1) try {
         auto msg = dbus.popMessage();
         if (msg.isNull()) break;
-        if (strcmp(msg.sender(),mName) == 0) continue;
-        if (strcmp(msg.sender(),mName2) == 0) continue;
 
-        if (msg.type() == DBUS_MESSAGE_TYPE_METHOD_CALL) {
-          for (auto& method : myMethods) {
-            if ((method.member == std::string(msg.member())) && 
-                (method.interface == std::string(msg.interface()))) {
-              if (this->monitor) this->methodCalls.insert({msg.serial(), msg});
-              else (this->*method.callback)(&msg, nullptr);
+        this->stats.dbusMessages.add();
+        if (strcmp(msg.sender(),mName) == 0 || strcmp(msg.sender(),mName2) == 0) {
+          this->stats.dbusIgnored.add();
+          continue;
+        }
 
-              break;
+        bool handled = false;
+
+        if (msg.type() == DBUS_MESSAGE_TYPE_METHOD_CALL) {
+          auto it = this->methodTable.find(memberRef(msg));
+          if (it != this->methodTable.end()) {
+            handled = true;
+            if (this->monitor) {
+              // Hold on to it until the implementer replies
+              auto held = findCall(this->methodCalls, msg.sender(), msg.serial());
+              if (held != this->methodCalls.end()) this->methodCalls.erase(held);
+              this->methodCalls.emplace(msg.serial(), std::move(msg));
+              continue;
             }
+            (this->*myMethods[it->second].callback)(&msg, nullptr);
           }
         }
 
-        if (msg.type() == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
-            this->methodCalls.contains(msg.replySerial())) {
-          auto callMsg = this->methodCalls.at(msg.replySerial());
-          // TODO myMethods should probably be a map
-          for (auto method : myMethods) {
-            if (method.member == callMsg.member()) {
-              (this->*method.callback)(&callMsg, &msg);
-              this->methodCalls.erase(msg.replySerial());
-              break;
-            }
+        bool implementerReply = msg.type() == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+          (!this->monitor || orEmpty(msg.sender()) == this->monitorOwner);
+        auto call = implementerReply ?
+          findCall(this->methodCalls, msg.destination(), msg.replySerial()) :
+          this->methodCalls.end();
+        if (call != this->methodCalls.end()) {
+          auto callMsg = std::move(call->second);
+          this->methodCalls.erase(call);
+          handled = true;
+
+          auto it = this->methodTable.find(memberRef(callMsg));
+          if (it != this->methodTable.end())
+            (this->*myMethods[it->second].callback)(&callMsg, &msg);
+        }
+
+        if (this->monitor && msg.type() == DBUS_MESSAGE_TYPE_SIGNAL &&
+            memberRef(msg) == MemberRef(DBUS_INTERFACE_DBUS, "NameOwnerChanged")) {
+          const char* name; const char* oldOwner; const char* newOwner;
+          msg.getArgs(DBUS_TYPE_STRING, &name, DBUS_TYPE_STRING, &oldOwner,
+                      DBUS_TYPE_STRING, &newOwner, DBUS_TYPE_INVALID);
+
+          // TODO: if nobody implements it anymore we should probably take it over
+          if (this->interface == name && newOwner[0] != '\0' && this->monitorOwner != newOwner) {
+            this->monitorOwner = newOwner;
+            this->methodCalls.clear(); // The old owner won't be replying to them
           }
         }
 
         if (msg.type() == DBUS_MESSAGE_TYPE_SIGNAL) {
-          // TODO mySignals should probably be a map
-          for (auto& signal : mySignals) {
-            if ((signal.member == std::string(msg.member())) &&
-                (signal.interface == std::string(msg.interface()))) {
-              (this->*signal.callback)(&msg);
-              break;
-            }
+          auto it = this->signalTable.find(memberRef(msg));
+          if (it != this->signalTable.end()) {
+            handled = true;
+            (this->*mySignals[it->second].callback)(&msg);
           }
         }
+
+        if (!handled) this->stats.dbusIgnored.add();
       } catch (DBus::InvalidArgsError& e) {
-        printf("Got invalid args for a method call, ignoring. (%s)\n", e.what());
+        Log::warn("Got invalid args for a method call, ignoring. (%s)", e.what());
         // TODO should we respond to the bad request in some way in this situation? Some apps
         // could hang waiting for a response.
       }
       this->poll();
-      co_await std::suspend_always();
+
+      // Handlers can leave messages queued (ie. a blocking call reads everything that arrives
+      // while it waits for its reply), in which case the socket might never become readable
+      if (dbus.dataRemains()) co_await this->waitFor({}, 0);
+      else {
+        auto fds = dbus.pollFds();
+        int32_t timeoutMS = dbus.timeoutMS();
+        if (this->callDbus) {
+          for (auto& fd : this->callDbus->pollFds()) fds.push_back(fd);
+          int32_t callTimeoutMS = this->callDbus->timeoutMS();
+          if (timeoutMS < 0 || (callTimeoutMS >= 0 && callTimeoutMS < timeoutMS))
+            timeoutMS = callTimeoutMS;
+        }
+        for (auto& fd : this->watchFds()) fds.push_back(fd);
+        co_await this->waitFor(fds, timeoutMS);
+      }
     }
     catch (DBus::DisconnectedError& e) {
-      printf(ANSI_COLOR_RED "DBus disconnection for interface %s. Trying to reconnect..."
-             ANSI_COLOR_RESET, this->interface.c_str());
+      Log::error("DBus disconnection for interface %s. Trying to reconnect...",
+                 this->interface.c_str());
 
       // TODO: we need to re-set ourselves up (as in what the constructor does)
       // note that this won't always work because some constructors need root,
@@ -202,17 +357,14 @@ namespace uinhibit {
         dbus.reconnect();
       } catch (...) { fail = true; }
 
-      if (!fail) printf(ANSI_COLOR_GREEN "reconnected\n" ANSI_COLOR_RESET);
-      else printf(ANSI_COLOR_RED "failed. Stopping inhibitor\n" ANSI_COLOR_RESET);
+      if (!fail) Log::info(ANSI_COLOR_GREEN "%s: reconnected" ANSI_COLOR_RESET,
+                           this->interface.c_str());
+      else Log::error("%s: failed to reconnect. Stopping inhibitor", this->interface.c_str());
 
-      if (fail) {
-        // TODO this situation seems to lead to segfault, possibly attempting to resume a returned
-        // coroutine
-        break;
-      }
+      if (fail) break;
     }
     catch (std::exception &e) {
-      printf("Unhandled exception %s: %s\n", currentExceptionTypeName(), e.what());
+      Log::error("Unhandled exception %s: %s", currentExceptionTypeName(), e.what());
     }
     catch (...) { std::terminate(); }
   }
@@ -18,6 +18,7 @@
 
 #include "InhibitInterface.hpp"
 #include "util.hpp"
+#include "Log.hpp"
 
 #include <X11/Xlib.h>
 #include <X11/extensions/scrnsaver.h>
@@ -31,19 +32,19 @@ THIS::THIS(std::function<void(InhibitInterface*,Inhibit)> inhibitCB,
   InhibitInterface(inhibitCB, unInhibitCB, "x11-dpms-xscreensaver")
 {
   if(!(this->dpy = XOpenDisplay(NULL))) {
-    printf("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] X11-dpms+xscreensaver: "
-           "Cannot open display '%s'.\n", XDisplayName(NULL));
+    Log::info("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] X11-dpms+xscreensaver: "
+              "Cannot open display '%s'.", XDisplayName(NULL));
     return;
   }
 
-  printf("[" ANSI_COLOR_GREEN "->" ANSI_COLOR_RESET "] X11-dpms+xscreensaver: "
-         "Feeding events, will disable screen blanking and xscreensaver upon screensaver"
-         " inhibit.\n");
+  Log::info("[" ANSI_COLOR_GREEN "->" ANSI_COLOR_RESET "] X11-dpms+xscreensaver: "
+            "Feeding events, will disable screen blanking and xscreensaver upon screensaver"
+            " inhibit.");
   this->ok = true;
 }
 
 InhibitInterface::ReturnObject THIS::start() {
-  while(1) co_await std::suspend_always();
+  while(1) co_await this->waitFor({});
 }
 
 void THIS::handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) {
@@ -53,34 +53,21 @@ void THIS::handleSimActivityMsg(DBus::Message* msg, DBus::Message* retmsg) {
     (uint64_t)time(NULL)
   };
 
-  // Clear any existing simActivity inhibits from this sender
-  std::vector<InhibitID> eraseIDs;
-  for (auto& [id, in] : this->activeInhibits) {
-    auto idc = id;
-    auto idStruct = reinterpret_cast<const _InhibitID*>(&id[0]);
-    if (idStruct->cookie == 0 && idStruct->sender == msg->sender()) eraseIDs.push_back(idc);
-  }
-  for (auto& id : eraseIDs) this->registerUnInhibit(id);
+  // Clear any existing simActivity inhibit from this sender
+  this->registerUnInhibit(i.id);
   this->inhibitOwners[std::string(msg->sender())].clear();
 
   // Register new inhibit
   this->registerInhibit(i);
   this->inhibitOwners[std::string(msg->sender())].push_back(i.id);
 
-  if (!this->monitor) msg->newMethodReturn().send();
-}
+  // (Re)start its expiry
+  if (this->simTimers.contains(i.id)) this->timers.cancel(this->simTimers.at(i.id));
+  this->simTimers[i.id] = this->timers.add(5*60*1000, [this, id = i.id]() mutable {
+    this->simTimers.erase(id);
+    this->inhibitOwners[internedString(id.str)].clear();
+    this->registerUnInhibit(id);
+  });
 
-void THIS::poll() {
-  // Unregister any expired inhibits
-  std::vector<InhibitID> eraseIDs;
-  for (auto& [id, in] : this->activeInhibits) {
-    auto idc = id;
-    auto idStruct = reinterpret_cast<const _InhibitID*>(&id[0]);
-    if (idStruct->cookie == 0 && in.created <= (time(NULL)-(60*5))) {
-      this->inhibitOwners[idStruct->sender].clear();
-      eraseIDs.push_back(idc);
-    }
-  }
-
-  for (auto& id : eraseIDs) this->registerUnInhibit(id);
+  if (!this->monitor) msg->newMethodReturn().send();
 }
@@ -17,6 +17,7 @@
 #include <cstdio>
 #include <unistd.h>
 #include "util.hpp"
+#include "Log.hpp"
 #include <cstring>
 #include <algorithm>
 
@@ -83,6 +84,8 @@ void THIS::handleUnInhibitMsg(DBus::Message* msg, DBus::Message* retmsg) {
   // TODO I don't think this is actually cleaning up properly
   std::remove_if(inhibitOwners[msg->sender()].begin(), inhibitOwners[msg->sender()].end(),
                  [&id](InhibitID eid) { return id == eid; });
+
+  if (!this->monitor) msg->newMethodReturn().send();
 }
 
 void THIS::handleIsInhibitedMsg(DBus::Message* msg, DBus::Message* retmsg) {
@@ -99,8 +102,7 @@ void THIS::handleGetInhibitors(DBus::Message* msg, DBus::Message* retmsg) {
 
   std::vector<std::string> paths;
   for (auto& [id, inhibit] : this->activeInhibits) {
-    auto idStruct = reinterpret_cast<_InhibitID*>(&inhibit.id[0]);
-    paths.push_back(std::string(PATH)+"/Inhibitor"+std::to_string(idStruct->cookie));
+    paths.push_back(std::string(PATH)+"/Inhibitor"+std::to_string(inhibit.id.cookie));
   }
 
   std::vector<const char*> flatPaths;
@@ -129,7 +131,7 @@ void THIS::handleGetFlags(DBus::Message* msg, DBus::Message* retmsg) {
     uint32_t cookie = this->inhibitorPathToCookie(msg->path());
     flags = us2gnomeType(this->inhibitFromCookie(cookie)->type);
   } catch (InhibitNotFoundException& e)  {
-    printf(INTERFACE ": Caller requested information about non-existant inhibit.\n");
+    Log::verbose(INTERFACE ": Caller requested information about non-existant inhibit.");
     // TODO: does dbus have a way for us to return an error to the caller?
   }
 
@@ -157,7 +159,7 @@ void THIS::handleGetAppID(DBus::Message* msg, DBus::Message* retmsg) {
     uint32_t cookie = this->inhibitorPathToCookie(msg->path()); 
     appidStr = this->inhibitFromCookie(cookie)->appname.c_str();
   } catch (InhibitNotFoundException& e) { 
-    printf(INTERFACE ": Caller requested information about non-existant inhibit.\n");
+    Log::verbose(INTERFACE ": Caller requested information about non-existant inhibit.");
     // TODO: does dbus have a way for us to return an error to the caller?
   }
 
@@ -173,7 +175,7 @@ void THIS::handleGetReason(DBus::Message* msg, DBus::Message* retmsg) {
     uint32_t cookie = this->inhibitorPathToCookie(msg->path());
     str = this->inhibitFromCookie(cookie)->reason.c_str();
   } catch (InhibitNotFoundException& e) {
-    printf(INTERFACE ": Caller requested information about non-existant inhibit.\n");
+    Log::verbose(INTERFACE ": Caller requested information about non-existant inhibit.");
     // TODO: does dbus have a way for us to return an error to the caller?
   }
 
@@ -181,19 +183,17 @@ void THIS::handleGetReason(DBus::Message* msg, DBus::Message* retmsg) {
 }
 
 void THIS::handleIntrospect(DBus::Message* msg, DBus::Message* retmsg) {
-  if (this->monitor || std::string(msg->destination()) != INTERFACE) return;
-
+  if (this->monitor || std::string_view(msg->destination()) != INTERFACE) return;
 
-  if (std::string(msg->path()) == "/")  {
-    const char* introspectXml = DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+  std::string_view path = msg->path();
+  if (path == "/") this->sendIntrospect(msg, []{
+    return DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
       "<node name='/'>"
       "  <node name='org/gnome/SessionManager' />"
       "</node>";
+  });
 
-    msg->newMethodReturn().appendArgs(DBUS_TYPE_STRING,&introspectXml,DBUS_TYPE_INVALID)->send();
-  }
-
-  if (std::string(msg->path()) == "/org/gnome/SessionManager")  {
+  if (path == "/org/gnome/SessionManager") this->sendIntrospect(msg, [this]{
     std::string xml = DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
       "<node name='" PATH "'>"
       "  <interface name='" INTERFACE "'>"
@@ -226,23 +226,19 @@ void THIS::handleIntrospect(DBus::Message* msg, DBus::Message* retmsg) {
                                         // no inhibitors
 
     for (auto& [id, inhibit] : this->activeInhibits) {
-      auto idStruct = reinterpret_cast<_InhibitID*>(&inhibit.id[0]);
-      xml += "<node name='Inhibitor"+std::to_string(idStruct->cookie)+"'/>";
+      xml += "<node name='Inhibitor"+std::to_string(inhibit.id.cookie)+"'/>";
     }
 
     xml += "</node>";
+    return xml;
+  });
 
-    const char* introspectXml = xml.c_str();
-
-    msg->newMethodReturn().appendArgs(DBUS_TYPE_STRING,&introspectXml,DBUS_TYPE_INVALID)->send();
-  }
-
-  if (std::string(msg->path()).rfind("/org/gnome/SessionManager/Inhibitor", 0) == 0)  {
+  if (path.starts_with(PATH "/Inhibitor")) this->sendIntrospect(msg, [this, msg]{
     std::string name = std::string(PATH "/Inhibitor")+"XXXX";
     uint32_t cookie = this->inhibitorPathToCookie(msg->path());
     if (cookie > 0) name = std::string(PATH "/Inhibitor")+std::to_string(cookie);
 
-    std::string xml = std::string(DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE)+
+    return std::string(DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE)+
       std::string("<node name='" PATH )+name+"'>"
       "  <interface name='" INTERFACE ".Inhibitor'>"
       "    <method name='GetAppId'>"
@@ -256,18 +252,13 @@ void THIS::handleIntrospect(DBus::Message* msg, DBus::Message* retmsg) {
       "    </method>"
       "  </interface>"
       "</node>";
-
-
-    const char* introspectXml = xml.c_str();
-    msg->newMethodReturn().appendArgs(DBUS_TYPE_STRING,&introspectXml,DBUS_TYPE_INVALID)->send();
-  }
+  });
 }
 
 void THIS::handleInhibitEvent(Inhibit inhibit) {
   if (this->monitor) return;
 
-  auto idStruct = reinterpret_cast<_InhibitID*>(&inhibit.id[0]);
-  std::string ret = std::string(PATH "/Inhibitor")+std::to_string(idStruct->cookie);
+  std::string ret = std::string(PATH "/Inhibitor")+std::to_string(inhibit.id.cookie);
   const char *str = ret.c_str();
   dbus.newSignal(PATH, INTERFACE, "InhibitorAdded")
     .appendArgs(DBUS_TYPE_OBJECT_PATH, &str, DBUS_TYPE_INVALID)
@@ -277,8 +268,7 @@ void THIS::handleInhibitEvent(Inhibit inhibit) {
 void THIS::handleUnInhibitEvent(Inhibit inhibit) {
   if (this->monitor) return;
 
-  auto idStruct = reinterpret_cast<_InhibitID*>(&inhibit.id[0]);
-  std::string ret = std::string(PATH "/Inhibitor")+std::to_string(idStruct->cookie);
+  std::string ret = std::string(PATH "/Inhibitor")+std::to_string(inhibit.id.cookie);
   const char *str = ret.c_str();
   dbus.newSignal(PATH, INTERFACE, "InhibitorRemoved")
     .appendArgs(DBUS_TYPE_OBJECT_PATH, &str, DBUS_TYPE_INVALID)
@@ -289,28 +279,25 @@ Inhibit THIS::doInhibit(InhibitRequest r) {
   if (us2gnomeType(r.type) == GnomeInhibitType::NONE) 
     throw uinhibit::InhibitRequestUnsupportedTypeException();
 
-  uint32_t cookie = 0;
+  uint32_t cookie = ++this->lastCookie;
   if (this->monitor) {  
     const char* appname = r.appname.c_str();
     const char* reason = r.reason.c_str();
     uint32_t zero = 0;
     uint32_t flags = (uint32_t)us2gnomeType(r.type);
 
-    try {
-      auto replymsg = callDbus
-        ->newMethodCall(INTERFACE, PATH, INTERFACE, "Inhibit")
-        .appendArgs(DBUS_TYPE_STRING, &appname, 
+    auto call = callDbus->newMethodCall(INTERFACE, PATH, INTERFACE, "Inhibit");
+    call.appendArgs(DBUS_TYPE_STRING, &appname, 
                     DBUS_TYPE_UINT32, &zero,
                     DBUS_TYPE_STRING, &reason, 
                     DBUS_TYPE_UINT32, &flags,
-                    DBUS_TYPE_INVALID)
-        ->sendAwait(500);
-      if(replymsg.notNull()) replymsg.getArgs(DBUS_TYPE_UINT32, &cookie, DBUS_TYPE_INVALID);
-    } catch (DBus::NoReplyError& e) {
-      throw InhibitNoResponseException();
-    } 
-  } else {
-    cookie = ++this->lastCookie;
+                    DBUS_TYPE_INVALID);
+
+    this->forwardInhibit(cookie, std::move(call), [this](uint32_t theirCookie) {
+      callDbus->newMethodCall(INTERFACE, PATH, INTERFACE, "Uninhibit")
+        .appendArgs(DBUS_TYPE_UINT32, &theirCookie, DBUS_TYPE_INVALID)
+        ->send();
+    });
   }
 
   Inhibit i = {gnomeType2us(us2gnomeType(r.type)), r.appname, r.reason, {}, (uint64_t)time(NULL)}; 
@@ -319,24 +306,11 @@ Inhibit THIS::doInhibit(InhibitRequest r) {
 }
 
 void THIS::doUnInhibit(InhibitID id) {
-  auto idStruct = reinterpret_cast<_InhibitID*>(&id[0]);
-  if (this->monitor) {
-    callDbus->newMethodCall(INTERFACE, PATH, INTERFACE, "Uninhibit")
-        .appendArgs(DBUS_TYPE_UINT32, &(idStruct->cookie), DBUS_TYPE_INVALID)
-        ->send();
-  }
+  if (this->monitor) this->unforwardInhibit(id.cookie);
 }
 
-InhibitID THIS::mkId(std::string sender, uint32_t cookie) {
-  _InhibitID idStruct = {this->instanceId, {}, cookie};
-
-  uint32_t size = (sender.size()>sizeof(idStruct.sender)) ? sizeof(idStruct.sender) : sender.size();
-  strncpy(idStruct.sender, sender.c_str(), size);
-  if(size>0) idStruct.sender[size]=0; // NULL terminate
-
-  auto ptr = reinterpret_cast<std::byte*>(&idStruct);
-  InhibitID id(ptr, ptr+sizeof(idStruct));
-  return id;
+InhibitID THIS::mkId(std::string_view sender, uint32_t cookie) {
+  return {this->instanceId, internString(sender), cookie};
 };
 
 InhibitType THIS::gnomeType2us(GnomeInhibitType gnomeInhibitType) {
@@ -378,8 +352,7 @@ uint32_t THIS::inhibitorPathToCookie(std::string path) {
 
 Inhibit* THIS::inhibitFromCookie(uint32_t cookie) {
   for (auto& [id,inhibit] : this->activeInhibits) {
-    auto idStruct = reinterpret_cast<_InhibitID*>(&inhibit.id[0]);
-    if (cookie == idStruct->cookie) return &inhibit;
+    if (cookie == inhibit.id.cookie) return &inhibit;
   }
   
   throw InhibitNotFoundException(); 
@@ -14,11 +14,112 @@
 // not, see <https://www.gnu.org/licenses/>.
 
 #include "InhibitInterface.hpp"
+#include <sys/eventfd.h>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
 
 static std::mutex lastInstanceIdMutex;
 static uint64_t lastInstanceId = 0;
 
+// Interned strings are freed once no active inhibit refers to them and they've gone unused for
+// internGraceMS, so a long-running daemon doesn't keep every D-Bus sender it ever saw. Handles
+// are never reused: a stale InhibitID just stops matching anything.
+struct Interned {
+  std::string str;
+  uint32_t refs = 0; // activeInhibits entries using it
+  int64_t lastUsedMS = 0;
+};
+static std::mutex internMutex;
+static std::unordered_map<uint32_t, Interned> internedStrings; // Nodes (and strs) never move
+static std::unordered_map<std::string_view, uint32_t> internHandles;
+static uint32_t lastHandle = 0;
+static int64_t lastSweepMS = 0;
+
+// Under internMutex
+static void sweepInterned(int64_t now) {
+  lastSweepMS = now;
+  for (auto it = internedStrings.begin(); it != internedStrings.end();) {
+    auto& [handle, interned] = *it;
+    if (interned.refs > 0 || now-interned.lastUsedMS < uinhibit::internGraceMS) { it++; continue; }
+    internHandles.erase(interned.str);
+    it = internedStrings.erase(it);
+  }
+}
+
 namespace uinhibit {
+  std::atomic<uint32_t> InhibitInterface::globalTypeCounts[INHIBIT_TYPE_BITS] = {};
+  int64_t InhibitInterface::debounceMS = 0;
+  int64_t internGraceMS = 60*1000;
+
+  uint32_t internString(std::string_view str) {
+    if (str.empty()) return 0;
+    std::lock_guard<std::mutex> lock(internMutex);
+    int64_t now = monotonicMS();
+
+    auto it = internHandles.find(str);
+    if (it != internHandles.end()) {
+      internedStrings.at(it->second).lastUsedMS = now;
+      return it->second;
+    }
+
+    if (now-lastSweepMS >= internGraceMS) sweepInterned(now);
+
+    uint32_t handle = ++lastHandle;
+    auto& interned = internedStrings.emplace(handle, Interned{std::string(str), 0, now})
+      .first->second;
+    internHandles.insert({interned.str, handle});
+    return handle;
+  }
+
+  std::string internedString(uint32_t handle) {
+    std::lock_guard<std::mutex> lock(internMutex);
+    auto it = internedStrings.find(handle);
+    return (it == internedStrings.end()) ? "" : it->second.str;
+  }
+
+  void retainString(uint32_t handle) {
+    std::lock_guard<std::mutex> lock(internMutex);
+    auto it = internedStrings.find(handle);
+    if (it != internedStrings.end()) it->second.refs++;
+  }
+
+  void releaseString(uint32_t handle) {
+    std::lock_guard<std::mutex> lock(internMutex);
+    auto it = internedStrings.find(handle);
+    if (it == internedStrings.end() || it->second.refs == 0) return;
+    it->second.refs--;
+    it->second.lastUsedMS = monotonicMS();
+  }
+
+  bool processRunning(std::string_view comm) {
+    static const auto processes = []{
+      std::unordered_set<std::string, StringHash, std::equal_to<>> ret;
+
+      DIR* proc = opendir("/proc");
+      if (proc == NULL) return ret;
+
+      while (dirent* e = readdir(proc)) {
+        if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+
+        int32_t fd = openat(dirfd(proc), (std::string(e->d_name)+"/comm").c_str(),
+                            O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue; // Exited since readdir()
+
+        char buf[64];
+        ssize_t r = read(fd, buf, sizeof(buf));
+        close(fd);
+        if (r <= 0) continue;
+        if (buf[r-1] == '\n') r--;
+        ret.emplace(buf, r);
+      }
+
+      closedir(proc);
+      return ret;
+    }();
+
+    return processes.contains(comm.substr(0, 15));
+  }
 
   InhibitInterface::InhibitInterface(std::function<void(InhibitInterface*, Inhibit)> inhibitCB,
                        std::function<void(InhibitInterface*, Inhibit)> unInhibitCB,
@@ -27,20 +128,109 @@ namespace uinhibit {
       lastInstanceIdMutex.lock();
       this->instanceId = lastInstanceId++;
       lastInstanceIdMutex.unlock();
+
+      this->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (this->wakeFd < 0) throw std::runtime_error("Failed to create eventfd");
     };
 
+  InhibitInterface::~InhibitInterface() {
+    for (auto& [id, inhibit] : this->activeInhibits) {
+      this->countInhibit(inhibit.type, -1);
+      releaseString(id.str);
+    }
+    close(this->wakeFd);
+  }
+
+  void InhibitInterface::wake() {
+    uint64_t one = 1;
+    [[maybe_unused]] auto r = write(this->wakeFd, &one, sizeof(one));
+  }
+
+  InhibitInterface::Wait InhibitInterface::waitFor(std::vector<pollfd> fds, int64_t timeoutMS) {
+    for (int64_t deadline : {this->timers.next(), this->spawner.next()}) {
+      if (deadline < 0) continue;
+      int64_t left = std::max<int64_t>(deadline - monotonicMS(), 0);
+      if (timeoutMS < 0 || left < timeoutMS) timeoutMS = left;
+    }
+
+    for (auto& fd : this->spawner.pollFds()) fds.push_back(fd);
+    fds.push_back({this->wakeFd, POLLIN, 0});
+    this->waitSet.set(fds, timeoutMS);
+    return {this};
+  }
+
+  void InhibitInterface::Wait::await_resume() {
+    // Reset wake() before the coroutine looks at whatever it was woken up for, so a wake() that
+    // races with that isn't lost
+    uint64_t count;
+    [[maybe_unused]] auto r = read(this->inhibitInterface->wakeFd, &count, sizeof(count));
+
+    this->inhibitInterface->timers.run();
+    this->inhibitInterface->spawner.reap();
+  }
+
   InhibitType InhibitInterface::inhibited() {
-    InhibitType ret = InhibitType::NONE;
+    uint32_t ret = InhibitType::NONE;
+    for (uint32_t i = 0; i < INHIBIT_TYPE_BITS; i++) if (this->typeCounts[i] > 0) ret |= (1 << i);
+    return static_cast<InhibitType>(ret);
+  }
+
+  InhibitType InhibitInterface::globalInhibited() {
+    uint32_t ret = InhibitType::NONE;
+    for (uint32_t i = 0; i < INHIBIT_TYPE_BITS; i++) if (globalTypeCounts[i] > 0) ret |= (1 << i);
+    return static_cast<InhibitType>(ret);
+  }
+
+  void InhibitInterface::countInhibit(InhibitType type, int32_t delta) {
+    for (uint32_t i = 0; i < INHIBIT_TYPE_BITS; i++) {
+      if ((type & (1 << i)) == 0) continue;
+      this->typeCounts[i] += delta;
+      globalTypeCounts[i] += delta;
+    }
+  }
+
+  bool InhibitInterface::addActive(const Inhibit& i) {
+    if (!this->activeInhibits.insert({i.id, i}).second) return false;
+    retainString(i.id.str);
+    this->countInhibit(i.type, 1);
+    this->activeGeneration++;
+    this->stats.active.add(1);
+    return true;
+  }
+
+  bool InhibitInterface::removeActive(const InhibitID& id, Inhibit* removed) {
+    auto it = this->activeInhibits.find(id);
+    if (it == this->activeInhibits.end()) return false;
 
-    for (auto& [id, inhibit] : this->activeInhibits)
-      ret = static_cast<InhibitType>(ret | inhibit.type);
+    *removed = std::move(it->second);
+    this->activeInhibits.erase(it);
+    releaseString(id.str);
+    this->countInhibit(removed->type, -1);
+    this->activeGeneration++;
+    this->stats.active.add(-1);
+    return true;
+  }
 
-    return ret;
+  // Counts failures of a forward to us (anything but an unsupported type) and rethrows
+  [[noreturn]] static void countForwardFailure(InhibitStats& stats) {
+    try { throw; }
+    catch (InhibitRequestUnsupportedTypeException& e) { throw; }
+    catch (InhibitNoResponseException& e) {
+      stats.noResponses.add();
+      stats.forwardFailures.add();
+      throw;
+    }
+    catch (...) { stats.forwardFailures.add(); throw; }
   }
 
   Inhibit InhibitInterface::inhibit(InhibitRequest i)  {
-    auto ii = this->doInhibit(i); 
-    activeInhibits.insert({ii.id, ii});
+    Inhibit ii;
+    int64_t begin = monotonicUS();
+    try { ii = this->doInhibit(i); } catch (...) { countForwardFailure(this->stats); }
+    this->stats.doInhibitUS.record(monotonicUS()-begin);
+    this->stats.inhibitsForwarded.add();
+
+    this->addActive(ii);
     this->callEvent(true, ii);
 
     return ii;
@@ -48,25 +238,36 @@ namespace uinhibit {
 
   void InhibitInterface::unInhibit(InhibitID id) {
     if (this->activeInhibits.contains(id)) {
-      auto mid = this->activeInhibits.at(id);
-      this->doUnInhibit(id);
-      this->activeInhibits.erase(id);
-      this->callEvent(false, mid);
+      int64_t begin = monotonicUS();
+      try { this->doUnInhibit(id); } catch (...) { countForwardFailure(this->stats); }
+      this->stats.doUnInhibitUS.record(monotonicUS()-begin);
+      this->stats.unInhibitsForwarded.add();
+
+      Inhibit mid;
+      if (this->removeActive(id, &mid)) this->callEvent(false, mid);
     }
     // TODO: else throw exception?
   }
 
   void InhibitInterface::registerInhibit(Inhibit& i) {
-    activeInhibits.insert({i.id, i});
+    this->stats.inhibitsReceived.add();
+    this->addActive(i);
+
+    int64_t begin = monotonicUS();
     this->inhibitCB(this, i);
+    this->stats.forwardUS.record(monotonicUS()-begin);
+
     this->callEvent(true, i);
   }
 
   void InhibitInterface::registerUnInhibit(InhibitID& id) {
-    if (this->activeInhibits.contains(id)) {
-      auto mid = this->activeInhibits.at(id);
-      this->activeInhibits.erase(id);
+    this->stats.unInhibitsReceived.add();
+
+    Inhibit mid;
+    if (this->removeActive(id, &mid)) {
+      int64_t begin = monotonicUS();
       this->unInhibitCB(this, mid);
+      this->stats.forwardUS.record(monotonicUS()-begin);
       this->callEvent(false, mid);
     }
   }
@@ -76,9 +277,41 @@ namespace uinhibit {
     else           this->handleUnInhibitEvent(i);
 
     InhibitType inhibited = this->inhibited();
-    if (inhibited != this->lastInhibitState) {
-      this->handleInhibitStateChanged(inhibited, i);
-      this->lastInhibitState = inhibited;
+    if (inhibited == this->lastInhibitState && this->stateTimer == 0) return;
+
+    // Suspend can't wait: we'd let the machine sleep (or keep it awake) for the window
+    bool suspendChanged = ((inhibited ^ this->lastInhibitState) & InhibitType::SUSPEND) != 0;
+    if (debounceMS <= 0 || suspendChanged) {
+      this->flushStateChange(i);
+      return;
+    }
+
+    // Not pushed back by further changes, so a steady flap still lands once per window
+    this->pendingStateInhibit = i;
+    if (this->stateTimer == 0) {
+      this->stateTimer = this->timers.add(debounceMS, [this] {
+        this->stateTimer = 0;
+        this->flushStateChange(this->pendingStateInhibit);
+      });
+      this->wake(); // Might be suspended without this deadline, ie. called from another interface
     }
   }
+
+  void InhibitInterface::flushStateChange() {
+    if (this->stateTimer != 0) this->flushStateChange(this->pendingStateInhibit);
+  }
+
+  bool InhibitInterface::busy() {
+    return this->stateTimer != 0 || this->spawner.busy();
+  }
+
+  void InhibitInterface::flushStateChange(const Inhibit& i) {
+    if (this->stateTimer != 0) this->timers.cancel(this->stateTimer);
+    this->stateTimer = 0;
+
+    InhibitType inhibited = this->inhibited();
+    if (inhibited == this->lastInhibitState) return; // Flapped back
+    this->handleInhibitStateChanged(inhibited, i);
+    this->lastInhibitState = inhibited;
+  }
 } // End namespace uinhibit
@@ -17,11 +17,15 @@
 #include <sys/inotify.h>
 #include <fcntl.h>
 #include "util.hpp"
+#include "Log.hpp"
 #include <algorithm>
+#include <cstring>
 
 #define THIS LinuxKernelInhibitInterface
 #define WAKE_LOCK_PATH "/sys/power/wake_lock"
 #define WAKE_UNLOCK_PATH "/sys/power/wake_unlock"
+#define SCAN_MIN_INTERVAL_MS 250
+#define SCAN_MAX_INTERVAL_MS 4000
 
 using namespace uinhibit;
 
@@ -32,23 +36,23 @@ THIS::THIS(std::function<void(InhibitInterface*,Inhibit)> inhibitCB,
           inhibitFork(inhibitFork)
 {
   if (access(WAKE_LOCK_PATH, F_OK) != 0) {
-    printf("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] Linux kernel wakelock: "
-           WAKE_LOCK_PATH " doesn't exist. You probably don't have CONFIG_PM_WAKELOCKS enabled"
-           " in your kernel.\n");
+    Log::info("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] Linux kernel wakelock: "
+              WAKE_LOCK_PATH " doesn't exist. You probably don't have CONFIG_PM_WAKELOCKS enabled"
+              " in your kernel.");
     return;
   }
 
   if (access(WAKE_UNLOCK_PATH, F_OK) != 0) {
-    printf("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] Linux kernel wakelock: "
-           WAKE_UNLOCK_PATH " doesn't exist. You probably don't have CONFIG_PM_WAKELOCKS enabled"
-           " in your kernel.\n");
+    Log::info("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] Linux kernel wakelock: "
+              WAKE_UNLOCK_PATH " doesn't exist. You probably don't have CONFIG_PM_WAKELOCKS enabled"
+              " in your kernel.");
     return;
   }
 
-  if (this->inhibitFork->rxLine() == "nowrite") {
-    printf("[" ANSI_COLOR_YELLOW "<-" ANSI_COLOR_RESET "] Linux kernel wakelock: "
-           "Don't have write access to " WAKE_LOCK_PATH ". You probably need to give me setuid "
-           "(chown root uinhibitd && chmod 4755 uinhibitd). We'll still try to read events.\n");
+  if (this->inhibitFork->rxWait().value == 0) {
+    Log::info("[" ANSI_COLOR_YELLOW "<-" ANSI_COLOR_RESET "] Linux kernel wakelock: "
+              "Don't have write access to " WAKE_LOCK_PATH ". You probably need to give me setuid "
+              "(chown root uinhibitd && chmod 4755 uinhibitd). We'll still try to read events.");
 
     canRead = true;
     return;
@@ -56,11 +60,11 @@ THIS::THIS(std::function<void(InhibitInterface*,Inhibit)> inhibitCB,
 
   canRead = true;
   canSend = true;
-  printf("[" ANSI_COLOR_GREEN "<->" ANSI_COLOR_RESET "] Linux kernel wakelock\n");
+  Log::info("[" ANSI_COLOR_GREEN "<->" ANSI_COLOR_RESET "] Linux kernel wakelock");
 };
 
 InhibitInterface::ReturnObject THIS::start() {
-  while (!canRead) co_await std::suspend_always();
+  while (!canRead) co_await this->waitFor({});
 
   std::jthread(&THIS::watcherThread, this).detach();
 
@@ -71,60 +75,68 @@ InhibitInterface::ReturnObject THIS::start() {
       for (auto& r : this->unregisterQueue) this->registerUnInhibit(r);
       this->registerQueue.clear();
       this->unregisterQueue.clear();
+      this->inhibitFork->flush(); // Everything doInhibit()/doUnInhibit() queued since last time
     }
-    co_await std::suspend_always();
+
+    this->handleForkResults();
+
+    std::vector<pollfd> fds;
+    if (!this->forkPending.empty()) fds.push_back({this->inhibitFork->rxFd(), POLLIN, 0});
+    co_await this->waitFor(fds);
   }
 }
 
+bool THIS::busy() {
+  return InhibitInterface::busy() || !this->forkPending.empty();
+}
+
 void THIS::watcherThread() {
-  /*int32_t inotifyFD = inotify_init();
-  if (inotifyFD == -1) throw std::runtime_error("Failed to create inotify instance");
+  // We must poll such that we capture locks that expire without inotify event. Poll quickly
+  // while locks are coming and going, backing off while nothing changes.
+  int64_t intervalMS = SCAN_MIN_INTERVAL_MS;
 
-  int32_t inotifyLockWD = inotify_add_watch(inotifyFD, "/sys/power/wake_lock", IN_MODIFY);
-  if (inotifyLockWD == -1) throw std::runtime_error("Failed to create inotify watch descriptor");
+  int32_t wakeLockFile = -1;
+  std::vector<char> buf(4096);
+  std::unordered_set<std::string, StringHash, std::equal_to<>> snapshot; // Last scan's lock names
+  std::unordered_set<std::string_view> current;
 
-  int32_t inotifyUnlockWD = inotify_add_watch(inotifyFD, "/sys/power/wake_unlock", IN_MODIFY);
-  if (inotifyUnlockWD == -1) throw std::runtime_error("Failed to create inotify watch descriptor");
+  while(1) {
+    if (wakeLockFile < 0) wakeLockFile = open(WAKE_LOCK_PATH, O_RDONLY | O_CLOEXEC);
 
-  struct InotifyEvent {
-    int      wd;
-    uint32_t mask;
-    uint32_t cookie;
-    uint32_t len;
-    char     name[NAME_MAX+1];
-  } inotifyEvent;*/
+    // Reading from offset 0 gets sysfs to regenerate the contents, so we can keep the fd
+    int64_t got = -1;
+    while (wakeLockFile >= 0 && (got = pread(wakeLockFile, buf.data(), buf.size(), 0)) >= 0 &&
+           got == (int64_t)buf.size()) buf.resize(buf.size()*2);
 
-  //while(read(inotifyFD, &inotifyEvent, sizeof(InotifyEvent)) > 0) {}
+    if (got < 0) {
+      if (wakeLockFile >= 0) close(wakeLockFile);
+      wakeLockFile = -1;
+      got = 0;
+    }
 
-  // Unfortunately we must poll such that we capture locks that expire without inotify event
-  while(1) {
-    int32_t wakeLockFile = open(WAKE_LOCK_PATH, O_RDONLY); // Must open every time to get
-                                                                   // latest info
- 
-    char buf[4096] = "";
-    std::vector<std::string> locks;
-    char prevChar = ' ';
-    int64_t got = -1;
-    while ((got = read(wakeLockFile, buf, 2)) > 0) {
-      for (int i = 0; i < got; i++) {
-        if (prevChar == ' ' && buf[i] != ' ' && buf[i] != '\n') locks.emplace_back();
-        if (buf[i] != ' ' && buf[i] != '\n') locks.back().push_back(buf[i]);
-        prevChar = buf[i];
-      }
+    current.clear();
+    std::string_view contents(buf.data(), got);
+    while (!contents.empty()) {
+      auto start = contents.find_first_not_of(" \n");
+      if (start == std::string_view::npos) break;
+      contents.remove_prefix(start);
+
+      auto end = std::min(contents.find_first_of(" \n"), contents.size());
+      current.insert(contents.substr(0, end));
+      contents.remove_prefix(end);
     }
 
-    // Check for any locks we have not tracked yet
-    for (auto lock : locks) {
-      bool exists = false;
-      // TODO activeInhibits mutex lock needed?
-      for (auto& [id, in] : this->activeInhibits) {
-        auto idStruct = reinterpret_cast<const _InhibitID*>(&id[0]);
-        if (strcmp(idStruct->lockName, lock.c_str()) == 0) exists = true;
-      }
+    std::vector<std::string> added;
+    std::vector<std::string> removed;
+    for (auto lock : current) if (!snapshot.contains(lock)) added.emplace_back(lock);
+    for (auto& lock : snapshot) if (!current.contains(lock)) removed.push_back(lock);
 
-      if (!exists) {
-        std::unique_lock<std::mutex> lk(this->registerMutex);
-        auto id = this->mkId(lock.c_str());
+    if (!added.empty() || !removed.empty()) {
+      std::unique_lock<std::mutex> lk(this->registerMutex);
+      for (auto& lock : added) {
+        snapshot.insert(lock);
+
+        auto id = this->mkId(lock);
         if (!this->ourInhibits.contains(id))
           registerQueue.push_back({
             InhibitType::SUSPEND,
@@ -134,47 +146,69 @@ void THIS::watcherThread() {
               (uint64_t)time(NULL)
           });
       }
-    }
 
-    // Check for any locks we are tracking and have been removed
-    for (auto& [id, in] : this->activeInhibits) {
-      auto idStruct = reinterpret_cast<const _InhibitID*>(&id[0]);
-      bool exists = false;
-      for (auto lock : locks) {
-        if (strcmp(idStruct->lockName, lock.c_str()) == 0) exists = true;
-      }
+      for (auto& lock : removed) {
+        snapshot.erase(lock);
 
-      if (!exists && !this->ourInhibits.contains(id)) {
-        std::unique_lock<std::mutex> lk(this->registerMutex);
-        this->unregisterQueue.push_back(this->mkId(idStruct->lockName));
+        auto id = this->mkId(lock);
+        if (!this->ourInhibits.contains(id)) this->unregisterQueue.push_back(id);
       }
+
+      if (!this->registerQueue.empty() || !this->unregisterQueue.empty()) this->wake();
     }
 
-    close(wakeLockFile);
-    usleep(500*1000);
+    if (!added.empty() || !removed.empty()) intervalMS = SCAN_MIN_INTERVAL_MS;
+    else intervalMS = std::min(intervalMS*2, (int64_t)SCAN_MAX_INTERVAL_MS);
+    usleep(intervalMS*1000);
+  }
+}
+
+void THIS::handleForkResults() {
+  ForkMessage result;
+  while (!this->forkPending.empty()) {
+    if (!this->inhibitFork->rxMessage(result)) {
+      if (!this->inhibitFork->rxReady()) break;
+      this->inhibitFork->rxFill();
+      continue;
+    }
+
+    if (result.op != LinuxKernelInhibitFork::RESULT) continue;
+    auto it = this->forkPending.find(result.id);
+    if (it == this->forkPending.end()) continue;
+    auto [op, lockName] = it->second;
+    this->forkPending.erase(it);
+
+    if (result.value == 0 || op != LinuxKernelInhibitFork::LOCK) continue;
+
+    Log::warn("failed to take kernel wakelock '%s': %s", lockName.c_str(), strerror(result.value));
+
+    // The kernel never had it, so watcherThread() won't see it go away. Release it ourselves.
+    auto id = this->mkId(lockName);
+    {
+      std::unique_lock<std::mutex> lk(this->registerMutex);
+      this->ourInhibits.erase(id);
+    }
+    this->registerUnInhibit(id);
   }
-  //close(inotifyFD);
 }
 
 Inhibit THIS::doInhibit(InhibitRequest r) {
   if ((r.type & InhibitType::SUSPEND) == InhibitType::NONE)
     throw uinhibit::InhibitRequestUnsupportedTypeException();
 
+  if (!canSend) throw uinhibit::InhibitRequestUnsupportedTypeException();
+
   // TODO: appname-reason isn't gauranteed to be completely unique.
-  // Ideally we'd use InhibitID in some way, but it's an opaque type currently.
-  // InhibitID should probably be refactored to be a class that has a 'serialize' method.
-  //
-  // Alternatively InhibitID could just a be string-encoded type. This would get around the
-  // annoyances of using custom types in a std::map etc
 
   std::unique_lock<std::mutex> lk(this->registerMutex);
 
-  auto id = this->mkId((r.appname+"-"+r.reason).c_str());
+  auto lockName = cleanLockName(r.appname+"-"+r.reason);
+  auto id = this->mkId(lockName);
 
   this->ourInhibits.insert(id);
 
-  // Tell our setuid fork to add the inhibit
-  this->inhibitFork->tx(r.appname+'-'+r.reason+'\n');
+  // Tell our setuid fork to add the inhibit (from start(), batched with anything else queued)
+  this->sendToFork(LinuxKernelInhibitFork::LOCK, lockName);
 
   return {
     InhibitType::SUSPEND,
@@ -189,8 +223,9 @@ void THIS::doUnInhibit(InhibitID id) {
   if (this->activeInhibits.contains(id)) {
     std::unique_lock<std::mutex> lk(this->registerMutex);
     auto r = this->activeInhibits[id];
-    auto id = this->mkId((r.appname+"-"+r.reason).c_str());
-    this->inhibitFork->tx('\t'+r.appname+'-'+r.reason+'\n');
+    auto lockName = cleanLockName(r.appname+"-"+r.reason);
+    auto id = this->mkId(lockName);
+    this->sendToFork(LinuxKernelInhibitFork::UNLOCK, lockName);
     this->ourInhibits.erase(id);
   }
 }
@@ -199,15 +234,20 @@ void THIS::handleInhibitEvent(Inhibit inhibit) {}
 void THIS::handleUnInhibitEvent(Inhibit inhibit) {}
 void THIS::handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) {}
 
-InhibitID THIS::mkId(const char* lockName) {
-  std::string cleanLockName(lockName);
-  cleanLockName.erase(std::remove(cleanLockName.begin(), cleanLockName.end(), ' '),
-                      cleanLockName.end());
+void THIS::sendToFork(uint8_t op, const std::string& lockName) {
+  uint32_t requestId = ++this->lastRequestId;
+  this->forkPending[requestId] = {op, lockName};
+  this->inhibitFork->queue(op, requestId, 0, {lockName});
+  this->wake();
+}
 
-  _InhibitID idStruct = {this->instanceId, {}};
-  strncpy(idStruct.lockName, cleanLockName.c_str(), sizeof(idStruct.lockName)-1);
+// The kernel stops reading a lock name at the first space
+std::string THIS::cleanLockName(std::string_view lockName) {
+  std::string clean(lockName);
+  clean.erase(std::remove(clean.begin(), clean.end(), ' '), clean.end());
+  return clean;
+}
 
-  auto ptr = reinterpret_cast<std::byte*>(&idStruct);
-  InhibitID id(ptr, ptr+sizeof(idStruct));
-  return id;
+InhibitID THIS::mkId(std::string_view lockName) {
+  return {this->instanceId, internString(cleanLockName(lockName)), 0};
 }
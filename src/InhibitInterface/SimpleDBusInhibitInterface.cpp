@@ -112,20 +112,18 @@ void THIS::handleNameLostMsg(DBus::Message* msg) {
 }
 
 void THIS::handleIntrospect(DBus::Message* msg, DBus::Message* retmsg) {
-  if (this->monitor || std::string(msg->destination()) != this->interface) return;
+  if (this->monitor || std::string_view(msg->destination()) != this->interface) return;
 
-  if (std::string(msg->path()) == "/")  {
-    std::string xml = DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+  std::string_view path = msg->path();
+  if (path == "/") this->sendIntrospect(msg, [this]{
+    return DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
       "<node name='/'>"
       "  <node name='"+this->path+"' />"
       "</node>";
+  });
 
-    const char* introspectXml = xml.c_str();
-    msg->newMethodReturn().appendArgs(DBUS_TYPE_STRING,&introspectXml,DBUS_TYPE_INVALID)->send();
-  } 
-
-  if (std::string(msg->path()) == "/"+this->path)  {
-    std::string xml = DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+  if (path.starts_with('/') && path.substr(1) == this->path) this->sendIntrospect(msg, [this]{
+    return DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
       "<node name='"+this->path+"'>"
       "  <interface name=\""+this->interface+"\">"
       "    <method name='Inhibit'>"
@@ -139,37 +137,35 @@ void THIS::handleIntrospect(DBus::Message* msg, DBus::Message* retmsg) {
       +this->extraIntrospect+
       "  </interface>"
       "</node>";
-
-    const char* introspectXml = xml.c_str();
-    msg->newMethodReturn().appendArgs(DBUS_TYPE_STRING,&introspectXml,DBUS_TYPE_INVALID)->send();
-  }
+  });
 }
 
 Inhibit THIS::doInhibit(InhibitRequest r) {
   if ((r.type & this->inhibitType) == InhibitType::NONE)
     throw uinhibit::InhibitRequestUnsupportedTypeException();
-  uint32_t cookie = 0;
+
+  this->lastCookie++;
+  if (this->lastCookie == 0) this->lastCookie = 1;
+  uint32_t cookie = this->lastCookie;
+
   if (this->monitor) {
     const char* appname = r.appname.c_str();
     const char* reason = r.reason.c_str();
 
-    try {
-      auto replymsg = callDbus->newMethodCall(this->interface.c_str(),
-                                              ("/"+this->path).c_str(),
-                                              this->interface.c_str(),
-                                              "Inhibit")
-        .appendArgs(DBUS_TYPE_STRING, &appname,
-                    DBUS_TYPE_STRING, &reason, DBUS_TYPE_INVALID)
-        ->sendAwait(500);
-      if(replymsg.notNull()) replymsg.getArgs(DBUS_TYPE_UINT32, &cookie, DBUS_TYPE_INVALID);
-    } catch (DBus::NoReplyError& e) {
-      throw InhibitNoResponseException();
-    }
-  } else {
-    this->lastCookie++;
-    if (this->lastCookie == 0) this->lastCookie = 1;
-
-    cookie = this->lastCookie;
+    auto call = callDbus->newMethodCall(this->interface.c_str(),
+                                        ("/"+this->path).c_str(),
+                                        this->interface.c_str(),
+                                        "Inhibit");
+    call.appendArgs(DBUS_TYPE_STRING, &appname, DBUS_TYPE_STRING, &reason, DBUS_TYPE_INVALID);
+
+    this->forwardInhibit(cookie, std::move(call), [this](uint32_t theirCookie) {
+      callDbus->newMethodCall(this->interface.c_str(),
+                              ("/"+this->path).c_str(),
+                              this->interface.c_str(),
+                              "UnInhibit")
+        .appendArgs(DBUS_TYPE_UINT32, &theirCookie, DBUS_TYPE_INVALID)
+        ->send();
+    });
   }
 
   Inhibit i = {this->inhibitType, r.appname, r.reason, {}, (uint64_t)time(NULL)}; 
@@ -178,25 +174,9 @@ Inhibit THIS::doInhibit(InhibitRequest r) {
 }
 
 void THIS::doUnInhibit(InhibitID id) {
-  auto idStruct = reinterpret_cast<_InhibitID*>(&id[0]);
-  if (this->monitor) {
-    callDbus->newMethodCall(this->interface.c_str(),
-                            ("/"+this->path).c_str(),
-                            this->interface.c_str(),
-                            "UnInhibit")
-        .appendArgs(DBUS_TYPE_UINT32, &(idStruct->cookie), DBUS_TYPE_INVALID)
-        ->send();
-  }
+  if (this->monitor) this->unforwardInhibit(id.cookie);
 }
 
-InhibitID THIS::mkId(std::string sender, uint32_t cookie) {
-  _InhibitID idStruct = {this->instanceId, {}, cookie};
-
-  uint32_t size = (sender.size()>sizeof(idStruct.sender)) ? sizeof(idStruct.sender) : sender.size();
-  strncpy(idStruct.sender, sender.c_str(), size);
-  if(size>0) idStruct.sender[size]=0; // NULL terminate
-
-  auto ptr = reinterpret_cast<std::byte*>(&idStruct);
-  InhibitID id(ptr, ptr+sizeof(idStruct));
-  return id;
+InhibitID THIS::mkId(std::string_view sender, uint32_t cookie) {
+  return {this->instanceId, internString(sender), cookie};
 };
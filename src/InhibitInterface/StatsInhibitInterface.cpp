@@ -0,0 +1,228 @@
+// Copyright (C) 2022 Matthew Egeler
+//
+// This file is part of unified-inhibit.
+//
+// unified-inhibit is free software: you can redistribute it and/or modify it under the terms of the
+// GNU General Public License as published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// unified-inhibit is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with unified-inhibit. If
+// not, see <https://www.gnu.org/licenses/>.
+
+#include "InhibitInterface.hpp"
+#include <cstdio>
+#include <unistd.h>
+#include "util.hpp"
+#include "Log.hpp"
+#include <cstring>
+#include <sys/stat.h>
+
+#define THIS StatsInhibitInterface
+#define METHOD_CAST (void (DBusInhibitInterface::*)(DBus::Message* msg, DBus::Message* retmsg))
+#define INTERFACE "org.unifiedinhibit.Stats"
+#define PROPERTIES_INTERFACE "org.freedesktop.DBus.Properties"
+#define INTROSPECT_INTERFACE "org.freedesktop.DBus.Introspectable"
+#define PATH "/org/unifiedinhibit/Stats"
+#define RELPATH "org/unifiedinhibit/Stats"
+#define STATS_SIGNATURE "a{sa{st}}"
+
+using namespace uinhibit;
+
+std::atomic<bool> THIS::dumpRequested = false;
+std::atomic<StatsInhibitInterface*> THIS::instance = nullptr;
+
+THIS::THIS(std::function<void(InhibitInterface*, Inhibit)> inhibitCB,
+           std::function<void(InhibitInterface*, Inhibit)> unInhibitCB,
+           const std::vector<InhibitInterface*>* inhibitors,
+           std::string dumpPath)
+  : DBusInhibitInterface
+    (inhibitCB, unInhibitCB, INTERFACE, INTERFACE, DBUS_BUS_SESSION,
+     {
+       {PROPERTIES_INTERFACE, "Get", METHOD_CAST &THIS::handleGetProperty, INTERFACE},
+       {PROPERTIES_INTERFACE, "GetAll", METHOD_CAST &THIS::handleGetAllProperties, INTERFACE},
+       {INTROSPECT_INTERFACE, "Introspect", METHOD_CAST &THIS::handleIntrospect, INTERFACE}
+     },
+     {}),
+    inhibitors(inhibitors),
+    dumpPath(dumpPath)
+{
+  instance = this;
+}
+
+THIS::~THIS() {
+  StatsInhibitInterface* us = this;
+  instance.compare_exchange_strong(us, nullptr);
+}
+
+void THIS::requestDump() {
+  dumpRequested = true;
+  StatsInhibitInterface* i = instance;
+  if (i != nullptr) i->wake();
+}
+
+std::vector<std::pair<std::string, std::vector<std::pair<std::string, uint64_t>>>>
+THIS::snapshot() {
+  std::vector<std::pair<std::string, std::vector<std::pair<std::string, uint64_t>>>> ret;
+  for (auto i : *this->inhibitors) {
+    if (i == this) continue;
+    ret.push_back({i->name, i->stats.snapshot()});
+  }
+  return ret;
+}
+
+void THIS::appendStats(DBusMessageIter* iter) {
+  DBusMessageIter arrayIter;
+  dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sa{st}}", &arrayIter);
+
+  for (auto& [name, values] : this->snapshot()) {
+    const char* nameStr = name.c_str();
+    DBusMessageIter entryIter, valuesIter;
+    dbus_message_iter_open_container(&arrayIter, DBUS_TYPE_DICT_ENTRY, NULL, &entryIter);
+    dbus_message_iter_append_basic(&entryIter, DBUS_TYPE_STRING, &nameStr);
+    dbus_message_iter_open_container(&entryIter, DBUS_TYPE_ARRAY, "{st}", &valuesIter);
+
+    for (auto& [key, value] : values) {
+      const char* keyStr = key.c_str();
+      uint64_t v = value;
+      DBusMessageIter valueIter;
+      dbus_message_iter_open_container(&valuesIter, DBUS_TYPE_DICT_ENTRY, NULL, &valueIter);
+      dbus_message_iter_append_basic(&valueIter, DBUS_TYPE_STRING, &keyStr);
+      dbus_message_iter_append_basic(&valueIter, DBUS_TYPE_UINT64, &v);
+      dbus_message_iter_close_container(&valuesIter, &valueIter);
+    }
+
+    dbus_message_iter_close_container(&entryIter, &valuesIter);
+    dbus_message_iter_close_container(&arrayIter, &entryIter);
+  }
+
+  dbus_message_iter_close_container(iter, &arrayIter);
+}
+
+void THIS::handleGetProperty(DBus::Message* msg, DBus::Message* retmsg) {
+  if (this->monitor) return;
+  const char* interface; const char* property;
+  msg->getArgs(DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &property, DBUS_TYPE_INVALID);
+
+  if (std::string_view(interface) != INTERFACE || std::string_view(property) != "Stats") return;
+
+  // TODO abstract this properly in DBus wrapper
+  auto ret = msg->newMethodReturn();
+
+  DBusMessageIter iter, variantIter;
+  dbus_message_iter_init_append(ret.msg, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT, STATS_SIGNATURE, &variantIter);
+  this->appendStats(&variantIter);
+  dbus_message_iter_close_container(&iter, &variantIter);
+
+  ret.send();
+}
+
+void THIS::handleGetAllProperties(DBus::Message* msg, DBus::Message* retmsg) {
+  if (this->monitor) return;
+  const char* interface;
+  msg->getArgs(DBUS_TYPE_STRING, &interface, DBUS_TYPE_INVALID);
+
+  auto ret = msg->newMethodReturn();
+
+  DBusMessageIter iter, arrayIter;
+  dbus_message_iter_init_append(ret.msg, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &arrayIter);
+
+  if (std::string_view(interface) == INTERFACE) {
+    const char* name = "Stats";
+    DBusMessageIter entryIter, variantIter;
+    dbus_message_iter_open_container(&arrayIter, DBUS_TYPE_DICT_ENTRY, NULL, &entryIter);
+    dbus_message_iter_append_basic(&entryIter, DBUS_TYPE_STRING, &name);
+    dbus_message_iter_open_container(&entryIter, DBUS_TYPE_VARIANT, STATS_SIGNATURE, &variantIter);
+    this->appendStats(&variantIter);
+    dbus_message_iter_close_container(&entryIter, &variantIter);
+    dbus_message_iter_close_container(&arrayIter, &entryIter);
+  }
+
+  dbus_message_iter_close_container(&iter, &arrayIter);
+  ret.send();
+}
+
+void THIS::handleIntrospect(DBus::Message* msg, DBus::Message* retmsg) {
+  if (this->monitor) return;
+
+  std::string_view path = msg->path();
+  if (path == "/") this->sendIntrospect(msg, []{
+    return DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+      "<node name='/'>"
+      "  <node name='" RELPATH "' />"
+      "</node>";
+  });
+  else if (path == PATH) this->sendIntrospect(msg, []{
+    return DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+      "<node name='" PATH "'>"
+      "  <interface name='" PROPERTIES_INTERFACE "'>"
+      "    <method name='Get'>"
+      "      <arg type='s' name='interface_name' direction='in'/>"
+      "      <arg type='s' name='property_name' direction='in'/>"
+      "      <arg type='v' name='value' direction='out'/>"
+      "    </method>"
+      "    <method name='GetAll'>"
+      "      <arg type='s' name='interface_name' direction='in'/>"
+      "      <arg type='a{sv}' name='properties' direction='out'/>"
+      "    </method>"
+      "  </interface>"
+      "  <interface name='" INTROSPECT_INTERFACE "'>"
+      "    <method name='Introspect'>"
+      "      <arg name='xml_data' type='s' direction='out'/>"
+      "    </method>"
+      "  </interface>"
+      "  <interface name='" INTERFACE "'>"
+      "    <property name='Stats' type='" STATS_SIGNATURE "' access='read'/>"
+      "  </interface>"
+      "</node>";
+  });
+}
+
+void THIS::poll() {
+  if (dumpRequested.exchange(false)) this->dump();
+}
+
+void THIS::dump() {
+  // Write then rename, so readers never see half a dump. dumpPath may be under /tmp, where anyone
+  // could have made the directory (or planted symlinks) before us.
+  std::string dir = this->dumpPath.substr(0, this->dumpPath.rfind('/'));
+  if (!dir.empty() && !privateDir(dir)) {
+    Log::warn("not writing stats to %s: %s", dir.c_str(), strerror(errno));
+    return;
+  }
+
+  std::string tmpPath = this->dumpPath+".tmp";
+  int fd = exclusiveCreate(tmpPath);
+  FILE* f = (fd < 0) ? NULL : fdopen(fd, "w");
+  if (f == NULL) {
+    Log::warn("failed to write stats to %s: %s", tmpPath.c_str(), strerror(errno));
+    if (fd >= 0) close(fd);
+    return;
+  }
+
+  for (auto& [name, values] : this->snapshot()) {
+    fprintf(f, "%s\n", name.c_str());
+    for (auto& [key, value] : values) fprintf(f, "  %-24s %lu\n", key.c_str(), value);
+  }
+
+  bool ok = (fclose(f) == 0);
+  if (ok && rename(tmpPath.c_str(), this->dumpPath.c_str()) == 0) {
+    Log::info("Wrote stats to %s", this->dumpPath.c_str());
+  } else {
+    Log::warn("failed to write stats to %s: %s", this->dumpPath.c_str(), strerror(errno));
+    unlink(tmpPath.c_str());
+  }
+}
+
+Inhibit THIS::doInhibit(InhibitRequest r) {
+  throw InhibitRequestUnsupportedTypeException();
+}
+
+void THIS::doUnInhibit(InhibitID id) {
+  throw InhibitRequestUnsupportedTypeException();
+}
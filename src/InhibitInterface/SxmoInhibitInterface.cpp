@@ -16,35 +16,53 @@
 
 #include "InhibitInterface.hpp"
 #include "util.hpp"
+#include "Log.hpp"
 #include <sys/inotify.h>
 #include <algorithm>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
 
 #define THIS SxmoInhibitInterface
+#define COALESCE_MS 50       // Rescan once inotify has been quiet this long...
+#define COALESCE_MAX_MS 250  // ...or this long after the first event, whichever is sooner
 
 using namespace uinhibit;
 
+// Lines sxmo itself keeps in can_suspend
+static const std::unordered_set<std::string_view> sxmoNoise = {
+  "Playing with leds",
+  "Checking some mutexes",
+};
+
 THIS::THIS(std::function<void(InhibitInterface*,Inhibit)> inhibitCB,
            std::function<void(InhibitInterface*,Inhibit)> unInhibitCB) :
   InhibitInterface(inhibitCB, unInhibitCB, "sxmo")
 {
-  int32_t r = system("sxmo_mutex.sh can_suspend list > /dev/null 2> /dev/null");
-  bool sxmoMutexExists = (r == 0);
+  const char* xdgRuntimeDir = getenv("XDG_RUNTIME_DIR");
+  bool sxmoMutexExists = inPath("sxmo_mutex.sh");
 
   if (!sxmoMutexExists) {
-    printf("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] Sxmo: "
-           "Can't find sxmo_mutex.sh. You probably don't have Sxmo. \n");
+    Log::info("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] Sxmo: "
+              "Can't find sxmo_mutex.sh. You probably don't have Sxmo.");
+  } else if (xdgRuntimeDir == NULL) {
+    Log::info("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] Sxmo: "
+              "XDG_RUNTIME_DIR isn't set, can't find sxmo's mutexes.");
   } else {
-    printf("[" ANSI_COLOR_GREEN "<->" ANSI_COLOR_RESET "] Sxmo: "
-           "Feeding via 'sxmo_mutex.sh can_suspend lock|free'. Will map sent screensaver+suspend"
-           " events to can_suspend. Will also read suspend events. If running in ssh/tty, you need"
-           " to run 'export DBUS_SESSION_BUS_ADDRESS=$(cat $XDG_RUNTIME_DIR/dbus.bus)' before"
-           " starting uinhibitd\n");
+    this->mutexDir = std::string(xdgRuntimeDir)+"/sxmo_mutex";
+    this->canSuspend = this->mutexDir+"/can_suspend";
+
+    Log::info("[" ANSI_COLOR_GREEN "<->" ANSI_COLOR_RESET "] Sxmo: "
+              "Feeding via sxmo's can_suspend mutex. Will map sent screensaver+suspend"
+              " events to can_suspend. Will also read suspend events. If running in ssh/tty, you"
+              " need to run 'export DBUS_SESSION_BUS_ADDRESS=$(cat $XDG_RUNTIME_DIR/dbus.bus)' before"
+              " starting uinhibitd");
     this->ok = true;
   }
 }
 
 InhibitInterface::ReturnObject THIS::start() {
-  while (!ok) co_await std::suspend_always();
+  while (!ok) co_await this->waitFor({});
 
   std::jthread(&THIS::watcherThread, this).detach();
 
@@ -57,135 +75,128 @@ InhibitInterface::ReturnObject THIS::start() {
       this->registerQueue.clear();
       this->unregisterQueue.clear();
     }
-    co_await std::suspend_always();
+    co_await this->waitFor({});
+  }
+}
+
+// Returns false if inotify has nothing more for us (fd is non-blocking)
+static bool drainInotify(int32_t inotifyFD, bool& rewatch) {
+  alignas(inotify_event) char buf[4096];
+  bool any = false;
+
+  ssize_t len;
+  while ((len = read(inotifyFD, buf, sizeof(buf))) > 0) {
+    any = true;
+    for (char* p = buf; p < buf+len; p += sizeof(inotify_event)+((inotify_event*)p)->len) {
+      auto event = (inotify_event*)p;
+
+      // can_suspend gets constantly deleted and recreated. Need to remake our watch when this
+      // happens.
+      if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_CREATE | IN_MOVED_TO)) rewatch = true;
+    }
   }
+
+  return any;
 }
 
 void THIS::watcherThread() {
-  std::string xdgRuntimeDir = getenv("XDG_RUNTIME_DIR");
-  std::string can_suspend = xdgRuntimeDir + "/sxmo_mutex/can_suspend";
-  std::string can_suspend_dir = xdgRuntimeDir + "/sxmo_mutex/";
+  mkdir(this->mutexDir.c_str(), 0700); // Like sxmo_mutex.sh does, so we can watch it
 
-  int32_t inotifyFD = inotify_init();
+  int32_t inotifyFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
   if (inotifyFD == -1) throw std::runtime_error("Failed to create inotify instance");
 
-  int32_t inotifyLockWD = inotify_add_watch(inotifyFD,
-                                            can_suspend.c_str(),
+  // The file watch fails while can_suspend doesn't exist, the directory watch tells us when it does
+  int32_t inotifyLockWD = inotify_add_watch(inotifyFD, this->canSuspend.c_str(),
                                             IN_MODIFY | IN_DELETE_SELF);
-  if (inotifyLockWD == -1) throw std::runtime_error("Failed to create inotify watch descriptor");
 
-
-  int32_t inotifyLockWD2 = inotify_add_watch(inotifyFD, can_suspend_dir.c_str(), IN_CREATE);
+  int32_t inotifyLockWD2 = inotify_add_watch(inotifyFD, this->mutexDir.c_str(),
+                                             IN_CREATE | IN_MOVED_TO);
   if (inotifyLockWD2 == -1) throw std::runtime_error("Failed to create inotify watch descriptor");
 
-  struct InotifyEvent {
-    int      wd;
-    uint32_t mask;
-    uint32_t cookie;
-    uint32_t len;
-    char     name[NAME_MAX+1];
-  } inotifyEvent;
-
-  size_t got;
-  while((got = read(inotifyFD, &inotifyEvent, sizeof(InotifyEvent)) > 0)) {
-    int64_t i = 0;
-    while ( i < got ) {
-      InotifyEvent* event = (InotifyEvent*) &((&inotifyEvent)[i]);
-      i += sizeof(InotifyEvent) + event->len;
-
-      // can_suspend gets constantly deleted and recreated. Need to remake our watch when this
-      // happens.
-      if (((event->mask & IN_IGNORED) > 0)
-          || ((event->mask & IN_DELETE_SELF) > 0)
-          || (event->mask & IN_CREATE) > 0) {
-        inotify_rm_watch(inotifyFD, inotifyLockWD);
-        inotifyLockWD = inotify_add_watch(inotifyFD,
-                                          can_suspend.c_str(),
-                                          IN_MODIFY | IN_DELETE_SELF);
-        if (inotifyLockWD == -1)
-          throw std::runtime_error("Failed to create inotify watch descriptor");
-      }
+  std::string contents;
+  std::unordered_set<std::string, StringHash, std::equal_to<>> snapshot; // Lines as of last scan
+  std::unordered_set<std::string_view> current;
 
-      FILE* p = popen("sxmo_mutex.sh can_suspend list", "r");
-      if (p == NULL) {
-        puts(ANSI_COLOR_YELLOW
-             "Warning: failed to run sxmo_mutex.sh to check for new events"
-             ANSI_COLOR_RESET);
-        sleep(30);
-        continue;
-      }
+  while(1) {
+    // Collapse a burst of events into one rescan
+    bool rewatch = false;
+    int64_t firstEvent = monotonicMS();
+    while (1) {
+      drainInotify(inotifyFD, rewatch);
 
-      std::string output;
-      char buf[1024];
-      while((fgets(buf, 1024, p)) != NULL) output += buf;
+      int64_t left = firstEvent+COALESCE_MAX_MS-monotonicMS();
+      if (left <= 0) break;
 
-      std::vector<std::string> tokens;
-      tokens.push_back("");
-      for (auto c : output) {
-        if (c == '\n') tokens.push_back("");
-        else tokens.back().push_back(c);
-      }
+      struct pollfd pfd = { .fd = inotifyFD, .events = POLLIN, .revents = 0 };
+      if (::poll(&pfd, 1, std::min((int64_t)COALESCE_MS, left)) <= 0) break;
+    }
 
-      if (tokens.size() > 0 && tokens.back() == "") tokens.pop_back();
+    if (rewatch) {
+      if (inotifyLockWD >= 0) inotify_rm_watch(inotifyFD, inotifyLockWD);
+      inotifyLockWD = inotify_add_watch(inotifyFD, this->canSuspend.c_str(),
+                                        IN_MODIFY | IN_DELETE_SELF);
+    }
 
-      tokens.erase(
-        std::remove(tokens.begin(), tokens.end(), "Playing with leds"),
-        tokens.end()
-        );
+    // One line per lock
+    contents.clear();
+    int32_t fd = open(this->canSuspend.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      char buf[4096];
+      ssize_t got;
+      while ((got = read(fd, buf, sizeof(buf))) > 0) contents.append(buf, got);
+      close(fd);
+    }
 
-      tokens.erase(
-        std::remove(tokens.begin(), tokens.end(), "Checking some mutexes"),
-        tokens.end()
-        );
+    current.clear();
+    std::string_view remaining(contents);
+    while (!remaining.empty()) {
+      auto newline = std::min(remaining.find('\n'), remaining.size());
+      auto line = remaining.substr(0, newline);
+      remaining.remove_prefix(std::min(newline+1, remaining.size()));
 
-      // Check for any locks we have not tracked yet
-      for (auto tok : tokens) {
-        std::unique_lock<std::mutex> lk(this->registerMutex);
+      if (line.empty() || sxmoNoise.contains(line)) continue;
+      current.insert(line);
+    }
 
-        bool exists = false;
-        // TODO activeInhibits mutex lock needed?
-        for (auto& [id, in] : this->activeInhibits) {
-          auto idStruct = reinterpret_cast<const _InhibitID*>(&id[0]);
-          if (strcmp(idStruct->token, tok.c_str()) == 0) exists = true;
-        }
+    std::vector<std::string> added;
+    std::vector<std::string> removed;
+    for (auto line : current) if (!snapshot.contains(line)) added.emplace_back(line);
+    for (auto& line : snapshot) if (!current.contains(line)) removed.push_back(line);
 
-        for (auto& in : this->registerQueue) {
-          auto idStruct = reinterpret_cast<const _InhibitID*>(&in.id[0]);
-          if (strcmp(idStruct->token, tok.c_str()) == 0) exists = true;
-        }
+    if (!added.empty() || !removed.empty()) {
+      std::unique_lock<std::mutex> lk(this->registerMutex);
 
-        if (!exists) {
-          auto id = this->mkId(tok.c_str());
-
-          if (!this->ourInhibits.contains(id)) {
-            registerQueue.push_back({
-              InhibitType::SUSPEND,
-                "unknown-app",
-                tok,
-                id,
-                (uint64_t)time(NULL)
-            });
-          }
+      for (auto& tok : added) {
+        snapshot.insert(tok);
+
+        auto id = this->mkId(tok);
+        if (!this->ourInhibits.contains(id)) {
+          registerQueue.push_back({
+            InhibitType::SUSPEND,
+              "unknown-app",
+              tok,
+              id,
+              (uint64_t)time(NULL)
+          });
         }
       }
 
-      // Check for any lokcs we are tracking and have been removed
-      for (auto& [id, in] : this->activeInhibits) {
-        auto idStruct = reinterpret_cast<const _InhibitID*>(&id[0]);
-        bool exists = false;
-        for (auto tok : tokens) if (strcmp(idStruct->token, tok.c_str()) == 0) exists = true;
+      for (auto& tok : removed) {
+        snapshot.erase(tok);
 
-        if (!exists) {
-          std::unique_lock<std::mutex> lk(this->registerMutex);
-          this->unregisterQueue.push_back(id);
-        }
+        auto id = this->mkId(tok);
+        if (!this->ourInhibits.contains(id)) this->unregisterQueue.push_back(id);
       }
 
-      pclose(p);
+      if (!this->registerQueue.empty() || !this->unregisterQueue.empty()) this->wake();
     }
+
+    // Wait for something to happen
+    struct pollfd pfd = { .fd = inotifyFD, .events = POLLIN, .revents = 0 };
+    if (::poll(&pfd, 1, -1) < 0 && errno != EINTR) break;
   }
 
-  printf(ANSI_COLOR_YELLOW "Warning: sxmo read loop broke!\n" ANSI_COLOR_RESET);
+  Log::warn("sxmo read loop broke!");
 
   close(inotifyFD);
 }
@@ -209,10 +220,6 @@ Inhibit THIS::doInhibit(InhibitRequest r) {
 
   std::string token = this->mkToken(r.appname, r.reason);
 
-  std::string cmd = "sxmo_mutex.sh can_suspend lock \""+token+"\"";
-  int32_t rr = system(cmd.c_str());
-  if (rr != 0) puts(ANSI_COLOR_YELLOW "Warning: failed to set sxmo lock" ANSI_COLOR_RESET);
-
   Inhibit ret = {};
   ret.type = r.type;
   ret.appname = r.appname;
@@ -220,7 +227,14 @@ Inhibit THIS::doInhibit(InhibitRequest r) {
   ret.id = this->mkId(token);
   ret.created = time(NULL);
 
-  this->ourInhibits.insert(ret.id);
+  {
+    // Before it hits the file, so watcherThread() doesn't take it for someone else's
+    std::unique_lock<std::mutex> lk(this->registerMutex);
+    this->ourInhibits.insert(ret.id);
+  }
+
+  if (!this->mutexLock(token))
+    Log::warn("failed to set sxmo lock");
 
   return ret;
 }
@@ -228,35 +242,72 @@ Inhibit THIS::doInhibit(InhibitRequest r) {
 void THIS::doUnInhibit(InhibitID id) {
   if (!this->ok) return;
 
-  this->ourInhibits.erase(id);
+  {
+    std::unique_lock<std::mutex> lk(this->registerMutex);
+    this->ourInhibits.erase(id);
+  }
+
+  if (!this->mutexFree(internedString(id.str)))
+    Log::warn("failed to release sxmo lock");
+}
 
-  auto idStruct = reinterpret_cast<_InhibitID*>(&id[0]);
-  std::string token = idStruct->token;
+// can_suspend is one reason per line, same as 'sxmo_mutex.sh can_suspend lock|free' maintains.
+bool THIS::mutexLock(const std::string& token) {
+  int32_t fd = open(this->canSuspend.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) return false;
 
-  std::string cmd = "sxmo_mutex.sh can_suspend free \""+token+"\"";
-  int32_t r = system(cmd.c_str());
-  if (r != 0) puts(ANSI_COLOR_YELLOW "Warning: failed to release sxmo lock" ANSI_COLOR_RESET);
+  std::string line = token+'\n';
+  bool ok = (write(fd, line.data(), line.size()) == (ssize_t)line.size());
+  close(fd);
+  return ok;
 }
 
-InhibitID THIS::mkId(std::string token) {
-  _InhibitID idStruct = {this->instanceId, {}};
+bool THIS::mutexFree(const std::string& token) {
+  int32_t fd = open(this->canSuspend.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return (errno == ENOENT); // Nothing locked at all
+
+  std::string contents;
+  char buf[4096];
+  ssize_t got;
+  while ((got = read(fd, buf, sizeof(buf))) > 0) contents.append(buf, got);
+  close(fd);
+
+  std::string kept;
+  std::string_view remaining(contents);
+  while (!remaining.empty()) {
+    auto newline = std::min(remaining.find('\n'), remaining.size());
+    auto line = remaining.substr(0, newline);
+    remaining.remove_prefix(std::min(newline+1, remaining.size()));
+
+    if (line == token) continue;
+    kept += line;
+    kept += '\n';
+  }
+
+  // Replace it in one go so readers never see it half written
+  std::string tmp = this->canSuspend+".uinhibit";
+  fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) return false;
 
-  uint32_t size = (token.size()>sizeof(idStruct.token)-1) ? sizeof(idStruct.token)-1 : token.size();
-  strncpy(idStruct.token, token.c_str(), size);
-  if(size>0) idStruct.token[size]=0; // NULL terminate
+  bool ok = (write(fd, kept.data(), kept.size()) == (ssize_t)kept.size());
+  close(fd);
+
+  if (ok) ok = (rename(tmp.c_str(), this->canSuspend.c_str()) == 0);
+  if (!ok) unlink(tmp.c_str());
+  return ok;
+}
 
-  auto ptr = reinterpret_cast<std::byte*>(&idStruct);
-  InhibitID id(ptr, ptr+sizeof(idStruct));
-  return id;
+InhibitID THIS::mkId(std::string_view token) {
+  return {this->instanceId, internString(token), 0};
 }
 
 std::string THIS::mkToken(std::string appname, std::string reason) {
   std::string cleanReason;
-  for (auto c : reason) if (c != '"') cleanReason.push_back(c);
+  for (auto c : reason) if (c != '"' && c != '\n') cleanReason.push_back(c);
 
   std::string cleanAppname;
   for (auto c : appname) {
-    if (c != '"') cleanAppname.push_back(c);
+    if (c != '"' && c != '\n') cleanAppname.push_back(c);
     if (c == '/') cleanAppname.clear();
   }
 
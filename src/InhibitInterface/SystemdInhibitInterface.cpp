@@ -18,16 +18,14 @@
 #include <unistd.h>
 #include "util.hpp"
 #include <cstring>
-
-namespace cpoll {
 #include <poll.h>
-}
-
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <thread>
 #include <dirent.h>
+#include <libgen.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 
 #define THIS SystemdInhibitInterface
 #define METHOD_CAST (void (DBusInhibitInterface::*)(DBus::Message* msg, DBus::Message* retmsg))
@@ -54,24 +52,39 @@ THIS::THIS(std::function<void(InhibitInterface*, Inhibit)> inhibitCB,
      {}),
     inhibitFork(inhibitFork)
 {
-  this->forkSender = this->inhibitFork->rx();
-  this->forkSender.pop_back(); // Remove trailing newline
+  auto hello = this->inhibitFork->rxWait();
+  if (hello.nFields > 0) this->forkSender = hello.fields[0];
+
+  this->releaseEpollFd = epoll_create1(EPOLL_CLOEXEC);
+  this->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (this->releaseEpollFd < 0 || this->inotifyFd < 0)
+    throw std::runtime_error("Failed to set up inhibit release watching");
+
+  epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = this->inotifyFd;
+  epoll_ctl(this->releaseEpollFd, EPOLL_CTL_ADD, this->inotifyFd, &ev);
+}
+
+THIS::~THIS() {
+  for (auto& [fd, release] : this->releaseFds) close(fd);
+  close(this->inotifyFd);
+  close(this->releaseEpollFd);
 }
 
 void THIS::handleIntrospect(DBus::Message* msg, DBus::Message* retmsg) {
-  if (this->monitor || std::string(msg->destination()) != DBUSNAME) return;
+  if (this->monitor || std::string_view(msg->destination()) != DBUSNAME) return;
 
-  if (std::string(msg->path()) == "/")  {
-    const char* introspectXml = DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+  std::string_view path = msg->path();
+  if (path == "/") this->sendIntrospect(msg, []{
+    return DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
       "<node name='/'>"
       "  <node name='org/freedesktop/login1' />"
       "</node>";
+  });
 
-    msg->newMethodReturn().appendArgs(DBUS_TYPE_STRING,&introspectXml,DBUS_TYPE_INVALID)->send();
-  }
-
-  if (std::string(msg->path()) == "/org/freedesktop/login1")  {
-    const char* introspectXml = DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+  if (path == "/org/freedesktop/login1") this->sendIntrospect(msg, []{
+    return DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
       "<node name='org/freedesktop/login1'>"
       "  <interface name='" INTERFACE "'>"
       "    <method name='Inhibit'>"
@@ -87,9 +100,7 @@ void THIS::handleIntrospect(DBus::Message* msg, DBus::Message* retmsg) {
       "    <property name='BlockInhibited' type='s' access='read'/>"
       "  </interface>"
       "</node>";
-
-    msg->newMethodReturn().appendArgs(DBUS_TYPE_STRING,&introspectXml,DBUS_TYPE_INVALID)->send();
-  }
+  });
 }
 
 void THIS::handleGetProperty(DBus::Message* msg, DBus::Message* retmsg) {
@@ -110,7 +121,7 @@ void THIS::handleListInhibitorsMsg(DBus::Message* msg, DBus::Message* retmsg) {
   if (this->monitor) return;
 
   struct Minhibitor {
-    const char* what;
+    std::string what;
     const char* who;
     const char* why;
     const char* mode;
@@ -120,14 +131,12 @@ void THIS::handleListInhibitorsMsg(DBus::Message* msg, DBus::Message* retmsg) {
 
   std::vector<Minhibitor> list;
   for (auto& [id, in] : this->activeInhibits) {
-    std::string whatstr = us2systemdType(in.type);
-
     Minhibitor mmin = {
-      .what = whatstr.c_str(),
+      .what = us2systemdType(in.type),
       .who = in.appname.c_str(),
       .why = in.reason.c_str(),
       .mode = "block", // TODO support lock expiry?
-      .pid = this->pidUids[id].pid,
+      .pid = this->pidUids[id].pid, // Zero until the credential lookup comes back
       .uid = this->pidUids[id].uid,
     };
 
@@ -136,7 +145,7 @@ void THIS::handleListInhibitorsMsg(DBus::Message* msg, DBus::Message* retmsg) {
 
   // TODO abstract this properly in DBus wrapper
   auto ret = msg->newMethodReturn();
-  auto mmsg = ret.msg.get()->msg;
+  auto mmsg = ret.msg;
 
   DBusMessageIter iter;
   dbus_message_iter_init_append(mmsg, &iter);
@@ -144,10 +153,11 @@ void THIS::handleListInhibitorsMsg(DBus::Message* msg, DBus::Message* retmsg) {
   DBusMessageIter arrayIter;
   dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(ssssuu)", &arrayIter);
 
-  for (auto min : list) {
+  for (auto& min : list) {
+    const char* what = min.what.c_str();
     DBusMessageIter structIter;
     dbus_message_iter_open_container(&arrayIter, DBUS_TYPE_STRUCT, NULL, &structIter);
-    dbus_message_iter_append_basic(&structIter, DBUS_TYPE_STRING, &(min.what));
+    dbus_message_iter_append_basic(&structIter, DBUS_TYPE_STRING, &what);
     dbus_message_iter_append_basic(&structIter, DBUS_TYPE_STRING, &(min.who));
     dbus_message_iter_append_basic(&structIter, DBUS_TYPE_STRING, &(min.why));
     dbus_message_iter_append_basic(&structIter, DBUS_TYPE_STRING, &(min.mode));
@@ -161,48 +171,76 @@ void THIS::handleListInhibitorsMsg(DBus::Message* msg, DBus::Message* retmsg) {
   ret.send();
 }
 
-void THIS::releaseThread(const char* path, Inhibit in, bool delay) {
-  uint64_t startTime = time(NULL);
+void THIS::watchReleasePath(std::string path, Inhibit in, bool delay) {
+  // Systemd keeps the fd around for delay locks even after the delay time
+  // This delay time is system-configurable, but defaults to 5 seconds.
+  // We will just release any delay locks after 5 seconds.
+  if (delay) {
+    this->timers.add(5*1000, [this, in]() { this->releaseQueue.push_back(in); });
+    return;
+  }
 
   // We don't have read access to wait for EOF, so we just need to wait until the file goes away
-  // TODO: could probably use inotify for this
-  while (1) {
-
-    // Systemd keeps the fd around for delay locks even after the delay time
-    // This delay time is system-configurable, but defaults to 5 seconds.
-    // We will just release any delay locks after 5 seconds.
-    if (delay && time(NULL)-startTime > 5) {
-      {
-        std::unique_lock<std::mutex> lk(this->releaseQueueMutex);
-        this->releaseQueue.push_back(in);
-      }
-      break;
+  std::string dir = path;
+  dir = dirname(dir.data());
+  int32_t wd = inotify_add_watch(this->inotifyFd, dir.c_str(), IN_DELETE | IN_MOVED_FROM);
+  if (wd >= 0) this->inotifyDirs[wd] = dir;
+  this->releasePaths[path] = in;
+
+  // It may have gone away before we started watching
+  if (access(path.c_str(), F_OK) != 0) {
+    this->releasePaths.erase(path);
+    this->releaseQueue.push_back(in);
+  }
+}
+
+void THIS::watchReleaseFd(int32_t fd, std::string path, Inhibit in) {
+  epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  epoll_ctl(this->releaseEpollFd, EPOLL_CTL_ADD, fd, &ev);
+
+  this->releaseFds[fd] = {path, in};
+}
+
+bool THIS::busy() {
+  return DBusInhibitInterface::busy() || this->forkPending > 0 || this->inhibitFork->txPending();
+}
+
+std::vector<pollfd> THIS::watchFds() {
+  std::vector<pollfd> fds = {{this->releaseEpollFd, POLLIN, 0}};
+  if (this->forkPending > 0) fds.push_back({this->inhibitFork->rxFd(), POLLIN, 0});
+  return fds;
+}
+
+void THIS::handleForkReplies() {
+  this->inhibitFork->flush();
+
+  ForkMessage reply;
+  while (this->forkPending > 0) {
+    if (!this->inhibitFork->rxMessage(reply)) {
+      if (!this->inhibitFork->rxReady()) break;
+      this->inhibitFork->rxFill();
+      continue;
     }
 
-    int r = access(path, F_OK);
-    if (r != 0) {
-      {
-        std::unique_lock<std::mutex> lk(this->releaseQueueMutex);
-        this->releaseQueue.push_back(in);
-      }
-      break;
+    if (reply.op != SystemdInhibitFork::FD) continue;
+    this->forkPending--;
+
+    int32_t fd = reply.value;
+    uint32_t cookie = reply.id;
+
+    if (fd < 0) {
+      this->forkFds.erase(cookie);
+    } else if (this->forkFds.contains(cookie)) {
+      this->forkFds.at(cookie) = fd;
+    } else {
+      // Released while we were waiting
+      this->inhibitFork->queue(SystemdInhibitFork::RELEASE, cookie, fd);
     }
-    usleep(100*1000);
   }
-}
 
-void THIS::releaseThreadOurFd(int32_t fd, std::string path, Inhibit in) {
-  struct cpoll::pollfd pollfd = {
-    .fd = fd,
-    .events = POLLIN,
-    .revents = 0
-  };
-  cpoll::poll(&pollfd, 1, -1);
-  unlink(path.c_str());
-  {
-    std::unique_lock<std::mutex> lk(this->releaseQueueMutex);
-    this->releaseQueue.push_back(in);
-  }
+  this->inhibitFork->flush();
 }
 
 void THIS::handleInhibitMsg(DBus::Message* msg, DBus::Message* retmsg) {
@@ -237,21 +275,17 @@ void THIS::handleInhibitMsg(DBus::Message* msg, DBus::Message* retmsg) {
     char filePath[1024*10];
     std::string fdpath = "/proc/self/fd/";
     fdpath += std::to_string(fd);
-    int rl = readlink(fdpath.c_str(), filePath, 1024*10);
+    int rl = readlink(fdpath.c_str(), filePath, (1024*10)-1);
     close(fd);
 
     if (rl >= 0) {
-      std::thread t(&THIS::releaseThread, this, filePath, in, (std::string(mode) == "delay"));
-      t.detach();
+      filePath[rl] = 0;
+      this->watchReleasePath(filePath, in, (std::string(mode) == "delay"));
     }
   } else {
     auto lockRef = this->newLockRef();
     auto id = this->mkId(lockRef.wfd);
 
-    try {
-      this->pidUids[id] = { .pid = msg->senderPID(), .uid = msg->senderUID() };
-    } catch (DBus::NameHasNoOwnerError& e) {}
-
     msg->newMethodReturn().appendArgs(DBUS_TYPE_UNIX_FD, &lockRef.wfd, DBUS_TYPE_INVALID)->send();
 
     close(lockRef.wfd); // Close our end so we can watch for EOF on release
@@ -259,8 +293,12 @@ void THIS::handleInhibitMsg(DBus::Message* msg, DBus::Message* retmsg) {
     Inhibit in = { this->systemdType2us(what), who, why, id };
     this->registerInhibit(in);
 
-    std::thread t(&THIS::releaseThreadOurFd, this, lockRef.rfd, lockRef.file, in);
-    t.detach();
+    // May already be released by the time the lookup comes back
+    msg->senderCredentials([this, id](DBus::Credentials creds) {
+      if (this->activeInhibits.contains(id)) this->pidUids[id] = {creds.pid, creds.uid};
+    });
+
+    this->watchReleaseFd(lockRef.rfd, lockRef.file, in);
   }
 }
 
@@ -279,7 +317,43 @@ THIS::lockRef THIS::newLockRef() {
 }
 
 void THIS::poll() {
-  std::unique_lock<std::mutex> lk(this->releaseQueueMutex);
+  this->handleForkReplies();
+
+  epoll_event events[64];
+  int32_t n;
+  while ((n = epoll_wait(this->releaseEpollFd, events, 64, 0)) > 0) {
+    for (int32_t i = 0; i < n; i++) {
+      int32_t fd = events[i].data.fd;
+
+      if (fd == this->inotifyFd) {
+        alignas(inotify_event) char buf[4096];
+        ssize_t len;
+        while ((len = read(this->inotifyFd, buf, sizeof(buf))) > 0) {
+          for (char* p = buf; p < buf+len; p += sizeof(inotify_event)+((inotify_event*)p)->len) {
+            auto event = (inotify_event*)p;
+            if (event->len == 0 || !this->inotifyDirs.contains(event->wd)) continue;
+
+            auto path = this->inotifyDirs.at(event->wd)+"/"+event->name;
+            if (this->releasePaths.contains(path)) {
+              this->releaseQueue.push_back(this->releasePaths.at(path));
+              this->releasePaths.erase(path);
+            }
+          }
+        }
+        continue;
+      }
+
+      // One of our FIFOs saw EOF (or data, which we treat the same)
+      epoll_ctl(this->releaseEpollFd, EPOLL_CTL_DEL, fd, nullptr);
+      if (this->releaseFds.contains(fd)) {
+        auto& [path, in] = this->releaseFds.at(fd);
+        unlink(path.c_str());
+        this->releaseQueue.push_back(in);
+        this->releaseFds.erase(fd);
+      }
+      close(fd);
+    }
+  }
 
   for (auto r : this->releaseQueue) {
     if (this->pidUids.contains(r.id)) this->pidUids.erase(r.id);
@@ -294,25 +368,40 @@ Inhibit THIS::doInhibit(InhibitRequest r) {
       && ((r.type & InhibitType::SCREENSAVER) == InhibitType::NONE))
     throw uinhibit::InhibitRequestUnsupportedTypeException();
 
-  int32_t fd = -1;
+  Inhibit i = {r.type, r.appname, r.reason, {}, (uint64_t)time(NULL)};
+
   if (this->monitor) {
-    this->inhibitFork->tx(us2systemdType(r.type)+'\t'+r.appname+'\t'+r.reason+'\t'+"block"+'\n');
-    fd = atol(this->inhibitFork->rx().c_str());
+    uint32_t cookie = ++this->lastForkCookie;
+
+    // Sent from poll(), along with anything else that comes in before we get there
+    this->inhibitFork->queue(SystemdInhibitFork::INHIBIT, cookie, 0,
+                             {us2systemdType(r.type), r.appname, r.reason, "block"});
+
+    this->forkPending++;
+    this->forkFds[cookie] = std::nullopt;
+    i.id = this->mkId(cookie, "us");
+
+    this->wake(); // Likely called from another InhibitInterface, get poll() to flush
   } else {
     auto lockRef = this->newLockRef();
     close(lockRef.wfd);
-    fd = lockRef.rfd;
+    i.id = this->mkId(lockRef.rfd);
   }
 
-  Inhibit i = {r.type, r.appname, r.reason, {}, (uint64_t)time(NULL)};
-  i.id = this->mkId(fd);
   return i;
 }
 
 void THIS::doUnInhibit(InhibitID id) {
-  int32_t fd = reinterpret_cast<_InhibitID*>(&id[0])->fd;
+  int32_t fd = id.cookie;
   if (this->monitor) {
-    this->inhibitFork->tx(std::to_string(fd)+'\n');
+    // Still waiting on the fork? handleForkReplies() will release it as soon as we know the fd.
+    if (!this->forkFds.contains(id.cookie)) return;
+    auto forkFd = this->forkFds.at(id.cookie);
+    this->forkFds.erase(id.cookie);
+    if (forkFd) {
+      this->inhibitFork->queue(SystemdInhibitFork::RELEASE, id.cookie, *forkFd);
+      this->wake();
+    }
   } else {
     char filePath[1024*10];
     std::string fdpath = "/proc/self/fd/";
@@ -323,11 +412,9 @@ void THIS::doUnInhibit(InhibitID id) {
   }
 }
 
-InhibitID THIS::mkId(uint32_t fd) {
-  _InhibitID idStruct = {this->instanceId, fd};
-  auto ptr = reinterpret_cast<std::byte*>(&idStruct);
-  InhibitID id(ptr, ptr+sizeof(idStruct));
-  return id;
+// owner distinguishes our own inhibits (where fd is really a cookie) from fds we were handed
+InhibitID THIS::mkId(uint32_t fd, std::string_view owner) {
+  return {this->instanceId, internString(owner), fd};
 }
 
 InhibitType THIS::systemdType2us(std::string what) {
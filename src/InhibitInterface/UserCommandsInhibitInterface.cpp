@@ -16,6 +16,7 @@
 
 #include "InhibitInterface.hpp"
 #include "util.hpp"
+#include "Log.hpp"
 
 #define THIS UserCommandsInhibitInterface
 
@@ -55,17 +56,31 @@ THIS::THIS(std::function<void(InhibitInterface*,Inhibit)> inhibitCB,
   int64_t cmdSize = cmds.size()+uncmds.size();
 
   if (cmdSize == 0) {
-    printf("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] User actions: "
-           "No user commands specified. See man page to specify (un)inhibit actions. \n");
+    Log::info("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] User actions: "
+              "No user commands specified. See man page to specify (un)inhibit actions.");
   } else if (cmdSize > 0) {
-    printf("[" ANSI_COLOR_GREEN "->" ANSI_COLOR_RESET "] User actions: "
-           "%ld user action(s) present\n", cmdSize);
+    Log::info("[" ANSI_COLOR_GREEN "->" ANSI_COLOR_RESET "] User actions: "
+              "%ld user action(s) present", cmdSize);
     this->ok = true;
   }
 }
 
 InhibitInterface::ReturnObject THIS::start() {
-  while(1) co_await std::suspend_always();
+  while(1) co_await this->waitFor({});
+}
+
+// Commands for one type (and the any-type ones) run in the order we ask for them, but never
+// hold up inhibit processing
+void THIS::runCommand(const std::string& cmd, InhibitType t, const char* what) {
+  std::string typeStr = (t == InhibitType::NONE) ? "" : inhibitTypeToString(t)+" ";
+  Log::info("Running %s%s command: %s", typeStr.c_str(), what, cmd.c_str());
+
+  this->spawner.run(cmd, t, -1, [cmd](int32_t status) {
+    if (status != 0)
+      Log::warn("user command '%s' exited with status %d", cmd.c_str(), status);
+  });
+
+  this->wake(); // We're likely being called from another InhibitInterface, start watching it
 }
 
 void THIS::handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) {
@@ -74,19 +89,9 @@ void THIS::handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) {
   for (auto t : inhibitTypes()) {
     if ((inhibited & t) != (lastInhibited & t)) {
       if ((inhibited & t) > 0) {
-        if (this->cmds.contains(t)) {
-          printf("Running %s inhibit command: %s\n",
-                 inhibitTypeToString(t).c_str(),
-                 this->cmds.at(t).c_str());
-          [[maybe_unused]] int r = system(this->cmds.at(t).c_str());
-        }
+        if (this->cmds.contains(t)) this->runCommand(this->cmds.at(t), t, "inhibit");
       } else {
-        if (this->uncmds.contains(t)) {
-          printf("Running %s uninhibit command: %s\n",
-                 inhibitTypeToString(t).c_str(),
-                 this->uncmds.at(t).c_str());
-          [[maybe_unused]] int r = system(this->uncmds.at(t).c_str());
-        }
+        if (this->uncmds.contains(t)) this->runCommand(this->uncmds.at(t), t, "uninhibit");
       }
     }
   }
@@ -94,13 +99,11 @@ void THIS::handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) {
   if (lastInhibited != inhibited) {
     if (cmds.contains(InhibitType::NONE) && inhibited != InhibitType::NONE
                                          && lastInhibited == InhibitType::NONE) {
-      printf("Running inhibit command: %s\n", this->cmds.at(InhibitType::NONE).c_str());
-      [[maybe_unused]] int r = system(this->cmds.at(InhibitType::NONE).c_str());
+      this->runCommand(this->cmds.at(InhibitType::NONE), InhibitType::NONE, "inhibit");
     }
     if (uncmds.contains(InhibitType::NONE) && inhibited == InhibitType::NONE
                                            && lastInhibited != InhibitType::NONE) {
-      printf("Running uninhibit command: %s\n", this->uncmds.at(InhibitType::NONE).c_str());
-      [[maybe_unused]] int r = system(this->uncmds.at(InhibitType::NONE).c_str());
+      this->runCommand(this->uncmds.at(InhibitType::NONE), InhibitType::NONE, "uninhibit");
     }
   }
 
@@ -120,10 +123,6 @@ Inhibit THIS::doInhibit(InhibitRequest r) {
   return ret;
 }
 
-InhibitID THIS::mkId(uint64_t cookie) {
-  _InhibitID idStruct = {this->instanceId, cookie};
-
-  auto ptr = reinterpret_cast<std::byte*>(&idStruct);
-  InhibitID id(ptr, ptr+sizeof(idStruct));
-  return id;
+InhibitID THIS::mkId(uint32_t cookie) {
+  return {this->instanceId, 0, cookie};
 };
@@ -16,8 +16,10 @@
 
 #include "InhibitInterface.hpp"
 #include "util.hpp"
+#include "Log.hpp"
 
 #define THIS XautolockInhibitInterface
+#define COMMAND_TIMEOUT_MS 5000
 
 using namespace uinhibit;
 
@@ -25,27 +27,24 @@ THIS::THIS(std::function<void(InhibitInterface*,Inhibit)> inhibitCB,
            std::function<void(InhibitInterface*,Inhibit)> unInhibitCB) :
   InhibitInterface(inhibitCB, unInhibitCB, "xautolock")
 {
-  // TODO: cleaner way to detect if xautolock is running/exists?
-  int32_t r = system("ps aux | grep xautolock | grep -v grep > /dev/null 2>/dev/null");
-  bool xautolockRunning = (r == 0);
-  r = system("xautolock -version > /dev/null 2> /dev/null");
-  bool xautolockExists = (r == 0);
+  bool xautolockRunning = processRunning("xautolock");
+  bool xautolockExists = inPath("xautolock");
 
   if (!xautolockRunning) {
-    printf("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] xautolock: "
-           "Doesn't look like xautolock is running. \n");
+    Log::info("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] xautolock: "
+              "Doesn't look like xautolock is running.");
   } else if (!xautolockExists) {
-    printf("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] xautolock: "
-           "xautolock looks like it's running, but we couldn't find the xautolock command. \n");
+    Log::info("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] xautolock: "
+              "xautolock looks like it's running, but we couldn't find the xautolock command.");
   } else {
-    printf("[" ANSI_COLOR_GREEN "->" ANSI_COLOR_RESET "] xautolock: "
-           "Feeding events with xautolock -disable/enable\n");
+    Log::info("[" ANSI_COLOR_GREEN "->" ANSI_COLOR_RESET "] xautolock: "
+              "Feeding events with xautolock -disable/enable");
     this->ok = true;
   }
 }
 
 InhibitInterface::ReturnObject THIS::start() {
-  while(1) co_await std::suspend_always();
+  while(1) co_await this->waitFor({});
 }
 
 void THIS::handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) {
@@ -54,18 +53,21 @@ void THIS::handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) {
   // We only care when screensaver type has changed
   if ((inhibited & InhibitType::SCREENSAVER) == (lastInhibited & InhibitType::SCREENSAVER)) return;
 
+  // One at a time so they can't land out of order
   if ((inhibited & InhibitType::SCREENSAVER) > 0) {
-    int32_t r = system("xautolock -disable > /dev/null 2> /dev/null");
-    if (r != 0) puts(ANSI_COLOR_YELLOW
-                     "Warning: failed to disable xautolock (return code)"
-                     ANSI_COLOR_RESET);
+    const char* cmd = "xautolock -disable > /dev/null 2> /dev/null";
+    this->spawner.run(cmd, 0, COMMAND_TIMEOUT_MS, [](int32_t r) {
+      if (r != 0) Log::warn("failed to disable xautolock (return code)");
+    });
   } else {
-    int32_t r = system("xautolock -enable > /dev/null 2> /dev/null");
-    if (r != 0) puts(ANSI_COLOR_YELLOW
-                     "Warning: failed to enable xautolock (return code)"
-                     ANSI_COLOR_RESET);
+    const char* cmd = "xautolock -enable > /dev/null 2> /dev/null";
+    this->spawner.run(cmd, 0, COMMAND_TIMEOUT_MS, [](int32_t r) {
+      if (r != 0) Log::warn("failed to enable xautolock (return code)");
+    });
   }
 
+  this->wake(); // We're likely being called from another InhibitInterface, start watching it
+
   lastInhibited = inhibited;
 };
 
@@ -16,45 +16,123 @@
 
 #include "InhibitInterface.hpp"
 #include "util.hpp"
+#include "Log.hpp"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
 
 #define THIS XidlehookInhibitInterface
-#define SOCKETPATH "/tmp/xidlehook.sock"
 
 using namespace uinhibit;
 
 THIS::THIS(std::function<void(InhibitInterface*,Inhibit)> inhibitCB,
-           std::function<void(InhibitInterface*,Inhibit)> unInhibitCB) :
-  InhibitInterface(inhibitCB, unInhibitCB, "xidlehook")
+           std::function<void(InhibitInterface*,Inhibit)> unInhibitCB,
+           std::string socketPath) :
+  InhibitInterface(inhibitCB, unInhibitCB, "xidlehook"), socketPath(socketPath)
 {
-  // TODO: cleaner way to detect if xidlehook is running/exists?
-  int32_t r = system("ps aux | grep xidlehook | grep -v grep > /dev/null 2>/dev/null");
-  bool xidlehookRunning = (r == 0);
-  r = system("xidlehook --version > /dev/null 2> /dev/null");
-  bool xidlehookExists = (r == 0);
-  r = access(SOCKETPATH, F_OK);
-  bool socketExists = (r == 0);
-
-  if (!xidlehookRunning) {
-    printf("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] xidlehook: "
-           "Doesn't look like xidlehook is running. Make sure you start it with xidlehook --socket "
-           SOCKETPATH " \n");
-  } else if (!xidlehookExists) {
-    printf("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] xidlehook: "
-           "xidlehook looks like it's running, but we couldn't find the xidlehook command. \n");
-  } else if (!socketExists) {
-    printf("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] xidlehook: "
-           "xidlehook looks like it's running, but we couldn't find the socket at " SOCKETPATH "."
-           " Make sure you start xidlehook with '--socket " SOCKETPATH "'\n");
+  // If we can connect, xidlehook is running and listening where we expect
+  if (!this->connectSocket()) {
+    Log::info("[" ANSI_COLOR_RED "x" ANSI_COLOR_RESET "] xidlehook: "
+              "Couldn't connect to xidlehook's socket at %s. Make sure xidlehook is running and "
+              "you start it with '--socket %s'",
+              this->socketPath.c_str(), this->socketPath.c_str());
   } else {
-    printf("[" ANSI_COLOR_GREEN "->" ANSI_COLOR_RESET "] xidlehook: "
-           "Feeding events with xidlehook-client --socket "
-           SOCKETPATH " control --action Disable/Enable\n");
+    Log::info("[" ANSI_COLOR_GREEN "->" ANSI_COLOR_RESET "] xidlehook: "
+              "Feeding events as Disable/Enable controls over %s", this->socketPath.c_str());
     this->ok = true;
   }
 }
 
+THIS::~THIS() {
+  this->disconnectSocket();
+}
+
+bool THIS::connectSocket() {
+  if (this->sockFd >= 0) return true;
+
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (this->socketPath.size() >= sizeof(addr.sun_path)) return false;
+  memcpy(addr.sun_path, this->socketPath.c_str(), this->socketPath.size());
+
+  int32_t fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0) return false;
+
+  // Non-blocking connect on a unix socket either completes or fails right away (EAGAIN if
+  // xidlehook's backlog is full), it never leaves us waiting
+  if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return false;
+  }
+
+  this->sockFd = fd;
+  return true;
+}
+
+void THIS::disconnectSocket() {
+  if (this->sockFd >= 0) close(this->sockFd);
+  this->sockFd = -1;
+  this->rxBuf.clear();
+}
+
+void THIS::sendControl(const char* action) {
+  // What xidlehook-client sends for 'control --action <action>' without --timer: a serde JSON
+  // Message::Control, applying to every timer, NUL-terminated
+  std::string msg = std::string("{\"Control\":{\"action\":\"") + action +
+    "\",\"timer\":\"Any\"}}";
+  msg.push_back('\0');
+
+  // xidlehook may have restarted (or closed the connection on us) since we last spoke, in
+  // which case the first send fails and we try once more on a fresh connection
+  for (int32_t attempt = 0; attempt < 2; attempt++) {
+    if (!this->connectSocket()) break;
+
+    ssize_t r = send(this->sockFd, msg.data(), msg.size(), MSG_NOSIGNAL);
+    if (r == (ssize_t)msg.size()) return;
+
+    // A partial message would corrupt the stream, so that connection is done either way
+    this->disconnectSocket();
+    if (r >= 0 || (errno != EPIPE && errno != ECONNRESET && errno != ENOTCONN)) break;
+  }
+
+  Log::warn("failed to send %s to xidlehook at %s", action, this->socketPath.c_str());
+}
+
+void THIS::handleReplies() {
+  char buf[1024];
+  while (this->sockFd >= 0) {
+    ssize_t r = read(this->sockFd, buf, sizeof(buf));
+    if (r < 0 && (errno == EAGAIN || errno == EINTR)) break;
+    if (r <= 0) {
+      this->disconnectSocket(); // xidlehook went away, we'll reconnect on the next send
+      break;
+    }
+    this->rxBuf.append(buf, r);
+  }
+
+  // Replies are NUL-terminated too, "Empty" on success or {"Error":"..."}
+  size_t start = 0, end;
+  while ((end = this->rxBuf.find('\0', start)) != std::string::npos) {
+    std::string_view reply(this->rxBuf.data()+start, end-start);
+    if (reply.starts_with("{\"Error\"")) {
+      Log::warn("xidlehook replied with an error: %.*s", (int)reply.size(), reply.data());
+    }
+    start = end+1;
+  }
+  this->rxBuf.erase(0, start);
+}
+
 InhibitInterface::ReturnObject THIS::start() {
-  while(1) co_await std::suspend_always();
+  while(1) {
+    // Watching the socket even without pending replies so we notice xidlehook going away
+    std::vector<pollfd> fds;
+    if (this->sockFd >= 0) fds.push_back({this->sockFd, POLLIN, 0});
+    co_await this->waitFor(fds);
+
+    this->handleReplies();
+  }
 }
 
 void THIS::handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) {
@@ -64,19 +142,11 @@ void THIS::handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) {
   // We only care when screensaver type has changed
   if ((inhibited & InhibitType::SCREENSAVER) == (lastInhibited & InhibitType::SCREENSAVER)) return;
 
-  if ((inhibited & InhibitType::SCREENSAVER) > 0) {
-    int32_t r = system("xidlehook-client --socket " SOCKETPATH " control --action Disable"
-                       " > /dev/null 2> /dev/null");
-    if (r != 0) puts(ANSI_COLOR_YELLOW
-                     "Warning: failed to disable xidlehook (return code)"
-                     ANSI_COLOR_RESET);
-  } else {
-    int32_t r = system("xidlehook-client --socket " SOCKETPATH " control --action Enable"
-                       " > /dev/null 2> /dev/null");
-    if (r != 0) puts(ANSI_COLOR_YELLOW
-                     "Warning: failed to enable xidlehook (return code)"
-                     ANSI_COLOR_RESET);
-  }
+  // One connection, so xidlehook sees these in order
+  if ((inhibited & InhibitType::SCREENSAVER) > 0) this->sendControl("Disable");
+  else                                              this->sendControl("Enable");
+
+  this->wake(); // We're likely being called from another InhibitInterface, start watching it
 
   lastInhibited = inhibited;
 };
@@ -0,0 +1,420 @@
+// Copyright (C) 2022 Matthew Egeler
+//
+// This file is part of unified-inhibit.
+//
+// unified-inhibit is free software: you can redistribute it and/or modify it under the terms of the
+// GNU General Public License as published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// unified-inhibit is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with unified-inhibit. If
+// not, see <https://www.gnu.org/licenses/>.
+
+#include "Log.hpp"
+#include "EventLoop.hpp"
+#include "util.hpp"
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <cerrno>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define LOG_SLOTS 256        // Power of two
+#define LOG_LINE_MAX 512     // Longer lines are truncated
+#define LOG_BATCH_MAX 65536  // Most we hand to a single write()
+#define LOG_STOP_WAIT_MS 100 // Longest we wait on a line someone's still writing once stopping
+#define REPEAT_BURST 5       // Times one warning/error may be logged per window
+#define REPEAT_SITES 32
+
+namespace uinhibit {
+  // Bounded multi-producer single-consumer ring. A slot is free for position pos when its seq is
+  // pos, and holds a finished line once seq is pos+1.
+  struct Slot {
+    std::atomic<uint64_t> seq;
+    uint16_t len;
+    char text[LOG_LINE_MAX];
+  };
+
+  static Slot slots[LOG_SLOTS];
+  static std::atomic<uint64_t> head = 0; // Next position to claim
+  static uint64_t tail = 0;              // Next position to write out, writer thread only
+  static std::atomic<uint64_t> dropped = 0;
+  static std::atomic<uint32_t> wakeups = 0;
+  static std::atomic<bool> async = false;
+  static std::atomic<bool> stopping = false;
+  static std::thread* writer = nullptr;
+  static std::mutex writerMutex;
+
+  int64_t Log::repeatWindowMS = 10000;
+
+  static LogLevel minLevel = LogLevel::INFO;
+  static Log::Format format = Log::Format::PLAIN;
+  static bool syslogPrefix = false;
+
+  static const char* levelNames[] = {"verbose", "info", "warn", "error"};
+  static const int32_t syslogPriorities[] = {7, 6, 4, 3};
+  static const char* plainPrefixes[] = {"", "", ANSI_COLOR_YELLOW "Warning: ",
+                                        ANSI_COLOR_RED "Error: "};
+  static const char* plainSuffixes[] = {"", "", ANSI_COLOR_RESET, ANSI_COLOR_RESET};
+
+  static void writeAll(const char* buf, size_t len) {
+    while (len > 0) {
+      ssize_t r = write(STDOUT_FILENO, buf, len);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) return; // Nowhere to log to
+      buf += r;
+      len -= r;
+    }
+  }
+
+  // Appends into a fixed buffer, silently truncating
+  struct LineWriter {
+    char* out;
+    size_t cap;
+    size_t len = 0;
+
+    void append(const char* str) {
+      while (*str && len < cap) out[len++] = *str++;
+    }
+
+    void vappendf(const char* fmt, va_list args) {
+      int32_t r = vsnprintf(out+len, cap-len+1, fmt, args);
+      if (r > 0) len = std::min(len+r, cap);
+    }
+
+    // One escaped character: quotes and backslashes backslashed, control characters as \n, \xHH...
+    void appendEscapedChar(char c) {
+      char esc[5] = {'\\', c, 0, 0, 0};
+      if (c == '\n') esc[1] = 'n';
+      else if (c == '\r') esc[1] = 'r';
+      else if (c == '\t') esc[1] = 't';
+      else if ((uint8_t)c < 0x20 || c == 0x7f) snprintf(esc+1, sizeof(esc)-1, "x%02x", (uint8_t)c);
+      else if (c != '"' && c != '\\') esc[0] = c, esc[1] = '\0';
+
+      size_t n = strlen(esc);
+      if (len+n > cap) { len = cap; return; } // Don't leave half an escape
+      memcpy(out+len, esc, n);
+      len += n;
+    }
+
+    // Quoted-string safe, without ANSI colors (we add those ourselves, they're not content)
+    void appendEscaped(const char* str) {
+      while (*str && len < cap) {
+        if (str[0] == '\x1b' && str[1] == '[') {
+          str += 2;
+          while (*str && !isalpha((unsigned char)*str)) str++;
+          if (*str) str++;
+          continue;
+        }
+        appendEscapedChar(*str++);
+      }
+    }
+
+    // Left as-is, other than newlines, so nothing logged can start a line of its own
+    void appendOneLine(const char* str) {
+      while (*str && len < cap) {
+        char c = *str++;
+        if (c == '\n' || c == '\r') appendEscapedChar(c);
+        else out[len++] = c;
+      }
+    }
+
+    // key=value, or key="value" (escaped) if value is empty or has anything but plain characters
+    void appendField(const Log::Field& f) {
+      if (len > 0 && len < cap) out[len++] = ' ';
+      append(f.key);
+      append("=");
+
+      bool plain = !f.value.empty();
+      for (char c : f.value) {
+        if ((uint8_t)c <= ' ' || c == 0x7f || c == '"' || c == '=' || c == '\\') plain = false;
+      }
+
+      if (!plain && len < cap) out[len++] = '"';
+      for (char c : f.value) {
+        if (len >= cap) break;
+        if (plain) out[len++] = c;
+        else appendEscapedChar(c);
+      }
+      if (!plain && len < cap) out[len++] = '"';
+    }
+  };
+
+  // Formats a whole line (newline included) into out, which must have room for LOG_LINE_MAX.
+  // text is the message, fields are only given by Log::event().
+  static size_t formatLine(char* out, LogLevel level, const char* text,
+                           std::initializer_list<Log::Field> fields) {
+    LineWriter w{out, LOG_LINE_MAX-1}; // Room for the newline
+    uint8_t l = (uint8_t)level;
+
+    if (syslogPrefix) {
+      char prio[8];
+      snprintf(prio, sizeof(prio), "<%d>", syslogPriorities[l]);
+      w.append(prio);
+    }
+
+    if (format == Log::Format::PLAIN) {
+      w.append(plainPrefixes[l]);
+      w.appendOneLine(text);
+      for (auto& f : fields) w.appendField(f);
+      w.append(plainSuffixes[l]);
+    } else {
+      w.append("level=");
+      w.append(levelNames[l]);
+      w.append(" msg=\"");
+      w.appendEscaped(text);
+      w.append("\"");
+      for (auto& f : fields) w.appendField(f);
+    }
+
+    out[w.len++] = '\n';
+    return w.len;
+  }
+
+  // Claims the slot for the next position, nullptr if the ring is full
+  static Slot* claim(uint64_t& pos) {
+    pos = head.load(std::memory_order_relaxed);
+    while (1) {
+      Slot& s = slots[pos & (LOG_SLOTS-1)];
+      int64_t diff = (int64_t)(s.seq.load(std::memory_order_acquire) - pos);
+      if (diff == 0) {
+        if (head.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) return &s;
+      } else if (diff < 0) {
+        return nullptr; // The writer hasn't got to this slot's previous line yet
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  static void emitLine(LogLevel level, const char* text, std::initializer_list<Log::Field> fields) {
+    if (async.load(std::memory_order_acquire)) {
+      uint64_t pos;
+      Slot* s = claim(pos);
+      if (s == nullptr) { dropped.fetch_add(1, std::memory_order_relaxed); return; }
+
+      s->len = formatLine(s->text, level, text, fields);
+      s->seq.store(pos+1, std::memory_order_release);
+
+      wakeups.fetch_add(1, std::memory_order_release);
+      wakeups.notify_one();
+    } else {
+      // Through stdio, so we stay in order with anything else still printed that way
+      char line[LOG_LINE_MAX];
+      fwrite(line, 1, formatLine(line, level, text, fields), stdout);
+      fflush(stdout);
+    }
+  }
+
+  static void emit(LogLevel level, const char* fmt, va_list args) {
+    if (level < minLevel) return;
+
+    char text[LOG_LINE_MAX];
+    vsnprintf(text, sizeof(text), fmt, args);
+    size_t n = strlen(text);
+    if (n > 0 && text[n-1] == '\n') text[n-1] = '\0';
+    emitLine(level, text, {});
+  }
+
+  static void emitf(LogLevel level, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    emit(level, fmt, args);
+    va_end(args);
+  }
+
+  // Rate limiting, keyed on the format string (so per call site)
+  struct Repeat {
+    const char* fmt = nullptr;
+    int64_t windowStartMS = 0;
+    uint32_t count = 0;
+    uint32_t suppressed = 0;
+  };
+  static std::mutex repeatMutex;
+  static Repeat repeats[REPEAT_SITES];
+
+  // False if fmt has been logged too often lately. suppressed is set to how many were held back
+  // in the previous window the first time one is let through again.
+  static bool allowRepeat(const char* fmt, uint32_t& suppressed) {
+    std::lock_guard<std::mutex> lock(repeatMutex);
+    int64_t now = monotonicMS();
+    suppressed = 0;
+
+    Repeat* r = nullptr;
+    Repeat* oldest = &repeats[0];
+    for (auto& rep : repeats) {
+      if (rep.fmt == fmt) { r = &rep; break; }
+      if (rep.windowStartMS < oldest->windowStartMS) oldest = &rep;
+    }
+    if (r == nullptr) {
+      r = oldest;
+      *r = {fmt, now, 0, 0};
+    }
+
+    if (now - r->windowStartMS >= Log::repeatWindowMS) {
+      suppressed = r->suppressed;
+      *r = {fmt, now, 0, 0};
+    }
+
+    if (r->count >= REPEAT_BURST) { r->suppressed++; return false; }
+    r->count++;
+    return true;
+  }
+
+  static void rateLimited(LogLevel level, const char* fmt, va_list args) {
+    if (level < minLevel) return;
+
+    uint32_t suppressed;
+    if (!allowRepeat(fmt, suppressed)) return;
+    if (suppressed > 0) emitf(level, "(%u similar messages suppressed)", suppressed);
+    emit(level, fmt, args);
+  }
+
+  static void writerThread() {
+    static char batch[LOG_BATCH_MAX];
+
+    while (1) {
+      uint32_t seen = wakeups.load(std::memory_order_acquire);
+      size_t n = 0;
+      int64_t stalledMS = -1;
+
+      while (1) {
+        Slot& s = slots[tail & (LOG_SLOTS-1)];
+        if (s.seq.load(std::memory_order_acquire) != tail+1) {
+          if (head.load(std::memory_order_relaxed) == tail) break;
+
+          // Claimed but not finished yet, it won't be long. Unless whoever claimed it never comes
+          // back (ie. exit() while they were interrupted), so give up on it once stopping.
+          if (stopping.load(std::memory_order_acquire)) {
+            if (stalledMS < 0) stalledMS = monotonicMS();
+            else if (monotonicMS()-stalledMS > LOG_STOP_WAIT_MS) {
+              dropped.fetch_add(1, std::memory_order_relaxed);
+              tail++;
+              stalledMS = -1;
+              continue;
+            }
+          }
+          std::this_thread::yield();
+          continue;
+        }
+        stalledMS = -1;
+
+        if (n + s.len > sizeof(batch)) { writeAll(batch, n); n = 0; }
+        memcpy(batch+n, s.text, s.len);
+        n += s.len;
+        s.seq.store(tail+LOG_SLOTS, std::memory_order_release);
+        tail++;
+      }
+
+      uint64_t d = dropped.exchange(0, std::memory_order_relaxed);
+      if (d > 0) {
+        int32_t r = snprintf(batch+n, sizeof(batch)-n, "(%lu log lines dropped)\n", d);
+        if (r > 0) n = std::min(n+r, sizeof(batch));
+      }
+
+      writeAll(batch, n);
+
+      if (stopping.load(std::memory_order_acquire)) break;
+      if (n == 0) wakeups.wait(seen, std::memory_order_acquire);
+    }
+  }
+
+  // A fork doesn't get our writer thread
+  static void atforkChild() {
+    async.store(false);
+    writer = nullptr;
+  }
+
+  void Log::configure(LogLevel minLevel_, Format format_, bool syslogPrefix_) {
+    minLevel = minLevel_;
+    format = format_;
+    syslogPrefix = syslogPrefix_;
+  }
+
+  void Log::startThread() {
+    std::lock_guard<std::mutex> lock(writerMutex);
+    if (writer != nullptr) return;
+
+    for (uint64_t i = 0; i < LOG_SLOTS; i++) slots[i].seq.store(head.load()+i);
+    tail = head.load();
+    stopping = false;
+
+    static bool registered = false;
+    if (!registered) {
+      pthread_atfork(nullptr, nullptr, &atforkChild);
+      atexit(&Log::stopThread);
+      registered = true;
+    }
+
+    // Signals are for the main thread, not us (ie. SIGINT calls exit(), which joins us)
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    writer = new std::thread(&writerThread);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+    async.store(true, std::memory_order_release);
+  }
+
+  void Log::stopThread() {
+    std::lock_guard<std::mutex> lock(writerMutex);
+    if (writer == nullptr) return;
+
+    // Anyone logging from here on writes directly
+    async.store(false, std::memory_order_release);
+
+    stopping.store(true, std::memory_order_release);
+    wakeups.fetch_add(1, std::memory_order_release);
+    wakeups.notify_one();
+    writer->join();
+    delete writer;
+    writer = nullptr;
+  }
+
+  void Log::verbose(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    emit(LogLevel::VERBOSE, fmt, args);
+    va_end(args);
+  }
+
+  void Log::info(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    emit(LogLevel::INFO, fmt, args);
+    va_end(args);
+  }
+
+  void Log::warn(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    rateLimited(LogLevel::WARN, fmt, args);
+    va_end(args);
+  }
+
+  void Log::error(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    rateLimited(LogLevel::ERROR, fmt, args);
+    va_end(args);
+  }
+
+  void Log::event(LogLevel level, const char* msg, std::initializer_list<Field> fields) {
+    if (level >= minLevel) emitLine(level, msg, fields);
+  }
+
+  bool Log::parseLevel(std::string_view str, LogLevel& out) {
+    for (uint8_t l = 0; l < sizeof(levelNames)/sizeof(levelNames[0]); l++) {
+      if (str == levelNames[l]) { out = (LogLevel)l; return true; }
+    }
+    return false;
+  }
+}
@@ -0,0 +1,138 @@
+// Copyright (C) 2022 Matthew Egeler
+//
+// This file is part of unified-inhibit.
+//
+// unified-inhibit is free software: you can redistribute it and/or modify it under the terms of the
+// GNU General Public License as published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// unified-inhibit is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with unified-inhibit. If
+// not, see <https://www.gnu.org/licenses/>.
+
+#include "Spawner.hpp"
+#include "EventLoop.hpp"
+#include <spawn.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#define REAP_FALLBACK_MS 50
+
+extern char** environ;
+
+namespace uinhibit {
+  static int32_t pidfdOpen(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    return -1;
+#endif
+  }
+
+  Spawner::~Spawner() {
+    // Leave them running, we just stop caring about them
+    for (auto& [key, r] : this->running) if (r.pidfd >= 0) close(r.pidfd);
+  }
+
+  void Spawner::run(std::string cmd, uint32_t key, int64_t timeoutMS,
+                    std::function<void(int32_t status)> cb) {
+    this->queued[key].push_back({std::move(cmd), timeoutMS, std::move(cb)});
+    if (!this->running.contains(key)) this->startNext(key);
+  }
+
+  void Spawner::startNext(uint32_t key) {
+    while (1) {
+      auto it = this->queued.find(key);
+      if (it == this->queued.end()) return;
+      if (it->second.empty()) { this->queued.erase(it); return; }
+
+      Job job = std::move(it->second.front());
+      it->second.pop_front();
+
+      posix_spawnattr_t attr;
+      posix_spawnattr_init(&attr);
+
+      // Own process group, so a timeout can take down everything the shell started
+      if (job.timeoutMS >= 0) {
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attr, 0);
+      }
+
+      pid_t pid;
+      const char* argv[] = {"sh", "-c", job.cmd.c_str(), NULL};
+      int32_t err = posix_spawn(&pid, "/bin/sh", NULL, &attr, (char* const*)argv, environ);
+      posix_spawnattr_destroy(&attr);
+
+      if (err != 0) {
+        if (job.cb) job.cb(-1);
+        continue; // Don't hold up the rest
+      }
+
+      Running r;
+      r.pid = pid;
+      r.pidfd = pidfdOpen(pid);
+      r.deadlineMS = (job.timeoutMS < 0) ? -1 : monotonicMS()+job.timeoutMS;
+      r.job = std::move(job);
+      this->running[key] = std::move(r);
+      return;
+    }
+  }
+
+  bool Spawner::busy() {
+    return !this->running.empty() || !this->queued.empty();
+  }
+
+  std::vector<pollfd> Spawner::pollFds() {
+    std::vector<pollfd> fds;
+    for (auto& [key, r] : this->running) if (r.pidfd >= 0) fds.push_back({r.pidfd, POLLIN, 0});
+    return fds;
+  }
+
+  int64_t Spawner::next() {
+    int64_t next = -1;
+    for (auto& [key, r] : this->running) {
+      int64_t d = r.deadlineMS;
+      if (r.killed) d = -1; // Already dealt with, just waiting for it to go away
+      if (r.pidfd < 0) {
+        int64_t fallback = monotonicMS()+REAP_FALLBACK_MS;
+        if (d < 0 || fallback < d) d = fallback;
+      }
+      if (d >= 0 && (next < 0 || d < next)) next = d;
+    }
+    return next;
+  }
+
+  void Spawner::reap() {
+    std::vector<uint32_t> finished;
+    int64_t now = monotonicMS();
+
+    for (auto& [key, r] : this->running) {
+      int32_t status;
+      if (waitpid(r.pid, &status, WNOHANG) == r.pid) {
+        if (r.pidfd >= 0) close(r.pidfd);
+
+        int32_t result = -1;
+        if (!r.killed && WIFEXITED(status)) result = WEXITSTATUS(status);
+        if (r.job.cb) r.job.cb(result);
+
+        finished.push_back(key);
+        continue;
+      }
+
+      if (!r.killed && r.deadlineMS >= 0 && now >= r.deadlineMS) {
+        kill(-r.pid, SIGKILL);
+        r.killed = true;
+      }
+    }
+
+    for (auto key : finished) {
+      this->running.erase(key);
+      this->startNext(key);
+    }
+  }
+}
@@ -0,0 +1,201 @@
+// Copyright (C) 2022 Matthew Egeler
+//
+// This file is part of unified-inhibit.
+//
+// unified-inhibit is free software: you can redistribute it and/or modify it under the terms of the
+// GNU General Public License as published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// unified-inhibit is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with unified-inhibit. If
+// not, see <https://www.gnu.org/licenses/>.
+
+#include "StateFile.hpp"
+#include "EventLoop.hpp"
+#include "util.hpp"
+#include <cstring>
+#include <climits>
+#include <ctime>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define THIS StateFile
+
+using namespace uinhibit;
+
+// Copies src into a fixed-size field, never cutting a UTF-8 sequence in half
+static void copyString(char* dst, size_t size, std::string_view src) {
+  size_t n = std::min(src.size(), size-1);
+  if (n < src.size()) while (n > 0 && (src[n] & 0xC0) == 0x80) n--;
+  memcpy(dst, src.data(), n);
+  memset(dst+n, 0, size-n);
+}
+
+THIS::THIS(std::string path) : path(path) {
+  // Build it next to where it's going then rename, so readers never map half a file. path may
+  // be under /tmp, where anyone could have made the directory (or planted symlinks) before us.
+  std::string dir = this->path.substr(0, this->path.rfind('/'));
+  if (!dir.empty() && !privateDir(dir)) throw std::runtime_error(dir+": "+strerror(errno));
+
+  std::string tmpPath = this->path+".tmp";
+  this->fd = exclusiveCreate(tmpPath);
+  if (this->fd < 0) throw std::runtime_error(tmpPath+": "+strerror(errno));
+
+  this->size = sizeof(Header)+CAPACITY*sizeof(Entry);
+  void* map = MAP_FAILED;
+  if (ftruncate(this->fd, this->size) == 0)
+    map = mmap(NULL, this->size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+
+  if (map == MAP_FAILED) {
+    std::string err = tmpPath+": "+strerror(errno);
+    close(this->fd);
+    unlink(tmpPath.c_str());
+    throw std::runtime_error(err);
+  }
+
+  this->header = (Header*)map;
+  this->entries = (Entry*)((uint8_t*)map+sizeof(Header));
+
+  memcpy(this->header->magic, MAGIC, sizeof(MAGIC));
+  this->header->version = VERSION;
+  this->header->headerSize = sizeof(Header);
+  this->header->entrySize = sizeof(Entry);
+  this->header->capacity = CAPACITY;
+  this->publish(getpid());
+
+  if (rename(tmpPath.c_str(), this->path.c_str()) != 0) {
+    std::string err = this->path+": "+strerror(errno);
+    munmap(this->header, this->size);
+    close(this->fd);
+    unlink(tmpPath.c_str());
+    throw std::runtime_error(err);
+  }
+}
+
+THIS::~THIS() {
+  // Anyone still mapping it sees we're gone rather than whatever was last inhibited
+  this->active.clear();
+  this->activeOrder.clear();
+  memset(this->typeCounts, 0, sizeof(this->typeCounts));
+  this->publish(0);
+
+  unlink(this->path.c_str());
+  munmap(this->header, this->size);
+  close(this->fd);
+}
+
+void THIS::add(std::string_view source, const Inhibit& inhibit) {
+  if (this->activeOrder.contains(inhibit.id)) return;
+
+  uint64_t order = ++this->lastOrder;
+  Active a = {inhibit, std::string(source)};
+  if (a.inhibit.created == 0) a.inhibit.created = time(NULL);
+  this->active.emplace(order, std::move(a));
+  this->activeOrder.emplace(inhibit.id, order);
+
+  for (uint32_t i = 0; i < MAX_TYPES; i++) if ((inhibit.type & (1 << i)) > 0) this->typeCounts[i]++;
+  this->publish(getpid());
+}
+
+void THIS::remove(const Inhibit& inhibit) {
+  auto it = this->activeOrder.find(inhibit.id);
+  if (it == this->activeOrder.end()) return;
+
+  auto a = this->active.find(it->second);
+  for (uint32_t i = 0; i < MAX_TYPES; i++) {
+    if ((a->second.inhibit.type & (1 << i)) > 0) this->typeCounts[i]--;
+  }
+  this->active.erase(a);
+  this->activeOrder.erase(it);
+  this->publish(getpid());
+}
+
+void THIS::publish(uint32_t pid) {
+  std::atomic_ref<uint32_t> seq(this->header->seq);
+  std::atomic_ref<uint32_t> generation(this->header->generation);
+
+  // Odd if a write never finished (ie. we're exiting from whatever interrupted it). Take it over
+  // rather than going even-odd, which readers would never get a read past.
+  uint32_t s = seq.load(std::memory_order_relaxed) & ~1u;
+  seq.store(s+1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release); // seq goes odd before anything changes
+
+  uint32_t inhibited = InhibitType::NONE;
+  for (uint32_t i = 0; i < MAX_TYPES; i++) {
+    this->header->typeCounts[i] = this->typeCounts[i];
+    if (this->typeCounts[i] > 0) inhibited |= (1 << i);
+  }
+  this->header->pid = pid;
+  this->header->inhibited = inhibited;
+  this->header->updated = time(NULL);
+
+  uint32_t count = 0;
+  for (auto& [order, a] : this->active) {
+    if (count == CAPACITY) break;
+    Entry& e = this->entries[count++];
+    e.type = a.inhibit.type;
+    e.created = a.inhibit.created;
+    copyString(e.appname, sizeof(e.appname), a.inhibit.appname);
+    copyString(e.reason, sizeof(e.reason), a.inhibit.reason);
+    copyString(e.source, sizeof(e.source), a.source);
+  }
+  this->header->count = count;
+  this->header->dropped = this->active.size()-count;
+
+  seq.store(s+2, std::memory_order_release);
+  generation.fetch_add(1, std::memory_order_release);
+  syscall(SYS_futex, &this->header->generation, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+bool THIS::read(const void* map, size_t size, Header& header, std::vector<Entry>& entries) {
+  const Header* h = (const Header*)map;
+  if (size < sizeof(Header) || memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0) return false;
+  if (h->version != VERSION || h->headerSize < sizeof(Header) || h->entrySize < sizeof(Entry))
+    return false;
+  if (h->headerSize+(uint64_t)h->capacity*h->entrySize > size) return false;
+
+  std::atomic_ref<uint32_t> seq(const_cast<uint32_t&>(h->seq));
+  for (uint32_t tries = 0; tries < 10000; tries++) {
+    uint32_t s = seq.load(std::memory_order_acquire);
+    if (s % 2 == 1) continue; // Mid-write
+
+    memcpy(&header, h, sizeof(Header));
+    uint32_t count = std::min(header.count, header.capacity);
+    entries.resize(count);
+    for (uint32_t i = 0; i < count; i++)
+      memcpy(&entries[i], (const uint8_t*)map+header.headerSize+i*header.entrySize, sizeof(Entry));
+
+    std::atomic_thread_fence(std::memory_order_acquire); // Copies land before we recheck seq
+    if (seq.load(std::memory_order_relaxed) == s) return true;
+  }
+
+  return false;
+}
+
+bool THIS::wait(const void* map, uint32_t lastGeneration, int64_t timeoutMS) {
+  uint32_t* word = &((Header*)const_cast<void*>(map))->generation;
+  std::atomic_ref<uint32_t> generation(*word);
+  int64_t deadline = monotonicMS()+timeoutMS;
+
+  // FUTEX_WAIT returns right away if it's already moved, and may wake spuriously
+  while (generation.load(std::memory_order_acquire) == lastGeneration) {
+    timespec ts, *tsp = NULL;
+    if (timeoutMS >= 0) {
+      int64_t left = deadline-monotonicMS();
+      if (left <= 0) return false;
+      ts = {left/1000, (left%1000)*1000000};
+      tsp = &ts;
+    }
+    syscall(SYS_futex, word, FUTEX_WAIT, lastGeneration, tsp, NULL, 0);
+  }
+
+  return true;
+}
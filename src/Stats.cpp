@@ -0,0 +1,105 @@
+// Copyright (C) 2022 Matthew Egeler
+//
+// This file is part of unified-inhibit.
+//
+// unified-inhibit is free software: you can redistribute it and/or modify it under the terms of the
+// GNU General Public License as published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// unified-inhibit is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with unified-inhibit. If
+// not, see <https://www.gnu.org/licenses/>.
+
+#include "Stats.hpp"
+#include <bit>
+#include <algorithm>
+
+namespace uinhibit {
+  // Values below 2^SUB_BITS get a bucket each. Above that, every power of two is split into
+  // 2^SUB_BITS buckets.
+  uint32_t Histogram::bucketOf(uint64_t us) {
+    if (us >= (1ull << MAX_BITS)) us = (1ull << MAX_BITS)-1;
+    if (us < (1u << SUB_BITS)) return us;
+
+    uint32_t exp = 63-std::countl_zero(us);
+    uint32_t sub = (us >> (exp-SUB_BITS)) & ((1u << SUB_BITS)-1);
+    return ((exp-SUB_BITS+1) << SUB_BITS) + sub;
+  }
+
+  uint64_t Histogram::bucketUpper(uint32_t bucket) {
+    if (bucket < (1u << SUB_BITS)) return bucket;
+
+    uint32_t exp = (bucket >> SUB_BITS)+SUB_BITS-1;
+    uint64_t sub = bucket & ((1u << SUB_BITS)-1);
+    uint64_t width = 1ull << (exp-SUB_BITS);
+    return (((1ull << SUB_BITS)+sub) << (exp-SUB_BITS)) + width-1;
+  }
+
+  void Histogram::record(uint64_t us) {
+    this->buckets[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t max = this->maxUS.load(std::memory_order_relaxed);
+    while (us > max && !this->maxUS.compare_exchange_weak(max, us, std::memory_order_relaxed));
+  }
+
+  uint64_t Histogram::count() const {
+    uint64_t ret = 0;
+    for (auto& b : this->buckets) ret += b.load(std::memory_order_relaxed);
+    return ret;
+  }
+
+  uint64_t Histogram::max() const {
+    return this->maxUS.load(std::memory_order_relaxed);
+  }
+
+  uint64_t Histogram::percentile(double p) const {
+    uint64_t total = this->count();
+    if (total == 0) return 0;
+
+    uint64_t want = (uint64_t)((p/100.0)*total+0.5);
+    if (want < 1) want = 1;
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < BUCKETS; i++) {
+      seen += this->buckets[i].load(std::memory_order_relaxed);
+      if (seen < want) continue;
+      if (i == BUCKETS-1) break; // Everything past our range lands here
+      return std::min(bucketUpper(i), this->max());
+    }
+    return this->max();
+  }
+
+  std::vector<std::pair<std::string, uint64_t>> InhibitStats::snapshot() const {
+    std::vector<std::pair<std::string, uint64_t>> ret = {
+      {"inhibits_received",     this->inhibitsReceived.load()},
+      {"uninhibits_received",   this->unInhibitsReceived.load()},
+      {"inhibits_forwarded",    this->inhibitsForwarded.load()},
+      {"uninhibits_forwarded",  this->unInhibitsForwarded.load()},
+      {"forward_failures",      this->forwardFailures.load()},
+      {"no_responses",          this->noResponses.load()},
+      {"dbus_messages",         this->dbusMessages.load()},
+      {"dbus_ignored",          this->dbusIgnored.load()},
+      {"active",                this->active.load()},
+    };
+
+    std::pair<const char*, const Histogram*> histograms[] = {
+      {"do_inhibit_us",   &this->doInhibitUS},
+      {"do_uninhibit_us", &this->doUnInhibitUS},
+      {"forward_us",      &this->forwardUS},
+    };
+
+    for (auto [name, h] : histograms) {
+      std::string n = name;
+      ret.push_back({n+"_count", h->count()});
+      ret.push_back({n+"_p50",   h->percentile(50)});
+      ret.push_back({n+"_p90",   h->percentile(90)});
+      ret.push_back({n+"_p99",   h->percentile(99)});
+      ret.push_back({n+"_max",   h->max()});
+    }
+
+    return ret;
+  }
+}
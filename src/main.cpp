@@ -16,11 +16,19 @@
 #include <cstdio>
 #include "InhibitInterface.hpp"
 #include <thread>
+#include <memory>
+#include <exception>
 #include <mutex>
+#include <atomic>
 #include "util.hpp"
 #include "Fork.hpp"
+#include "EventLoop.hpp"
+#include "Log.hpp"
+#include "StateFile.hpp"
 #include <signal.h>
 
+#define EXIT_DRAIN_MS 2000 // Longest we'll keep running after a signal to finish releasing
+
 extern char **environ;
 
 // TODO
@@ -33,8 +41,6 @@ extern char **environ;
 //   step back to monitoring mode?
 // * when logging inhibit state change and there are active inhibits, list the inhibitors
 //   responsible
-// * log levels
-// * optional ability to write the current inhibit state to a file
 // * optional ability to forward screensaver locks to suspend and vice-versa
 // * ability to ignore inhibits from certain appnames (--ignore steam)
 
@@ -42,32 +48,27 @@ using namespace uinhibit;
 
 static std::vector<InhibitInterface*> inhibitors;
 static InhibitType lastInhibitType = InhibitType::NONE;
-static std::map<InhibitID, std::vector<std::pair<InhibitInterface*, InhibitID>>> releasePlan;
-
-static InhibitType inhibited() {
-  InhibitType i = InhibitType::NONE;
-  for (auto& in : inhibitors) {
-    for (auto& [in, inhibit] : in->activeInhibits) i = static_cast<InhibitType>(i | inhibit.type);
-  }
-  return i;
-}
+static std::unordered_map<InhibitID, std::vector<std::pair<InhibitInterface*, InhibitID>>> releasePlan;
+static std::unique_ptr<StateFile> stateFile;
 
 static void printInhibited() {
-  auto i = inhibited();
+  auto i = InhibitInterface::globalInhibited();
   if (lastInhibitType != i) {
-    printf("Inhibit state changed to: screensaver=%d suspend=%d\n",
-           ((i & InhibitType::SCREENSAVER) > 0),
-           ((i & InhibitType::SUSPEND) > 0));
+    Log::event(LogLevel::INFO, "Inhibit state changed to:",
+               {{"screensaver", (i & InhibitType::SCREENSAVER) ? "1" : "0"},
+                {"suspend",     (i & InhibitType::SUSPEND) ? "1" : "0"}});
     lastInhibitType = i;
   }
 }
 
 static void inhibitCB(InhibitInterface* inhibitor, Inhibit inhibit) {
-  printf("Inhibit event type=%d appname='%s' reason='%s' from='%s'\n",
-         inhibit.type,
-         inhibit.appname.c_str(),
-         inhibit.reason.c_str(),
-         inhibitor->name.c_str());
+  Log::event(LogLevel::INFO, "Inhibit event",
+             {{"type",    std::to_string(inhibit.type)},
+              {"appname", inhibit.appname},
+              {"reason",  inhibit.reason},
+              {"from",    inhibitor->name}});
+  if (stateFile) stateFile->add(inhibitor->name, inhibit);
+
   // Forward to all active inhibitors (other than the originator)
   try {
     for (auto& ai : inhibitors) {
@@ -79,7 +80,7 @@ static void inhibitCB(InhibitInterface* inhibitor, Inhibit inhibit) {
     }
   }
   catch (uinhibit::InhibitNoResponseException& e) {
-    printf(ANSI_COLOR_YELLOW "Warning: no response to a dbus method call\n" ANSI_COLOR_RESET);
+    Log::warn("no response to a dbus method call");
   }
 
   // Output our global inhibit state to STDOUT if it's changed
@@ -87,10 +88,12 @@ static void inhibitCB(InhibitInterface* inhibitor, Inhibit inhibit) {
 }
 
 static void unInhibitCB(InhibitInterface* inhibitor, Inhibit inhibit) {
-  printf("UnInhibit event type=%d appname='%s' from='%s'\n",
-         inhibit.type,
-         inhibit.appname.c_str(),
-         inhibitor->name.c_str());
+  Log::event(LogLevel::INFO, "UnInhibit event",
+             {{"type",    std::to_string(inhibit.type)},
+              {"appname", inhibit.appname},
+              {"from",    inhibitor->name}});
+  if (stateFile) stateFile->remove(inhibit);
+
   // Forward to all active inhibitors (other than the originator)
   try {
     if (releasePlan.contains(inhibit.id)) {
@@ -103,7 +106,7 @@ static void unInhibitCB(InhibitInterface* inhibitor, Inhibit inhibit) {
     }
   }
   catch (uinhibit::InhibitNoResponseException& e) {
-    printf(ANSI_COLOR_YELLOW "Warning: no response to a dbus method call\n" ANSI_COLOR_RESET);
+    Log::warn("no response to a dbus method call");
   }
   // Output our global inhibit state to STDOUT if it's changed
   printInhibited();
@@ -120,7 +123,9 @@ static std::string cleanDisplayEnv(std::string display) {
   return cleanDisplay;
 }
 
-static void handleExit() {
+// Release everything we forwarded. Anything that needs the loop to finish (commands, D-Bus
+// replies, fork requests) is left to it, see busy().
+static void releaseAll() {
   for (auto& [id, plan] : releasePlan) {
     for (auto& r : plan) {
       try {
@@ -129,11 +134,27 @@ static void handleExit() {
     }
   }
   releasePlan.clear();
-  usleep(100*1000); // Give forks/threads a chance to release stuff
+  for (auto inhibitor : inhibitors) inhibitor->flushStateChange(); // Don't wait out debounceMS
+}
+
+static void handleExit() {
+  releaseAll(); // Already done (and drained) if main() got to exit normally
+  Log::stopThread(); // Already done if we're exiting, not if we're terminating
 }
 
+// exit() from the handler itself could land in the middle of anything (a log line, a state file
+// write...), so have the main loop do it
+static volatile sig_atomic_t exitRequested = 0;
+static std::atomic<EventLoop*> runningLoop = nullptr;
+
 static void handleSig(int param) {
-  exit(0);
+  exitRequested = 1;
+  EventLoop* loop = runningLoop;
+  if (loop != nullptr) loop->interrupt();
+}
+
+static void handleDumpSig(int param) {
+  StatsInhibitInterface::requestDump();
 }
 
 static Args parseArgs(int argc, char* argv[]) {
@@ -178,6 +199,7 @@ int main([[maybe_unused]]int argc, [[maybe_unused]]char *argv[]) {
   atexit(handleExit);
   std::set_terminate(handleExit);
   signal(SIGINT, handleSig);
+  signal(SIGTERM, handleSig); // Service managers stop us this way, still clean up
 
   puts("===============================================================================");
   printf("unified-inhibit v%s\n\n", version());
@@ -198,6 +220,41 @@ int main([[maybe_unused]]int argc, [[maybe_unused]]char *argv[]) {
     exit(0);
   }
 
+  // Everything from here on goes through Log
+  LogLevel logLevel = LogLevel::INFO;
+  if (args.params.contains("log-level")) {
+    auto& v = args.params.at("log-level");
+    if (v.size() != 1 || !Log::parseLevel(v[0], logLevel)) {
+      printf(ANSI_COLOR_RED "Error: --log-level must be one of verbose, info, warn, error\n"
+             ANSI_COLOR_RESET);
+      exit(1);
+    }
+  }
+
+  Log::Format logFormat = Log::Format::PLAIN;
+  if (args.params.contains("log-format")) {
+    auto& v = args.params.at("log-format");
+    if (v.size() == 1 && v[0] == "kv") logFormat = Log::Format::KV;
+    else if (v.size() != 1 || v[0] != "plain") {
+      printf(ANSI_COLOR_RED "Error: --log-format must be plain or kv\n" ANSI_COLOR_RESET);
+      exit(1);
+    }
+  }
+
+  if (args.params.contains("debounce-ms")) {
+    auto& v = args.params.at("debounce-ms");
+    char* end = nullptr;
+    if (v.size() == 1) InhibitInterface::debounceMS = strtoll(v[0].c_str(), &end, 10);
+    if (v.size() != 1 || v[0].empty() || *end != '\0' || InhibitInterface::debounceMS < 0) {
+      printf(ANSI_COLOR_RED "Error: --debounce-ms must be a number of milliseconds\n"
+             ANSI_COLOR_RESET);
+      exit(1);
+    }
+  }
+
+  // journald sets this when it's reading our stdout, and understands <priority> line prefixes
+  Log::configure(logLevel, logFormat, getenv("JOURNAL_STREAM") != NULL);
+
   puts("\n[<-] : Listening for events from interface");
   puts("[->] : Sending events to interface");
   puts("[<->]: Bidirectional");
@@ -225,6 +282,10 @@ int main([[maybe_unused]]int argc, [[maybe_unused]]char *argv[]) {
   SystemdInhibitFork systemdInhibitFork; systemdInhibitFork.run();
   LinuxKernelInhibitFork linuxInhibitFork; linuxInhibitFork.run();
 
+  // Forks don't get threads, they keep writing their own lines
+  fflush(stdout);
+  Log::startThread();
+
   // D-Bus tries to prevent usage of setuid binaries by checking if euid != ruid.
   // We need setuid, but we can just set both euid *and* ruid and D-Bus is happy.
   auto ruid = getuid();
@@ -237,7 +298,9 @@ int main([[maybe_unused]]int argc, [[maybe_unused]]char *argv[]) {
 
   // Security note: we're root, always ensure these constructors are safe and don't touch raw
   // user input in any way. Our user input may be unprivileged.
+  int64_t systemdBegin = monotonicMS();
   uinhibit::SystemdInhibitInterface i4(inhibitCB, unInhibitCB, &systemdInhibitFork); inhibitors.push_back(&i4);
+  std::vector<int64_t> startupMS = {monotonicMS()-systemdBegin};
 
   // D-Bus inhibitors that need the session bus should be constructed as the user
   if (setresuid(ruid,ruid,ruid) != 0) { printf("Failed to drop privileges\n"); exit(1); }
@@ -253,32 +316,91 @@ int main([[maybe_unused]]int argc, [[maybe_unused]]char *argv[]) {
     putenv(envMem.back());
   }
 
-  FreedesktopScreenSaverInhibitInterface i1(inhibitCB, unInhibitCB); inhibitors.push_back(&i1);
-  FreedesktopPowerManagerInhibitInterface i2(inhibitCB, unInhibitCB); inhibitors.push_back(&i2);
-  GnomeSessionManagerInhibitInterface i3(inhibitCB, unInhibitCB); inhibitors.push_back(&i3);
-  GnomeScreenSaverInhibitInterface i5(inhibitCB, unInhibitCB); inhibitors.push_back(&i5);
-  CinnamonScreenSaverInhibitInterface i6(inhibitCB, unInhibitCB); inhibitors.push_back(&i6);
-  MateScreenSaverInhibitInterface i11(inhibitCB, unInhibitCB); inhibitors.push_back(&i11);
-  LinuxKernelInhibitInterface i7(inhibitCB, unInhibitCB, &linuxInhibitFork);
-  inhibitors.push_back(&i7);
+  std::string runtimeDir = "/tmp/uinhibit-"+std::to_string(ruid);
+  if (getenv("XDG_RUNTIME_DIR") != NULL)
+    runtimeDir = std::string(getenv("XDG_RUNTIME_DIR"))+"/uinhibit";
+  std::string statsPath = runtimeDir+"/stats";
+
+  if (!args.params.contains("no-state-file")) {
+    try {
+      stateFile = std::make_unique<StateFile>(runtimeDir+"/state");
+    } catch (std::runtime_error& e) {
+      Log::warn("failed to create state file: %s", e.what());
+    }
+  }
+
+  // None of these depend on each other, and most of their startup is spent waiting on D-Bus round
+  // trips, so construct them all at once. Each prints its status as soon as it's ready.
+  std::vector<std::function<InhibitInterface*()>> constructors = {
+    []{ return new FreedesktopScreenSaverInhibitInterface(inhibitCB, unInhibitCB); },
+    []{ return new FreedesktopPowerManagerInhibitInterface(inhibitCB, unInhibitCB); },
+    []{ return new GnomeSessionManagerInhibitInterface(inhibitCB, unInhibitCB); },
+    []{ return new GnomeScreenSaverInhibitInterface(inhibitCB, unInhibitCB); },
+    []{ return new CinnamonScreenSaverInhibitInterface(inhibitCB, unInhibitCB); },
+    []{ return new MateScreenSaverInhibitInterface(inhibitCB, unInhibitCB); },
+    [&]{ return new LinuxKernelInhibitInterface(inhibitCB, unInhibitCB, &linuxInhibitFork); },
 #ifdef BUILDFLAG_X11
-  X11DPMSScreensaverInhibitInterface i12(inhibitCB, unInhibitCB); inhibitors.push_back(&i12);
+    []{ return new X11DPMSScreensaverInhibitInterface(inhibitCB, unInhibitCB); },
 #endif
-  XautolockInhibitInterface i8(inhibitCB, unInhibitCB); inhibitors.push_back(&i8);
-  XidlehookInhibitInterface i9(inhibitCB, unInhibitCB); inhibitors.push_back(&i9);
-  SxmoInhibitInterface i13(inhibitCB, unInhibitCB); inhibitors.push_back(&i13);
-  UserCommandsInhibitInterface i10(inhibitCB, unInhibitCB, args); inhibitors.push_back(&i10);
+    []{ return new XautolockInhibitInterface(inhibitCB, unInhibitCB); },
+    []{ return new XidlehookInhibitInterface(inhibitCB, unInhibitCB); },
+    []{ return new SxmoInhibitInterface(inhibitCB, unInhibitCB); },
+    [&]{ return new UserCommandsInhibitInterface(inhibitCB, unInhibitCB, args); },
+    [&]{ return new StatsInhibitInterface(inhibitCB, unInhibitCB, &inhibitors, statsPath); },
+  };
+
+  std::vector<std::unique_ptr<InhibitInterface>> owned(constructors.size());
+  std::vector<std::exception_ptr> errors(constructors.size());
+  startupMS.resize(1+constructors.size());
+  {
+    std::vector<std::jthread> threads;
+    for (size_t n = 0; n < constructors.size(); n++) {
+      threads.emplace_back([&, n]{
+        int64_t begin = monotonicMS();
+        try {
+          owned[n].reset(constructors[n]());
+        } catch (...) { errors[n] = std::current_exception(); }
+        startupMS[1+n] = monotonicMS()-begin;
+      });
+    }
+  } // Joins
+
+  for (auto& e : errors) if (e) std::rethrow_exception(e);
+  for (auto& o : owned) inhibitors.push_back(o.get());
+
+  Log::info("Startup time:");
+  for (size_t n = 0; n < inhibitors.size(); n++) {
+    Log::info("  %-32s %4ldms", inhibitors[n]->name.c_str(), startupMS[n]);
+  }
+  Log::info("  %-32s %4ldms", "total", monotonicMS()-systemdBegin);
 
   // Run inhibitors
   // Security note: it is critical we have dropped privileges before this point, as we will be
   // running user-inputted commands.
+  EventLoop loop;
   std::vector<InhibitInterface::ReturnObject> ros;
-  for (auto& inhibitor : inhibitors) ros.push_back(inhibitor->start());
+  for (auto& inhibitor : inhibitors) {
+    ros.push_back(inhibitor->start());
+    loop.add(&inhibitor->waitSet, ros.back().handle);
+  }
+
+  signal(SIGUSR1, handleDumpSig);
 
+  Log::info("------------- Started successfully --------------");
 
-  puts("\n------------- Started successfully --------------");
+  runningLoop = &loop;
+  while (!exitRequested) loop.runOnce();
+  runningLoop = nullptr;
 
-  while(1) for (auto& r : ros) {r.handle.resume(); fflush(stdout); }
+  // Keep the loop going until our releases have gone out and commands they started have finished
+  // (ie. an xautolock -enable queued behind a -disable), within reason
+  releaseAll();
+  int64_t drainDeadline = monotonicMS()+EXIT_DRAIN_MS;
+  auto busy = []{
+    for (auto inhibitor : inhibitors) if (inhibitor->busy()) return true;
+    return false;
+  };
+  while (busy() && monotonicMS() < drainDeadline) loop.runOnce(drainDeadline-monotonicMS());
 
-  for (auto m : envMem) free(m);
+  exit(0); // Cleans up through handleExit(). envMem has to outlive that, it's in our environment.
 }
@@ -3,6 +3,14 @@
 #include "mateScreenSaver.hpp"
 #include "freedesktopPowerManager.hpp"
 #include "gnomeScreenSaverAssertions.hpp"
+#include "gnomeSessionManager.hpp"
+#include "xidlehook.hpp"
+#include "stats.hpp"
+#include "debounce.hpp"
+#include "stateFile.hpp"
+#include "log.hpp"
+#include "intern.hpp"
+#include "credentials.hpp"
 #include "DBus.hpp"
 using namespace uinhibit;
 
@@ -18,4 +26,28 @@ static void assertions(DBus& dbus) {
 
   puts(ANSI_COLOR_BOLD_YELLOW "\norg.gnome.ScreenSaver:" ANSI_COLOR_RESET);
   gnomeScreenSaverAssertions(dbus);
+
+  puts(ANSI_COLOR_BOLD_YELLOW "\norg.gnome.SessionManager:" ANSI_COLOR_RESET);
+  gnomeSessionManagerAssertions(dbus);
+
+  puts(ANSI_COLOR_BOLD_YELLOW "\nxidlehook:" ANSI_COLOR_RESET);
+  xidlehookAssertions();
+
+  puts(ANSI_COLOR_BOLD_YELLOW "\nStats:" ANSI_COLOR_RESET);
+  statsAssertions(dbus);
+
+  puts(ANSI_COLOR_BOLD_YELLOW "\nDebounce:" ANSI_COLOR_RESET);
+  debounceAssertions();
+
+  puts(ANSI_COLOR_BOLD_YELLOW "\nState file:" ANSI_COLOR_RESET);
+  stateFileAssertions();
+
+  puts(ANSI_COLOR_BOLD_YELLOW "\nLog:" ANSI_COLOR_RESET);
+  logAssertions();
+
+  puts(ANSI_COLOR_BOLD_YELLOW "\nInterned strings:" ANSI_COLOR_RESET);
+  internAssertions();
+
+  puts(ANSI_COLOR_BOLD_YELLOW "\nD-Bus credentials:" ANSI_COLOR_RESET);
+  credentialsAssertions();
 }
@@ -0,0 +1,55 @@
+#pragma once
+#include "testutils.hpp"
+using namespace uinhibit;
+
+#define CREDS_NAME "org.unifiedinhibit.test.Credentials"
+#define CREDS_SILENT_NAME "org.unifiedinhibit.test.Silent"
+
+// Implements nothing, just drives its connection from start() like every D-Bus interface
+class CredentialsLookup : public DBusInhibitInterface {
+  public:
+    CredentialsLookup() : DBusInhibitInterface([](auto a, auto b){}, [](auto a, auto b){},
+                                               "credentials", CREDS_NAME, DBUS_BUS_SESSION,
+                                               {}, {}) {}
+
+    DBus& connection() { return this->dbus; }
+
+  protected:
+    void poll() override {}
+    Inhibit doInhibit(InhibitRequest r) override { return {}; }
+    void doUnInhibit(InhibitID id) override {}
+    void handleInhibitEvent(Inhibit inhibit) override {}
+    void handleUnInhibitEvent(Inhibit inhibit) override {}
+    void handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) override {}
+};
+
+static void credentialsAssertions() {
+  Quiet q;
+
+  // Owns a name but never reads anything, so nothing asked of it is ever answered
+  DBus silent(DBUS_BUS_SESSION);
+  silent.requestName(CREDS_SILENT_NAME, 0);
+
+  CredentialsLookup c;
+  InhibitInterfaceSession session(&c);
+
+  uint32_t calls = 0;
+  DBus::Credentials creds = {1, 1};
+  session.runInThread([&]{
+    c.connection().credentialsService = CREDS_SILENT_NAME;
+    c.connection().getCredentials(silent.getUniqueName(), [&](DBus::Credentials got) {
+      creds = got;
+      calls++;
+    });
+  });
+
+  assert(session.waitUntil([&]{ return calls == 1; }),
+         "Credentials lookups that never get a reply give up");
+  assert(creds.pid == 0 && creds.uid == 0, "Lookups that give up report zeroed credentials");
+
+  session.runInThread([&]{
+    c.connection().getCredentials(silent.getUniqueName(), [&](DBus::Credentials got) { calls++; });
+  });
+  assert(session.waitUntil([&]{ return calls == 2; }),
+         "Lookups that gave up aren't left waiting on the first one");
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <signal.h>
+
+static std::vector<int> dbusPIDs;
+
+// Starts a dbus-daemon with test/dbus.conf listening on address, returning once it's accepting
+// connections. It gets killed after lifetimeS to handle corner-cases that can leave it running.
+static void startDbusDaemon(std::string address, int lifetimeS) {
+  // With --fork, the pid is only printed once the daemon is listening
+  std::string cmd = "dbus-daemon --fork --print-pid --config-file=test/dbus.conf"
+    " --address='"+address+"' 2>/dev/null";
+  FILE* out = popen(cmd.c_str(), "r");
+  int daemonPid = 0;
+  if (out == NULL || fscanf(out, "%d", &daemonPid) != 1 || daemonPid <= 0) {
+    printf("Failed to spool up local dbus-daemon (do you have dbus-daemon?)\n");
+    exit(1);
+  }
+  pclose(out);
+  dbusPIDs.push_back(daemonPid);
+
+  auto pid = fork();
+  if (pid == 0) {
+    setpgid(getpid(), getpid());
+    sleep(lifetimeS);
+    kill(daemonPid, SIGKILL);
+    _exit(0);
+  }
+  dbusPIDs.push_back(-pid);
+}
+
+static void stopDbusDaemons() {
+  for(auto pid : dbusPIDs) kill(pid, SIGKILL);
+}
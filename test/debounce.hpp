@@ -0,0 +1,103 @@
+#pragma once
+#include "testutils.hpp"
+using namespace uinhibit;
+
+// Records every handleInhibitStateChanged()
+class StateRecorder : public InhibitInterface {
+  public:
+    StateRecorder() : InhibitInterface([](auto a, auto b){}, [](auto a, auto b){}, "recorder") {}
+
+    ReturnObject start() override {
+      while (1) co_await this->waitFor({});
+    }
+
+    std::vector<InhibitType> changes;
+
+  protected:
+    Inhibit doInhibit(InhibitRequest r) override {
+      Inhibit ret = {};
+      ret.type = r.type;
+      ret.appname = r.appname;
+      ret.reason = r.reason;
+      ret.id = {this->instanceId, 0, ++this->lastCookie};
+      return ret;
+    }
+
+    void doUnInhibit(InhibitID id) override {}
+    void handleInhibitEvent(Inhibit inhibit) override {}
+    void handleUnInhibitEvent(Inhibit inhibit) override {}
+    void handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) override {
+      this->changes.push_back(inhibited);
+    }
+
+  private:
+    uint32_t lastCookie = 0;
+};
+
+static void debounceAssertions() {
+  InhibitRequest screensaver = {InhibitType::SCREENSAVER, "appname", "reason"};
+  InhibitRequest suspend = {InhibitType::SUSPEND, "appname", "reason"};
+  auto both = static_cast<InhibitType>(InhibitType::SCREENSAVER | InhibitType::SUSPEND);
+
+  {
+    InhibitInterface::debounceMS = 0;
+    StateRecorder r;
+    InhibitInterfaceSession session(&r);
+
+    size_t changes = 0;
+    session.runInThread([&]{ r.unInhibit(r.inhibit(screensaver).id); changes = r.changes.size(); });
+    assert(changes == 2, "With debouncing off, every state change is handled right away");
+  }
+
+  InhibitInterface::debounceMS = 50;
+  StateRecorder r;
+  InhibitInterfaceSession session(&r);
+
+  // An app dropping and retaking its inhibit (ie. a browser on tab switch)
+  Inhibit ss, sus;
+  size_t changes = 0;
+  session.runInThread([&]{
+    r.unInhibit(r.inhibit(screensaver).id);
+    ss = r.inhibit(screensaver);
+    changes = r.changes.size();
+  });
+  assert(changes == 0, "State changes are held back for the debounce window");
+
+  bool one = session.waitUntil([&]{ return r.changes.size() == 1; });
+  assert(one && r.changes[0] == InhibitType::SCREENSAVER,
+         "Changes within the debounce window are handled as one state change");
+
+  // Suspend going through right away also flushes anything pending
+  session.runInThread([&]{
+    r.unInhibit(ss.id);
+    ss = r.inhibit(screensaver);
+    sus = r.inhibit(suspend);
+    changes = r.changes.size();
+  });
+  assert(changes >= 2 && r.changes.back() == both, "Suspend state changes aren't held back");
+  assert(changes == 2, "Changes ending in the state we started with aren't handled");
+
+  InhibitInterface::debounceMS = 60*1000;
+  session.runInThread([&]{
+    r.unInhibit(ss.id);
+    r.unInhibit(sus.id);
+    changes = r.changes.size();
+  });
+  assert(changes == 3 && r.changes[2] == InhibitType::NONE,
+         "Suspend state changes take pending changes with them");
+
+  bool busy = false, busyAfter = true;
+  session.runInThread([&]{
+    ss = r.inhibit(screensaver);
+    size_t held = r.changes.size();
+    busy = r.busy();
+    r.flushStateChange();
+    busyAfter = r.busy();
+    changes = r.changes.size()-held;
+  });
+  assert(changes == 1 && r.changes.back() == InhibitType::SCREENSAVER,
+         "Pending state changes can be flushed without waiting out the window");
+  assert(busy && !busyAfter, "Interfaces are busy while a state change is pending");
+
+  InhibitInterface::debounceMS = 0;
+}
@@ -30,7 +30,6 @@ static void freedesktopPowerManagerAssertions(DBus& dbus) {
         new FreedesktopPowerManagerInhibitInterface([](auto a, auto b){}, [](auto a, auto b){})
       );
       impl_session = std::unique_ptr<InhibitInterfaceSession>(new InhibitInterfaceSession(impl_i.get()));
-      usleep(50*1000); // Give D-Bus a chance to ensure name is fully claimed
     }
 
     FreedesktopPowerManagerInhibitInterface i([](auto a, Inhibit in){}, [](auto a, Inhibit in){});
@@ -0,0 +1,60 @@
+#pragma once
+#include "testutils.hpp"
+using namespace uinhibit;
+
+#define GSM_NAME "org.gnome.SessionManager"
+#define GSM_PATH "/org/gnome/SessionManager"
+
+static uint32_t gsmInhibit(DBus& dbus, const char* appname) {
+  const char* reason = "reason";
+  uint32_t xid = 0;
+  uint32_t flags = 8; // Session idle
+  auto r = dbus.newMethodCall(GSM_NAME, GSM_PATH, GSM_NAME, "Inhibit")
+    .appendArgs(DBUS_TYPE_STRING, &appname, DBUS_TYPE_UINT32, &xid, DBUS_TYPE_STRING, &reason,
+                DBUS_TYPE_UINT32, &flags, DBUS_TYPE_INVALID)
+    ->sendAwait(200);
+
+  uint32_t cookie = 0;
+  if (r.notNull()) r.getArgs(DBUS_TYPE_UINT32, &cookie, DBUS_TYPE_INVALID);
+  return cookie;
+}
+
+static std::string gsmIntrospect(DBus& dbus) {
+  auto r = dbus.newMethodCall(GSM_NAME, GSM_PATH, "org.freedesktop.DBus.Introspectable",
+                              "Introspect").sendAwait(200);
+  const char* xml = "";
+  if (r.notNull()) r.getArgs(DBUS_TYPE_STRING, &xml, DBUS_TYPE_INVALID);
+  return xml;
+}
+
+static void gnomeSessionManagerAssertions(DBus& dbus) {
+  Quiet q;
+  GnomeSessionManagerInhibitInterface i([](auto a, auto b){}, [](auto a, auto b){});
+  InhibitInterfaceSession session(&i);
+
+  std::string before = gsmIntrospect(dbus); // Cached from here on
+
+  uint32_t cookie = gsmInhibit(dbus, "appname");
+  session.waitUntil([&]{ return i.activeInhibits.size() == 1; });
+
+  std::string node = "<node name='Inhibitor"+std::to_string(cookie)+"'/>";
+  assert(before.find("<interface name='" GSM_NAME "'>") != std::string::npos &&
+         before.find(node) == std::string::npos &&
+         gsmIntrospect(dbus).find(node) != std::string::npos,
+         "Introspect lists a new inhibitor even after it was cached without it");
+
+  bool replied = false;
+  try {
+    auto r = dbus.newMethodCall(GSM_NAME, GSM_PATH, GSM_NAME, "Uninhibit")
+      .appendArgs(DBUS_TYPE_UINT32, &cookie, DBUS_TYPE_INVALID)
+      ->sendAwait(200);
+    replied = r.notNull();
+  } catch (DBus::Exception& e) {}
+  assert(cookie > 0 && replied, "Replies to a call to Uninhibit");
+
+  assert(session.waitUntil([&]{ return i.activeInhibits.empty(); }),
+         "Uninhibit removes the active inhibit from object state");
+
+  assert(gsmIntrospect(dbus).find(node) == std::string::npos,
+         "Introspect stops listing an inhibitor once it's released");
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "testutils.hpp"
+using namespace uinhibit;
+
+// IDs from the appname, as D-Bus interfaces make them from the sender
+class SenderIds : public InhibitInterface {
+  public:
+    SenderIds() : InhibitInterface([](auto a, auto b){}, [](auto a, auto b){}, "senders") {}
+
+    ReturnObject start() override {
+      while (1) co_await this->waitFor({});
+    }
+
+  protected:
+    Inhibit doInhibit(InhibitRequest r) override {
+      Inhibit ret = {};
+      ret.type = r.type;
+      ret.appname = r.appname;
+      ret.reason = r.reason;
+      ret.id = {this->instanceId, internString(r.appname), 1};
+      return ret;
+    }
+
+    void doUnInhibit(InhibitID id) override {}
+    void handleInhibitEvent(Inhibit inhibit) override {}
+    void handleUnInhibitEvent(Inhibit inhibit) override {}
+    void handleInhibitStateChanged(InhibitType inhibited, Inhibit inhibit) override {}
+};
+
+static void internAssertions() {
+  internGraceMS = 0; // Anything unreferenced goes whenever something new is interned
+
+  uint32_t lookup = internString(":1.1000");
+  internString(":1.1001");
+  assert(internedString(lookup) == "" && internString(":1.1000") != lookup,
+         "Strings nothing refers to are freed, and their handles aren't reused");
+
+  SenderIds s;
+  InhibitInterfaceSession session(&s);
+
+  Inhibit i;
+  session.runInThread([&]{ i = s.inhibit({InhibitType::SCREENSAVER, ":1.1002", "reason"}); });
+  internString(":1.1003");
+  assert(internedString(i.id.str) == ":1.1002" && internString(":1.1002") == i.id.str,
+         "Strings an active inhibit refers to are kept");
+
+  session.runInThread([&]{ s.unInhibit(i.id); });
+  internString(":1.1004");
+  assert(internedString(i.id.str) == "", "Strings are freed once their inhibit is released");
+
+  internGraceMS = 60*1000;
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include "testutils.hpp"
+#include "Log.hpp"
+#include <thread>
+#include <fcntl.h>
+using namespace uinhibit;
+
+// Everything written to stdout from the time it's constructed, until done()
+class StdoutCapture {
+  public:
+    StdoutCapture(int32_t pipeSize = 0) {
+      fflush(stdout);
+      int fds[2];
+      if (pipe2(fds, O_CLOEXEC) != 0) return;
+      if (pipeSize > 0) fcntl(fds[1], F_SETPIPE_SZ, pipeSize);
+      this->readFd = fds[0];
+      this->stdoutFd = dup(STDOUT_FILENO);
+      dup2(fds[1], STDOUT_FILENO);
+      close(fds[1]);
+    }
+
+    // Must be reading before anything can block on a full pipe
+    void startReading() {
+      this->reader = std::thread([this] {
+        char buf[4096];
+        ssize_t r;
+        while ((r = read(this->readFd, buf, sizeof(buf))) > 0) this->out.append(buf, r);
+      });
+    }
+
+    std::string done() {
+      if (!this->reader.joinable()) this->startReading();
+      fflush(stdout);
+      dup2(this->stdoutFd, STDOUT_FILENO); // Drops the last write end, so the reader sees EOF
+      close(this->stdoutFd);
+      this->reader.join();
+      close(this->readFd);
+      return this->out;
+    }
+
+  private:
+    int32_t readFd = -1;
+    int32_t stdoutFd = -1;
+    std::thread reader;
+    std::string out;
+};
+
+static uint32_t countLines(const std::string& str) {
+  return std::count(str.begin(), str.end(), '\n');
+}
+
+static void logAssertions() {
+  {
+    Log::configure(LogLevel::WARN, Log::Format::PLAIN, false);
+    StdoutCapture c;
+    Log::info("Below the level");
+    Log::warn("At the level");
+    Log::error("Above the level");
+    std::string out = c.done();
+    assert(out.find("Below") == std::string::npos &&
+           out.find("At the level") != std::string::npos &&
+           out.find("Above the level") != std::string::npos,
+           "Lines below the configured level aren't logged");
+  }
+
+  {
+    Log::configure(LogLevel::INFO, Log::Format::KV, true);
+    StdoutCapture c;
+    Log::event(LogLevel::INFO, "Inhibit event",
+               {{"type", "1"}, {"appname", "app name=\"x\""}, {"reason", "a\n<0>forged"}});
+    std::string out = c.done();
+    assert(out == "<6>level=info msg=\"Inhibit event\" type=1 appname=\"app name=\\\"x\\\"\""
+                  " reason=\"a\\n<0>forged\"\n",
+           "KV field values are quoted and escaped when they need it");
+  }
+
+  {
+    Log::configure(LogLevel::INFO, Log::Format::PLAIN, true);
+    StdoutCapture c;
+    Log::event(LogLevel::INFO, "Inhibit event", {{"appname", "a\n<0>forged"}, {"empty", ""}});
+    Log::info("Lock %s", "b\r\n<0>forged");
+    std::string out = c.done();
+    assert(countLines(out) == 2 && out.find("\n<0>") == std::string::npos &&
+           out.find("appname=\"a\\n<0>forged\" empty=\"\"") != std::string::npos,
+           "Plain lines can't be split by what's logged in them");
+  }
+
+  {
+    Log::configure(LogLevel::INFO, Log::Format::PLAIN, false);
+    Log::repeatWindowMS = 100;
+    auto warnSite = []{ Log::warn("Repeated warning"); };
+
+    StdoutCapture c;
+    for (int i = 0; i < 8; i++) warnSite();
+    Log::warn("Another site");
+    usleep(120*1000); // Into the next window
+    warnSite();
+    std::string out = c.done();
+
+    size_t suppressed = out.find("(3 similar messages suppressed)");
+    assert(countLines(out) == 8 && out.find("Another site") != std::string::npos &&
+           suppressed != std::string::npos && suppressed > out.find("Another site"),
+           "Warnings are rate limited per call site, noting how many were suppressed");
+    Log::repeatWindowMS = 10000;
+  }
+
+  {
+    // Nobody reads the pipe until we're done logging, so the writer thread blocks on it and the
+    // ring fills up
+    const uint32_t total = 2000;
+    StdoutCapture c(4096);
+    Log::startThread();
+    for (uint32_t i = 0; i < total; i++) Log::info("Line %u", i);
+    c.startReading();
+    Log::stopThread();
+    std::string out = c.done();
+
+    uint32_t lines = 0, dropped = 0;
+    size_t pos = 0;
+    while (pos < out.size()) {
+      size_t end = out.find('\n', pos);
+      std::string line = out.substr(pos, end-pos);
+      unsigned long d;
+      if (line.rfind("Line ", 0) == 0) lines++;
+      else if (sscanf(line.c_str(), "(%lu log lines dropped)", &d) == 1) dropped += d;
+      pos = end+1;
+    }
+    assert(dropped > 0 && lines+dropped == total,
+           "Lines that don't fit in the ring are dropped and counted");
+  }
+}
@@ -42,7 +42,6 @@ static void simpleDbusAssertions(
 
       impl_i = construct([](auto a, auto b){}, [](auto a, auto b){});
       impl_session = std::unique_ptr<InhibitInterfaceSession>(new InhibitInterfaceSession(impl_i.get()));
-      usleep(50*1000); // Give D-Bus a chance to ensure name is fully claimed
     }
 
     uint64_t inhibitCB_calls = 0;
@@ -85,8 +84,9 @@ static void simpleDbusAssertions(
       return cookie > 0;
     }, mode+" mode: Returns a valid cookie (> 0) when calling Inhibit over D-Bus");
 
+    // Monitoring, we only see it once the implementer's reply comes by
     int64_t size = -1;
-    session.runInThread([&size, &i](){ size = i->activeInhibits.size(); });
+    session.waitUntil([&size, &i](){ size = i->activeInhibits.size(); return size == 1; });
 
     bool inhibitExists = assert(size == 1, mode+" mode: Calling Inhibit over D-Bus results"
                                 " in 1 active inhibit in object state");
@@ -100,8 +100,8 @@ static void simpleDbusAssertions(
     }, mode+" mode: Calling Inhibit over D-Bus results in an Inhibit object stored that"
     " looks like the inhibit we requested");
 
-    usleep(100*1000); // Give D-Bus some time
-    bool cb = assert(inhibitCB_calls-inhibitCB_callsBefore == 1, mode+" mode: Inhibit call over D-Bus calls our inhibit callback");
+    bool cb = assert(session.waitUntil([&]{ return inhibitCB_calls-inhibitCB_callsBefore == 1; }),
+                     mode+" mode: Inhibit call over D-Bus calls our inhibit callback");
 
     assert(cb, [&lastCBInhibit, &appname, &reason, &inhibitType]() {
       return ((lastCBInhibit.appname == std::string(appname))
@@ -125,11 +125,10 @@ static void simpleDbusAssertions(
     }, mode+" mode: Replies to a call to UnInhibit");
 
     int64_t size2 = -1;
-    session.runInThread([&size2, &i](){ size2 = i->activeInhibits.size(); });
+    session.waitUntil([&size2, &i](){ size2 = i->activeInhibits.size(); return size2 == 0; });
     assert(size2 == 0, mode+" mode: UnInhibit removes the active inhibit from object state");
 
-    usleep(100*1000); // Give D-Bus some time
-    cb = assert(uninhibitCB_calls-uninhibitCB_callsBefore == 1,
+    cb = assert(session.waitUntil([&]{ return uninhibitCB_calls-uninhibitCB_callsBefore == 1; }),
                 mode+" mode: UnInhibit call over D-Bus calls our uninhibit callback");
 
     assert(cb, [&lastCBUnInhibit, &appname, &reason, &inhibitType]() {
@@ -154,9 +153,15 @@ static void simpleDbusAssertions(
 
     inhibitCB_callsBefore = inhibitCB_calls;
     bool except = false;
-    try { inhibit = i->inhibit(req); } catch (...) { except = true; }
+    session.runInThread([&]{ try { inhibit = i->inhibit(req); } catch (...) { except = true; } });
 
-    if(monitor) usleep(100*1000); // Give D-Bus some time
+    // Forwarded to the implementer without waiting for it, so wait for it to get there
+    int64_t size4 = -1;
+    if (monitor)
+      impl_session->waitUntil([&]{
+        size4 = impl_i->activeInhibits.size();
+        return size4-size3 == 1;
+      });
 
     assert(!except, mode+" mode: inhibit() with a valid request generates no exceptions");
     assert((inhibitCB_calls-inhibitCB_callsBefore) == 0,
@@ -175,11 +180,8 @@ static void simpleDbusAssertions(
               && (in.type == inhibitType));
     },mode+" mode: active inhibit in our state from call to inhibit() is valid");
 
-    int64_t size4 = -1;
     bool haveImplInhibit = false;
     if (monitor) {
-      impl_session->runInThread([&size4, &impl_i](){ size4 = impl_i->activeInhibits.size(); });
-
       haveImplInhibit = assert(size4-size3 == 1, mode+" mode: inhibit() results in 1 new"
                                " activeInhibit on the implementor side");
     }
@@ -188,13 +190,10 @@ static void simpleDbusAssertions(
 
     uninhibitCB_callsBefore = uninhibitCB_calls;
     except = false;
-    try {
-      i->unInhibit(inhibit.id);
-    } catch (...) {
-      except = true;
-    }
+    session.runInThread([&]{ try { i->unInhibit(inhibit.id); } catch (...) { except = true; } });
 
-    if(monitor) usleep(100*1000); // Give D-Bus some time
+    if (monitor)
+      impl_session->waitUntil([&]{ size4 = impl_i->activeInhibits.size(); return size4 == size3; });
 
     assert(!except, mode+" mode: unInhibit() with a valid inhibit id for an active inhibit generates no exceptions");
     assert((uninhibitCB_calls-uninhibitCB_callsBefore) == 0,
@@ -207,9 +206,6 @@ static void simpleDbusAssertions(
            " active inhibits in object state");
 
     if (monitor) {
-      size4 = -1;
-      impl_session->runInThread([&size4, &impl_i](){ size4 = impl_i->activeInhibits.size(); });
-
       assert(haveImplInhibit, size4 == size3,
              mode+" mode: unInhibit() after inhibit() with a valid request results in the removal of"
              " the inhibit from the implementor's object state");
@@ -222,13 +218,11 @@ static void simpleDbusAssertions(
       impl_session->runInThread([&size3, &impl_i](){ size3 = impl_i->activeInhibits.size(); });
 
     except = false;
-    try {
-      req.type = InhibitType::SUSPEND;
-      if (inhibitType == InhibitType::SUSPEND) req.type = InhibitType::SCREENSAVER;
-      i->inhibit(req);
-    } catch (InhibitRequestUnsupportedTypeException& e) {
-      except = true;
-    }
+    req.type = InhibitType::SUSPEND;
+    if (inhibitType == InhibitType::SUSPEND) req.type = InhibitType::SCREENSAVER;
+    session.runInThread([&]{
+      try { i->inhibit(req); } catch (InhibitRequestUnsupportedTypeException& e) { except = true; }
+    });
 
     assert(except,
            mode+" mode: inhibit() with the wrong inhibit type throws InhibitRequestUnsupportedTypeException");
@@ -260,16 +254,77 @@ static void simpleDbusAssertions(
           .appendArgs(DBUS_TYPE_STRING, &appname, DBUS_TYPE_STRING, &reason, DBUS_TYPE_INVALID)
           ->sendAwait(200);
 
-        usleep(100*1000); // Give D-Bus some time
-
-        session.runInThread([&size2, &i](){ size2 = i->activeInhibits.size(); });
+        session.waitUntil([&]{ size2 = i->activeInhibits.size(); return size2 == size+1; });
       }
 
-      usleep(100*1000); // Give D-Bus some time
-      session.runInThread([&size3, &i](){ size3 = i->activeInhibits.size(); });
+      // Released once NameOwnerChanged says dbus2 is gone
+      session.waitUntil([&]{ size3 = i->activeInhibits.size(); return size3 == size; });
 
       assert((size2 == size+1) && (size3 == size),mode+" mode: If a sender inhibits but dissappears"
              " (ie. application crashes), the inhibit gets automatically released");
     }
+
+    // Serials are only unique per connection, so two callers can use the same one
+    if (monitor) {
+      int64_t size = -1;
+      int64_t size2 = -1;
+      session.runInThread([&size, &i](){ size = i->activeInhibits.size(); });
+
+      {
+        DBus a(DBUS_BUS_SESSION), b(DBUS_BUS_SESSION);
+
+        // Both calls go out before the implementer can reply to either
+        impl_session->runInThread([&]{
+          const char* appname = "appname";
+          const char* reason = "reason";
+          for (DBus* c : {&a, &b}) {
+            auto m = c->newMethodCall(dbusName.c_str(), dbusPath.c_str(),
+                                      dbusInterface.c_str(), "Inhibit");
+            m.appendArgs(DBUS_TYPE_STRING, &appname, DBUS_TYPE_STRING, &reason, DBUS_TYPE_INVALID);
+            dbus_message_set_serial(m.msg, 4242);
+            m.send();
+            c->flush();
+          }
+        });
+
+        session.waitUntil([&]{ size2 = i->activeInhibits.size(); return size2 == size+2; });
+      }
+
+      session.waitUntil([&]{ return (int64_t)i->activeInhibits.size() == size; });
+
+      assert(size2 == size+2, mode+" mode: Calls from two senders with the same serial are both"
+             " registered");
+    }
+
+    // Whoever implements the interface restarts (new unique name) while we watch
+    if (monitor) {
+      int64_t size = -1;
+      session.runInThread([&size, &i](){ size = i->activeInhibits.size(); });
+
+      impl_session.reset();
+      impl_i.reset();
+      impl_i = construct([](auto a, auto b){}, [](auto a, auto b){});
+      impl_session.reset(new InhibitInterfaceSession(impl_i.get()));
+
+      const char* appname = "appname";
+      const char* reason = "reason";
+      auto r = dbus.newMethodCall(dbusName.c_str(), dbusPath.c_str(),
+                                  dbusInterface.c_str(), "Inhibit")
+        .appendArgs(DBUS_TYPE_STRING, &appname, DBUS_TYPE_STRING, &reason, DBUS_TYPE_INVALID)
+        ->sendAwait(200);
+
+      assert(!impl_i->monitor && !r.isNull() &&
+             session.waitUntil([&]{ return (int64_t)i->activeInhibits.size() == size+1; }),
+             mode+" mode: Inhibits keep being seen after the implementer restarts");
+
+      uint32_t cookie = 0;
+      if (!r.isNull()) r.getArgs(DBUS_TYPE_UINT32, &cookie, DBUS_TYPE_INVALID);
+      dbus.newMethodCall(dbusName.c_str(), dbusPath.c_str(), dbusInterface.c_str(), "UnInhibit")
+        .appendArgs(DBUS_TYPE_UINT32, &cookie, DBUS_TYPE_INVALID)
+        ->sendAwait(200);
+
+      assert(session.waitUntil([&]{ return (int64_t)i->activeInhibits.size() == size; }),
+             mode+" mode: UnInhibit is seen after the implementer restarts");
+    }
   }
 }
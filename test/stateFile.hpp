@@ -0,0 +1,117 @@
+#pragma once
+#include "testutils.hpp"
+#include "StateFile.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <thread>
+#include <atomic>
+using namespace uinhibit;
+
+#define STATE_TEST_PATH "/tmp/uitest-state/state"
+
+static Inhibit mkStateInhibit(InhibitType type, std::string appname, uint32_t cookie) {
+  Inhibit ret = {};
+  ret.type = type;
+  ret.appname = appname;
+  ret.reason = "reason";
+  ret.id = {1000, 0, cookie};
+  return ret;
+}
+
+static void stateFileAssertions() {
+  StateFile::Header h;
+  std::vector<StateFile::Entry> entries;
+
+  auto state = std::make_unique<StateFile>(STATE_TEST_PATH);
+  int fd = open(STATE_TEST_PATH, O_RDWR | O_CLOEXEC); // RW only to fake an interrupted write
+  struct stat st = {};
+  fstat(fd, &st);
+  void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  bool ok = (map != MAP_FAILED) && StateFile::read(map, st.st_size, h, entries);
+  assert(ok && h.pid == (uint32_t)getpid() && h.inhibited == InhibitType::NONE && h.count == 0,
+         "State file is created with nothing inhibited");
+
+  uint32_t generation = h.generation;
+  auto ss = mkStateInhibit(InhibitType::SCREENSAVER, "appname", 1);
+  state->add("org.freedesktop.ScreenSaver", ss);
+  StateFile::read(map, st.st_size, h, entries);
+  assert(h.inhibited == InhibitType::SCREENSAVER && h.typeCounts[0] == 1 && h.count == 1 &&
+         h.generation != generation,
+         "Inhibits update the inhibited types, counts and generation");
+  assert(std::string(entries[0].appname) == "appname" &&
+         std::string(entries[0].reason) == "reason" &&
+         std::string(entries[0].source) == "org.freedesktop.ScreenSaver" &&
+         entries[0].type == InhibitType::SCREENSAVER && entries[0].created > 0,
+         "Active inhibits are listed with where they came from");
+
+  // 62 bytes of 'a', then a 3 byte character straddling the end of appname
+  auto longName = mkStateInhibit(InhibitType::SUSPEND, std::string(62, 'a')+"€", 2);
+  state->add("org.gnome.SessionManager", longName);
+  StateFile::read(map, st.st_size, h, entries);
+  assert(h.inhibited == (InhibitType::SCREENSAVER | InhibitType::SUSPEND) &&
+         std::string(entries[1].appname) == std::string(62, 'a'),
+         "Long strings are cut short on a UTF-8 boundary");
+
+  state->remove(longName);
+  generation = h.generation;
+  std::jthread later([&]{ usleep(20*1000); state->remove(ss); });
+  bool woke = StateFile::wait(map, generation, 2000);
+  later.join();
+  StateFile::read(map, st.st_size, h, entries);
+  assert(woke && h.inhibited == InhibitType::NONE && h.count == 0 && h.typeCounts[1] == 0,
+         "Waiting on the generation wakes on change");
+  assert(!StateFile::wait(map, h.generation, 10), "Waiting on the generation times out");
+
+  // Reader racing the writer must never see a half-written state
+  std::atomic<bool> done = false;
+  std::atomic<uint32_t> torn = 0, reads = 0;
+  std::jthread reader([&]{
+    StateFile::Header rh;
+    std::vector<StateFile::Entry> re;
+    while (!done) {
+      if (!StateFile::read(map, st.st_size, rh, re)) continue;
+      reads++;
+      if (rh.count+rh.dropped != rh.typeCounts[0] || re.size() != rh.count) torn++;
+      for (uint32_t i = 0; i < rh.count; i++) if (re[i].type != InhibitType::SCREENSAVER) torn++;
+    }
+  });
+
+  uint32_t n = StateFile::CAPACITY+10;
+  for (uint32_t round = 0; round < 50; round++) {
+    for (uint32_t i = 0; i < n; i++)
+      state->add("org.mate.ScreenSaver", mkStateInhibit(InhibitType::SCREENSAVER, "a", 100+i));
+    for (uint32_t i = 0; i < n; i++)
+      state->remove(mkStateInhibit(InhibitType::SCREENSAVER, "a", 100+i));
+  }
+  done = true;
+  reader.join();
+  assert(torn == 0 && reads > 0, "Readers always get a consistent snapshot");
+
+  for (uint32_t i = 0; i < n; i++)
+    state->add("org.mate.ScreenSaver", mkStateInhibit(InhibitType::SCREENSAVER, "a", 100+i));
+  StateFile::read(map, st.st_size, h, entries);
+  assert(h.count == StateFile::CAPACITY && h.dropped == 10 && h.typeCounts[0] == n,
+         "Inhibits past capacity are counted but not listed");
+
+  // As if we're exiting from a signal that landed mid-write
+  std::atomic_ref<uint32_t>(((StateFile::Header*)map)->seq).fetch_add(1);
+  state.reset();
+  ok = StateFile::read(map, st.st_size, h, entries);
+  assert(ok && h.pid == 0 && h.inhibited == InhibitType::NONE &&
+         access(STATE_TEST_PATH, F_OK) != 0,
+         "State file is cleared and removed when we're done, even mid-write");
+
+  munmap(map, st.st_size);
+  rmdir("/tmp/uitest-state");
+
+  bool refused = false;
+  mkdir("/tmp/uitest-state-shared", 0755);
+  try { StateFile shared("/tmp/uitest-state-shared/state"); }
+  catch (std::runtime_error& e) { refused = true; }
+  assert(refused && access("/tmp/uitest-state-shared/state.tmp", F_OK) != 0,
+         "State file isn't created in a directory others can get into");
+  rmdir("/tmp/uitest-state-shared");
+}
@@ -0,0 +1,140 @@
+#pragma once
+#include "testutils.hpp"
+using namespace uinhibit;
+
+// Reads the a{sa{st}} Stats property out of a Properties.Get reply
+static std::map<std::string, std::map<std::string, uint64_t>> parseStats(DBus::Message& r) {
+  std::map<std::string, std::map<std::string, uint64_t>> ret;
+
+  DBusMessageIter iter, variantIter, arrayIter;
+  if (!dbus_message_iter_init(r.msg, &iter)) return ret;
+  if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT) return ret;
+  dbus_message_iter_recurse(&iter, &variantIter);
+  if (dbus_message_iter_get_arg_type(&variantIter) != DBUS_TYPE_ARRAY) return ret;
+  dbus_message_iter_recurse(&variantIter, &arrayIter);
+
+  while (dbus_message_iter_get_arg_type(&arrayIter) == DBUS_TYPE_DICT_ENTRY) {
+    DBusMessageIter entryIter, valuesIter;
+    const char* name;
+    dbus_message_iter_recurse(&arrayIter, &entryIter);
+    dbus_message_iter_get_basic(&entryIter, &name);
+    dbus_message_iter_next(&entryIter);
+    dbus_message_iter_recurse(&entryIter, &valuesIter);
+
+    while (dbus_message_iter_get_arg_type(&valuesIter) == DBUS_TYPE_DICT_ENTRY) {
+      DBusMessageIter valueIter;
+      const char* key;
+      uint64_t value;
+      dbus_message_iter_recurse(&valuesIter, &valueIter);
+      dbus_message_iter_get_basic(&valueIter, &key);
+      dbus_message_iter_next(&valueIter);
+      dbus_message_iter_get_basic(&valueIter, &value);
+      ret[name][key] = value;
+      dbus_message_iter_next(&valuesIter);
+    }
+
+    dbus_message_iter_next(&arrayIter);
+  }
+
+  return ret;
+}
+
+static void statsAssertions(DBus& dbus) {
+  Histogram h;
+  for (uint64_t us = 1; us <= 1000; us++) h.record(us);
+  assert(h.count() == 1000 && h.max() == 1000, "Histogram counts every value and tracks the max");
+
+  uint64_t p50 = h.percentile(50), p99 = h.percentile(99);
+  assert(p50 >= 500 && p50 <= 500*1.125 && p99 >= 990 && p99 <= 1000,
+         "Histogram percentiles are within 12.5% of the real value");
+
+  Histogram big;
+  big.record(UINT64_MAX);
+  assert(big.count() == 1 && big.percentile(100) == UINT64_MAX,
+         "Histogram takes values past its range");
+
+  Quiet q;
+  std::vector<InhibitInterface*> inhibitors;
+  MateScreenSaverInhibitInterface mate([](auto a, auto b){}, [](auto a, auto b){});
+  StatsInhibitInterface stats([](auto a, auto b){}, [](auto a, auto b){}, &inhibitors,
+                              "/tmp/uitest-stats/stats");
+  inhibitors = {&mate, &stats};
+
+  InhibitInterfaceSession mateSession(&mate);
+  InhibitInterfaceSession statsSession(&stats);
+
+  const char* appname = "appname";
+  const char* reason = "reason";
+  auto r = dbus.newMethodCall("org.mate.ScreenSaver", "/org/mate/ScreenSaver",
+                              "org.mate.ScreenSaver", "Inhibit")
+    .appendArgs(DBUS_TYPE_STRING, &appname, DBUS_TYPE_STRING, &reason, DBUS_TYPE_INVALID)
+    ->sendAwait(200);
+
+  Inhibit forwarded;
+  mateSession.runInThread([&]{ forwarded = mate.inhibit({InhibitType::SCREENSAVER, "a", "b"}); });
+
+  assert(mate.stats.inhibitsReceived.load() == 1 && mate.stats.active.load() == 2 &&
+         mate.stats.forwardUS.count() == 1,
+         "Counts inhibits received over D-Bus, time to forward them and active inhibits");
+  assert(mate.stats.inhibitsForwarded.load() == 1 && mate.stats.doInhibitUS.count() == 1,
+         "Counts and times inhibits forwarded to an interface");
+  assert(mate.stats.dbusMessages.load() > 0, "Counts D-Bus messages");
+
+  bool unsupported = false;
+  statsSession.runInThread([&]{
+    try { stats.inhibit({InhibitType::SCREENSAVER, "a", "b"}); }
+    catch (InhibitRequestUnsupportedTypeException& e) { unsupported = true; }
+  });
+  assert(unsupported && stats.stats.forwardFailures.load() == 0,
+         "Unsupported inhibit types aren't counted as forward failures");
+
+  const char* iface = "org.unifiedinhibit.Stats";
+  const char* prop = "Stats";
+  auto reply = dbus.newMethodCall("org.unifiedinhibit.Stats", "/org/unifiedinhibit/Stats",
+                                  "org.freedesktop.DBus.Properties", "Get")
+    .appendArgs(DBUS_TYPE_STRING, &iface, DBUS_TYPE_STRING, &prop, DBUS_TYPE_INVALID)
+    ->sendAwait(200);
+
+  auto parsed = parseStats(reply);
+  assert(!reply.isNull() && parsed.contains("org.mate.ScreenSaver") && parsed.size() == 1,
+         "Stats property lists every other interface");
+  assert(parsed["org.mate.ScreenSaver"]["inhibits_received"] == 1 &&
+         parsed["org.mate.ScreenSaver"]["do_inhibit_us_count"] == 1,
+         "Stats property carries counters and histograms");
+
+  unlink("/tmp/uitest-stats/stats");
+  StatsInhibitInterface::requestDump();
+  assert(statsSession.waitUntil([]{ return access("/tmp/uitest-stats/stats", F_OK) == 0; }),
+         "requestDump() writes stats to a file");
+  unlink("/tmp/uitest-stats/stats");
+  rmdir("/tmp/uitest-stats");
+
+  // Without XDG_RUNTIME_DIR these go under /tmp, where someone else could get there first
+  mkdir("/tmp/uitest-shared", 0755);
+  mkdir("/tmp/uitest-private", 0700);
+  symlink("/tmp/uitest-private", "/tmp/uitest-link");
+  assert(!privateDir("/tmp/uitest-shared") && !privateDir("/tmp/uitest-link") &&
+         privateDir("/tmp/uitest-private"),
+         "Only directories that are ours alone (and not symlinks) are used");
+
+  FILE* victim = fopen("/tmp/uitest-victim", "w");
+  fputs("precious", victim);
+  fclose(victim);
+  symlink("/tmp/uitest-victim", "/tmp/uitest-private/stats.tmp");
+  int fd = exclusiveCreate("/tmp/uitest-private/stats.tmp");
+  struct stat st = {};
+  lstat("/tmp/uitest-private/stats.tmp", &st);
+  struct stat victimSt = {};
+  stat("/tmp/uitest-victim", &victimSt);
+  assert(fd >= 0 && victimSt.st_size == 8 && S_ISREG(st.st_mode),
+         "Files we create replace planted symlinks rather than following them");
+  if (fd >= 0) close(fd);
+
+  unlink("/tmp/uitest-private/stats.tmp");
+  unlink("/tmp/uitest-victim");
+  unlink("/tmp/uitest-link");
+  rmdir("/tmp/uitest-private");
+  rmdir("/tmp/uitest-shared");
+
+  mateSession.runInThread([&]{ mate.unInhibit(forwarded.id); });
+}
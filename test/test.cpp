@@ -10,29 +10,12 @@
 #include <chrono>
 #include "assertions.hpp"
 #include "testutils.hpp"
+#include "dbusDaemon.hpp"
 using namespace uinhibit;
 
-std::vector<int> dbusPIDs;
-// kills daemon after 30 seconds to handle corner-cases that can leave dbus-daemon running
-void startDbusDaemon() {
-  auto pid = fork();
-
-  if (pid == 0) {
-    setpgid(getpid(), getpid());
-    if (system("dbus-daemon --config-file=test/dbus.conf --address='unix:path=/tmp/uitest.sock'"
-               " 1>/dev/null 2>/dev/null &"
-               " export DDPID=$! && sleep 30 && kill $DDPID") == -1) {
-      printf("Failed to spool up local dbus-daemon (do you have dbus-daemon?)\n");
-      exit(1);
-    };
-    _exit(0);
-  }
-  dbusPIDs.push_back(pid);
-}
-
 void exitHandler() {
   printResults();
-  for(auto pid : dbusPIDs) kill(-pid, SIGKILL);
+  stopDbusDaemons();
 }
 
 int main() {
@@ -46,9 +29,7 @@ int main() {
     exit(1);
   };
 
-  startDbusDaemon();
-
-  usleep(200*1000); // give dbus-daemon a chance to start
+  startDbusDaemon("unix:path=/tmp/uitest.sock", 30);
 
   DBus dbus(DBUS_BUS_SESSION);
 
@@ -1,6 +1,5 @@
 #pragma once
 #include <chrono>
-using namespace std::chrono_literals;
 using namespace uinhibit;
 
 static uint64_t pass = 0, fail = 0;
@@ -48,48 +47,89 @@ class UnQuiet {
     }
 };
 
-// Runs the inhibitor in a thread until out of scope
+// Runs the inhibitor in a thread until out of scope.
+//
+// The thread only resumes start() when something it waits for is ready (D-Bus traffic, timers,
+// wake()), same as uinhibitd's main loop. Work handed to it and waitUntil() predicates run on that
+// thread between resumes, so they see the same state as callbacks without racing them.
 class InhibitInterfaceSession {
   public:
-    InhibitInterfaceSession(InhibitInterface* i) : tr(&InhibitInterfaceSession::runInhibitInterfaceThread, this, i) {}
-    ~InhibitInterfaceSession() { std::unique_lock<std::mutex> lk(stopMutex); stop = true; }
-    std::jthread tr;
+    InhibitInterfaceSession(InhibitInterface* i) :
+      i(i), tr(&InhibitInterfaceSession::runInhibitInterfaceThread, this) {}
 
-    // Blocking. Will be slow as we're waiting on mainloop polling.
-    void runInThread(std::function<void()> stuff) {
-      runme = &stuff;
+    ~InhibitInterfaceSession() {
       {
-        std::unique_lock<std::mutex> lk(runmeMutex);
-        runmeCV.wait_for(lk, 100ms, [this]{ return runme == nullptr; });
+        std::unique_lock<std::mutex> lk(mutex);
+        stop = true;
       }
+      this->poke();
+    }
+
+    // Blocking, until stuff has run
+    void runInThread(std::function<void()> stuff) {
+      std::unique_lock<std::mutex> lk(mutex);
+      runme = &stuff;
+      this->poke();
+      cv.wait(lk, [this]{ return runme == nullptr; });
+    }
+
+    // Blocks until pred() is true or timeoutMS passes. pred() is checked right away and after
+    // every resume, so this returns as soon as whatever we're waiting for has been handled.
+    bool waitUntil(std::function<bool()> pred, int64_t timeoutMS = 2000) {
+      std::unique_lock<std::mutex> lk(mutex);
+      until = &pred;
+      untilMet = false;
+      this->poke();
+      cv.wait_for(lk, std::chrono::milliseconds(timeoutMS), [this]{ return until == nullptr; });
+      until = nullptr;
+      return untilMet;
     }
 
-    std::mutex runmeMutex;
-    std::condition_variable runmeCV;
-    std::function<void()>* runme = nullptr;
+  private:
+    InhibitInterface* i;
 
-    std::mutex stopMutex;
-    bool stop = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::function<void()>* runme = nullptr; // under mutex
+    std::function<bool()>* until = nullptr; // under mutex
+    bool untilMet = false; // under mutex
+    bool stop = false; // under mutex
 
-    void runInhibitInterfaceThread(InhibitInterface* i) {
+    // Last, so it's joined before anything the thread uses is destroyed
+    std::jthread tr;
+
+    void poke() {
+      i->wake();
+      cv.notify_all();
+    }
+
+    void runInhibitInterfaceThread() {
       auto ro = i->start();
-      while(1) {
-        {
-          std::unique_lock<std::mutex> lk(stopMutex);
-          if (stop) break;
-        }
 
-        ro.handle.resume();
+      std::unique_lock<std::mutex> lk(mutex);
+      while (!stop) {
+        if (runme != nullptr) {
+          (*runme)();
+          runme = nullptr;
+          cv.notify_all();
+        }
 
-        {
-          std::unique_lock<std::mutex> lk(runmeMutex);
-          if (runme != nullptr) {
-            (*runme)();
-            runme = nullptr;
-            runmeCV.notify_all();
-          }
+        if (until != nullptr && (*until)()) {
+          untilMet = true;
+          until = nullptr;
+          cv.notify_all();
         }
         fflush(stdout);
+
+        // Nothing left to resume, just serve runInThread()/waitUntil()
+        if (ro.handle.done()) {
+          cv.wait(lk);
+          continue;
+        }
+
+        lk.unlock();
+        if (i->waitSet.ready(-1)) ro.handle.resume();
+        lk.lock();
       }
     }
 };
@@ -0,0 +1,230 @@
+#pragma once
+#include "testutils.hpp"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+using namespace uinhibit;
+
+#define XIDLEHOOK_TEST_SOCKET "/tmp/uitest-xidlehook.sock"
+
+// A Message::Control as xidlehook's socket deserializes it
+struct XidlehookControl {
+  std::string action; // Enable, Disable, Trigger or Delete
+  std::string timer;  // The Filter as sent: "Any" or {"Selected":[...]}
+};
+
+// Parses msg (without its NUL) the way xidlehook would, with both fields required and in any
+// order. False for anything xidlehook would reply with an Error to.
+static bool parseXidlehookControl(std::string_view msg, XidlehookControl& out) {
+  std::string s; // msg without whitespace outside of strings
+  bool inString = false;
+  for (size_t i = 0; i < msg.size(); i++) {
+    if (msg[i] == '"' && (i == 0 || msg[i-1] != '\\')) inString = !inString;
+    if (inString || !isspace(msg[i])) s.push_back(msg[i]);
+  }
+
+  const std::string prefix = "{\"Control\":{", suffix = "}}";
+  if (!s.starts_with(prefix) || !s.ends_with(suffix) || s.size() < prefix.size()+suffix.size())
+    return false;
+  std::string_view fields(s.data()+prefix.size(), s.size()-prefix.size()-suffix.size());
+
+  std::map<std::string, std::string> values;
+  inString = false;
+  int32_t depth = 0;
+  size_t start = 0;
+  for (size_t i = 0; i <= fields.size(); i++) {
+    if (i < fields.size() && fields[i] == '"') inString = !inString;
+    if (inString) continue;
+    if (i < fields.size() && (fields[i] == '{' || fields[i] == '[')) depth++;
+    if (i < fields.size() && (fields[i] == '}' || fields[i] == ']')) depth--;
+    if (i < fields.size() && (fields[i] != ',' || depth > 0)) continue;
+
+    std::string_view field = fields.substr(start, i-start);
+    size_t colon = field.find(':');
+    if (colon == std::string_view::npos || colon < 2 || field[0] != '"') return false;
+    values[std::string(field.substr(1, colon-2))] = field.substr(colon+1);
+    start = i+1;
+  }
+
+  if (values.size() != 2 || !values.contains("action") || !values.contains("timer")) return false;
+
+  std::string action = values["action"];
+  if (action != "\"Enable\"" && action != "\"Disable\"" && action != "\"Trigger\"" &&
+      action != "\"Delete\"") return false;
+
+  std::string timer = values["timer"];
+  if (timer != "\"Any\"" && !(timer.starts_with("{\"Selected\":[") && timer.ends_with("]}")))
+    return false;
+
+  out = {action.substr(1, action.size()-2), timer};
+  return true;
+}
+
+// Stands in for xidlehook's socket. Records every Control sent to it, replying like xidlehook
+// does ("Empty", or {"Error":"..."} for anything it can't parse, NUL-terminated). With hangUp it
+// closes each connection after replying, like a server that doesn't keep connections around.
+class XidlehookStub {
+  public:
+    XidlehookStub(bool hangUp) : hangUp(hangUp) {
+      unlink(XIDLEHOOK_TEST_SOCKET);
+      sockaddr_un addr = {};
+      addr.sun_family = AF_UNIX;
+      strcpy(addr.sun_path, XIDLEHOOK_TEST_SOCKET);
+      listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      bind(listenFd, (sockaddr*)&addr, sizeof(addr));
+      listen(listenFd, 4);
+      tr = std::jthread(&XidlehookStub::serve, this);
+    }
+
+    ~XidlehookStub() {
+      stop = true;
+      tr.join();
+      for (auto fd : clients) close(fd);
+      close(listenFd);
+      unlink(XIDLEHOOK_TEST_SOCKET);
+    }
+
+    std::vector<XidlehookControl> received() {
+      std::unique_lock<std::mutex> lk(mutex);
+      return controls;
+    }
+
+    // Waits up to timeoutMS for n controls to have arrived
+    std::vector<XidlehookControl> awaitReceived(size_t n, int64_t timeoutMS = 2000) {
+      std::unique_lock<std::mutex> lk(mutex);
+      cv.wait_for(lk, std::chrono::milliseconds(timeoutMS),
+                  [this, n]{ return controls.size() >= n; });
+      return controls;
+    }
+
+    uint32_t errors() {
+      std::unique_lock<std::mutex> lk(mutex);
+      return errorCount;
+    }
+
+  private:
+    bool hangUp;
+    int32_t listenFd = -1;
+    std::vector<int32_t> clients;
+    std::atomic<bool> stop = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<XidlehookControl> controls; // under mutex
+    uint32_t errorCount = 0; // under mutex, messages we replied to with an Error
+    std::jthread tr;
+
+    void serve() {
+      std::unordered_map<int32_t, std::string> bufs;
+      while (!stop) {
+        std::vector<pollfd> fds = {{listenFd, POLLIN, 0}};
+        for (auto fd : clients) fds.push_back({fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), 10) <= 0) continue;
+
+        if (fds[0].revents & POLLIN)
+          clients.push_back(accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC));
+
+        for (size_t i = 1; i < fds.size(); i++) {
+          if (!fds[i].revents) continue;
+          int32_t fd = fds[i].fd;
+          char buf[256];
+          ssize_t r = read(fd, buf, sizeof(buf));
+          bool done = (r <= 0);
+          if (r > 0) bufs[fd].append(buf, r);
+
+          size_t nul;
+          std::vector<XidlehookControl> got;
+          uint32_t bad = 0;
+          while (!done && (nul = bufs[fd].find('\0')) != std::string::npos) {
+            XidlehookControl control;
+            std::string reply = "\"Empty\"";
+            if (parseXidlehookControl(std::string_view(bufs[fd]).substr(0, nul), control)) {
+              got.push_back(control);
+            } else {
+              reply = "{\"Error\":\"invalid message\"}";
+              bad++;
+            }
+            bufs[fd].erase(0, nul+1);
+
+            reply.push_back('\0');
+            if (send(fd, reply.data(), reply.size(), MSG_NOSIGNAL) != (ssize_t)reply.size() ||
+                hangUp) done = true;
+          }
+
+          if (done) {
+            close(fd);
+            bufs.erase(fd);
+            std::erase(clients, fd);
+          }
+
+          // Only once we've hung up, so whoever awaits these can't race it with their next send
+          std::unique_lock<std::mutex> lk(mutex);
+          for (auto& control : got) controls.push_back(control);
+          errorCount += bad;
+          cv.notify_all();
+        }
+      }
+    }
+};
+
+static void xidlehookAssertions() {
+  XidlehookControl control;
+  bool selected = parseXidlehookControl(
+    "{ \"Control\": {\"timer\": {\"Selected\": [0, 1]}, \"action\": \"Enable\"} }", control);
+  assert(selected && control.action == "Enable" && control.timer == "{\"Selected\":[0,1]}" &&
+         !parseXidlehookControl("{\"Control\":{\"action\":\"Disable\"}}", control),
+         "The stub parses Controls like xidlehook does");
+
+  auto isAll = [](const XidlehookControl& c, const char* action) {
+    return c.action == action && c.timer == "\"Any\"";
+  };
+  InhibitRequest req = {InhibitType::SCREENSAVER, "appname", "reason"};
+
+  bool except = false;
+  try {
+    Quiet q;
+    unlink(XIDLEHOOK_TEST_SOCKET);
+    XidlehookInhibitInterface i([](auto a, auto b){}, [](auto a, auto b){}, XIDLEHOOK_TEST_SOCKET);
+    InhibitInterfaceSession session(&i);
+    session.runInThread([&]{ i.unInhibit(i.inhibit(req).id); });
+  } catch(...) { except = true; }
+  assert(!except, "No exceptions when xidlehook isn't running");
+
+  for (int j = 0; j < 2; j++) {
+    Quiet q;
+    bool hangUp = (j == 1);
+    std::string mode = hangUp ? "Server hangs up after each reply" : "Persistent connection";
+
+    auto stub = std::make_unique<XidlehookStub>(hangUp);
+    XidlehookInhibitInterface i([](auto a, auto b){}, [](auto a, auto b){}, XIDLEHOOK_TEST_SOCKET);
+    InhibitInterfaceSession session(&i);
+
+    Inhibit in;
+    session.runInThread([&]{ in = i.inhibit(req); });
+    auto got = stub->awaitReceived(1);
+    assert(got.size() == 1 && isAll(got[0], "Disable"),
+           mode+": Sends Disable when screensaver becomes inhibited");
+
+    session.runInThread([&]{ i.unInhibit(in.id); });
+    got = stub->awaitReceived(2);
+    assert(got.size() == 2 && isAll(got[1], "Enable"),
+           mode+": Sends Enable when screensaver is no longer inhibited");
+
+    // Anything sent for the suspend inhibit would arrive before the Disable that follows it
+    session.runInThread([&]{ in = i.inhibit({InhibitType::SUSPEND, "appname", "reason"}); });
+    session.runInThread([&]{ i.unInhibit(in.id); });
+    session.runInThread([&]{ in = i.inhibit(req); });
+    got = stub->awaitReceived(3);
+    assert(got.size() == 3 && isAll(got[2], "Disable"), mode+": Ignores suspend inhibits");
+    session.runInThread([&]{ i.unInhibit(in.id); });
+    stub->awaitReceived(4);
+    assert(stub->errors() == 0, mode+": Nothing we send gets an Error back");
+
+    // xidlehook restarted under us
+    stub.reset();
+    stub = std::make_unique<XidlehookStub>(hangUp);
+    session.runInThread([&]{ in = i.inhibit(req); });
+    got = stub->awaitReceived(1);
+    assert(got.size() == 1 && isAll(got[0], "Disable"),
+           mode+": Reconnects when xidlehook is restarted");
+  }
+}